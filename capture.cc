@@ -0,0 +1,232 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <mutex>
+#include <thread>
+
+namespace capture {
+
+bool enabled = false;
+
+namespace {
+
+/* Single-writer, single-reader ring. The owning thread fills the slots from
+   `head` while they're free of the reader's `tail`, then publishes them by
+   advancing `head`; the flush thread copies up to `head` and then frees them
+   by advancing `tail`.
+*/
+struct Ring {
+  std::atomic<uint64_t> head{0};
+  std::atomic<uint64_t> tail{0};
+  // Set once its thread has exited; it's reused once drained.
+  std::atomic<bool> retired{false};
+  CaptureRecord records[CAPTURE_RING];
+};
+
+int fd = -1;
+uint64_t startNs;
+std::atomic<uint32_t> lastConnection{0};
+std::atomic<uint64_t> written{0};
+std::atomic<uint64_t> dropped{0};
+std::mutex mu;
+std::vector<Ring *> live;
+std::vector<Ring *> spare;
+thread_local Ring *tlsRing = nullptr;
+
+struct Registration {
+  Ring *ring = nullptr;
+  ~Registration() {
+    if (ring != nullptr) {
+      ring->retired.store(true, std::memory_order_release);
+    }
+  }
+};
+thread_local Registration registration;
+
+Ring *registerThread() {
+  std::lock_guard<std::mutex> lock(mu);
+  Ring *ring;
+  if (!spare.empty()) {
+    ring = spare.back();
+    spare.pop_back();
+    ring->retired.store(false, std::memory_order_relaxed);
+  } else {
+    ring = new Ring();
+  }
+  live.push_back(ring);
+  registration.ring = ring;
+  tlsRing = ring;
+  return ring;
+}
+
+// pwrite()/pread() all `size` bytes at `offset`, or fail.
+bool writeAll(int fd, const void *buf, size_t size, off_t offset) {
+  for (size_t done = 0; done < size;) {
+    const ssize_t n = pwrite(fd, (const char *)buf + done, size - done,
+                             offset + done);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+bool readAll(int fd, void *buf, size_t size, off_t offset) {
+  for (size_t done = 0; done < size;) {
+    const ssize_t n = pread(fd, (char *)buf + done, size - done,
+                            offset + done);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Move what `ring` holds to the end of `out`. Returns false if it's retired
+// and now empty.
+bool drain(Ring &ring, std::vector<CaptureRecord> &out) {
+  // Read before `head`, so that a retired ring's last records are drained.
+  const bool retired = ring.retired.load(std::memory_order_acquire);
+  const uint64_t head = ring.head.load(std::memory_order_acquire);
+  const uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  for (uint64_t i = tail; i < head; ++i) {
+    out.push_back(ring.records[i % CAPTURE_RING]);
+  }
+  ring.tail.store(head, std::memory_order_release);
+  return !retired;
+}
+
+void t_flush() {
+  std::vector<CaptureRecord> batch;
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_FLUSH_MS));
+    batch.clear();
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      for (auto it = live.begin(); it != live.end();) {
+        if (drain(**it, batch)) {
+          ++it;
+        } else {
+          spare.push_back(*it);
+          it = live.erase(it);
+        }
+      }
+    }
+    if (batch.empty()) {
+      continue;
+    }
+    const size_t size = batch.size() * sizeof(CaptureRecord);
+    if (!writeAll(fd, batch.data(), size,
+                  sizeof(CaptureHeader) + written * sizeof(CaptureRecord))) {
+      perror("capture write");
+      return;
+    }
+    written += batch.size();
+  }
+}
+
+}  // namespace
+
+uint32_t connection() { return lastConnection++; }
+
+void recordSlow(uint32_t connection, const std::vector<LReq> &lreqs) {
+  Ring *ring = tlsRing != nullptr ? tlsRing : registerThread();
+  const uint64_t head = ring->head.load(std::memory_order_relaxed);
+  const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+  if (head + lreqs.size() - tail > CAPTURE_RING) {
+    dropped++;
+    return;
+  }
+  const uint64_t ns = nowNs() - startNs;
+  for (size_t i = 0; i < lreqs.size(); ++i) {
+    ring->records[(head + i) % CAPTURE_RING] = CaptureRecord{
+        ns,
+        lreqs[i].offset,
+        lreqs[i].size,
+        connection,
+        uint32_t(lreqs.size() - 1 - i),
+        lreqs[i].flags & (LREQ_BULK | LREQ_SPARSE),
+        0};
+  }
+  ring->head.store(head + lreqs.size(), std::memory_order_release);
+}
+
+std::string format() {
+  char lines[128];
+  snprintf(lines, sizeof(lines),
+           "capture_records %" PRIu64 "\ncapture_dropped %" PRIu64 "\n",
+           written.load(), dropped.load());
+  return lines;
+}
+
+bool start(const char *path) {
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("capture open");
+    return false;
+  }
+  const CaptureHeader header = {CAPTURE_MAGIC, CAPTURE_VERSION,
+                                sizeof(CaptureRecord), 0};
+  if (!writeAll(fd, &header, sizeof(header), 0)) {
+    perror("capture write");
+    return false;
+  }
+  startNs = nowNs();
+  enabled = true;
+  std::thread(t_flush).detach();
+  return true;
+}
+
+bool load(const char *path, std::vector<CaptureRecord> &records) {
+  const int in = open(path, O_RDONLY);
+  if (in == -1) {
+    perror("capture open");
+    return false;
+  }
+  struct stat st;
+  CaptureHeader header;
+  bool ok = fstat(in, &st) == 0 && st.st_size >= off_t(sizeof(header)) &&
+            readAll(in, &header, sizeof(header), 0);
+  if (!ok || header.magic != CAPTURE_MAGIC ||
+      header.version != CAPTURE_VERSION ||
+      header.recordSize != sizeof(CaptureRecord)) {
+    fprintf(stderr, "%s is not a capture\n", path);
+    close(in);
+    return false;
+  }
+  // A capture cut short by the server's exit may end mid-record.
+  records.resize((st.st_size - sizeof(header)) / sizeof(CaptureRecord));
+  const size_t size = records.size() * sizeof(CaptureRecord);
+  ok = readAll(in, records.data(), size, sizeof(header));
+  close(in);
+  if (!ok) {
+    fprintf(stderr, "failed to read %s\n", path);
+    return false;
+  }
+  // A request's ranges are contiguous and share a time.
+  std::stable_sort(records.begin(), records.end(),
+                   [](const CaptureRecord &a, const CaptureRecord &b) {
+                     return a.ns < b.ns;
+                   });
+  return true;
+}
+
+}  // namespace capture
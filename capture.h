@@ -0,0 +1,85 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+/*
+  Capture of the read requests a server receives, for replay by seek-client.
+
+  After start(), each receiving thread appends a record per range of every
+  request to a ring of its own. A ring has one writer and one reader and no
+  locks, so recording costs a clock read and a few stores. A thread drains
+  every ring to the file each CAPTURE_FLUSH_MS. A request that finds its ring
+  full is dropped from the capture rather than waited for, and counted. A
+  request's ranges are published together, so a flush never splits one.
+
+  The file is a CaptureHeader, then CaptureRecords in the order they were
+  flushed, ring by ring. load() sorts them by time, keeping each request's
+  ranges together.
+
+  Fibers can move between threads, but one records a request without
+  yielding, so it uses a single ring throughout.
+*/
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "wire.h"
+
+constexpr uint32_t CAPTURE_MAGIC = 0x50414353;  // "SCAP"
+constexpr uint32_t CAPTURE_VERSION = 1;
+// Records each thread's ring holds.
+constexpr size_t CAPTURE_RING = 8192;
+constexpr unsigned CAPTURE_FLUSH_MS = 10;
+
+struct CaptureHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t reserved;
+};
+
+// One range of a request, in host byte order.
+struct CaptureRecord {
+  // When the request was received, since the capture started.
+  uint64_t ns;
+  int64_t offset;
+  uint64_t size;
+  // The connection it came on, numbered from 0 as they start.
+  uint32_t connection;
+  // Ranges of the same request after this one.
+  uint32_t more;
+  // Its LReq flags, LREQ_BULK and LREQ_SPARSE.
+  uint32_t flags;
+  uint32_t reserved;
+};
+static_assert(sizeof(CaptureRecord) == 40, "CaptureRecord is on disk");
+
+namespace capture {
+
+extern bool enabled;
+
+// A number for a new connection.
+uint32_t connection();
+
+void recordSlow(uint32_t connection, const std::vector<LReq> &lreqs);
+
+// Record a read request, its ranges in response order.
+inline void record(uint32_t connection, const std::vector<LReq> &lreqs) {
+  if (enabled) {
+    recordSlow(connection, lreqs);
+  }
+}
+
+// Records written and requests dropped, one "name value" per line.
+std::string format();
+
+// Start capturing to `path`, replacing it. Returns false on error, having
+// reported it. Call from main() before starting any other thread.
+bool start(const char *path);
+
+// Read the capture at `path` into `records`, sorted by time. Returns false
+// on error, having reported it.
+bool load(const char *path, std::vector<CaptureRecord> &records);
+
+}  // namespace capture
+#endif
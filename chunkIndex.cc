@@ -0,0 +1,150 @@
+#include "chunkIndex.h"
+
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace {
+
+// Cut where the top 14 bits of the Gear hash are zero: one chance in 16 KiB
+// per byte past MIN_CHUNK.
+constexpr uint64_t CUT_MASK = ((1ull << 14) - 1) << 50;
+
+const char MAGIC[8] = "CHUNKS1";
+
+struct Header {
+  char magic[8];
+  uint64_t fileSize;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+  uint64_t count;
+};
+
+// Random per-byte values for the Gear hash, from a fixed splitmix64 sequence
+// so every build agrees.
+struct GearTable {
+  uint64_t values[256];
+  GearTable() {
+    uint64_t x = 0x6a09e667f3bcc908ull;
+    for (auto &v : values) {
+      x += 0x9e3779b97f4a7c15ull;
+      uint64_t z = x;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      v = z ^ (z >> 31);
+    }
+  }
+};
+const GearTable gear;
+
+// Length of the chunk starting at `data`, which has `size` bytes left.
+size_t cut(const uint8_t *data, size_t size) {
+  if (size <= MIN_CHUNK) {
+    return size;
+  }
+  const size_t limit = std::min(size, MAX_CHUNK);
+  uint64_t fp = 0;
+  // Bytes before MIN_CHUNK - 64 can't affect the hash at any allowed cut.
+  for (size_t i = MIN_CHUNK - 64; i < limit; ++i) {
+    fp = (fp << 1) + gear.values[data[i]];
+    if (i >= MIN_CHUNK && (fp & CUT_MASK) == 0) {
+      return i + 1;
+    }
+  }
+  return limit;
+}
+
+}  // namespace
+
+bool ChunkIndex::build(int fd, off_t size) {
+  chunks_.clear();
+  if (size == 0) {
+    return true;
+  }
+  void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("chunk index mmap");
+    return false;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  const uint8_t *data = static_cast<const uint8_t *>(map);
+  for (uint64_t offset = 0; offset < uint64_t(size);) {
+    Chunk chunk;
+    chunk.offset = offset;
+    chunk.size = cut(data + offset, size - offset);
+    SHA256(data + offset, chunk.size, chunk.hash.data());
+    chunks_.push_back(chunk);
+    offset += chunk.size;
+  }
+  munmap(map, size);
+  return true;
+}
+
+bool ChunkIndex::open(const char *path, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror("chunk index fstat");
+    return false;
+  }
+  const std::string indexPath = std::string(path) + ".chunks";
+  if (load(indexPath, st)) {
+    return true;
+  }
+  if (!build(fd, st.st_size)) {
+    return false;
+  }
+  save(indexPath, st);
+  return true;
+}
+
+bool ChunkIndex::load(const std::string &indexPath, const struct stat &st) {
+  FILE *f = fopen(indexPath.c_str(), "r");
+  if (f == nullptr) {
+    return false;
+  }
+  Header header;
+  bool valid = fread(&header, sizeof(header), 1, f) == 1 &&
+               memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+               header.fileSize == uint64_t(st.st_size) &&
+               header.mtimeSec == st.st_mtim.tv_sec &&
+               header.mtimeNsec == st.st_mtim.tv_nsec;
+  if (valid) {
+    chunks_.resize(header.count);
+    valid = fread(chunks_.data(), sizeof(Chunk), chunks_.size(), f) ==
+            chunks_.size();
+  }
+  fclose(f);
+  if (!valid) {
+    chunks_.clear();
+  }
+  return valid;
+}
+
+void ChunkIndex::save(const std::string &indexPath,
+                      const struct stat &st) const {
+  Header header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.fileSize = st.st_size;
+  header.mtimeSec = st.st_mtim.tv_sec;
+  header.mtimeNsec = st.st_mtim.tv_nsec;
+  header.count = chunks_.size();
+  // Write then rename so readers never see a partial index.
+  const std::string tmp = indexPath + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (f == nullptr) {
+    perror("chunk index fopen");
+    return;
+  }
+  const bool written =
+      fwrite(&header, sizeof(header), 1, f) == 1 &&
+      fwrite(chunks_.data(), sizeof(Chunk), chunks_.size(), f) ==
+          chunks_.size();
+  if (fclose(f) != 0 || !written || rename(tmp.c_str(), indexPath.c_str())) {
+    perror("chunk index write");
+    unlink(tmp.c_str());
+  }
+}
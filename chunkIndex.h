@@ -0,0 +1,63 @@
+#ifndef CHUNKINDEX_H
+#define CHUNKINDEX_H
+/*
+  Content-defined chunk index for delta transfers.
+
+  A file is cut into chunks where a Gear rolling hash of the preceding bytes
+  matches a mask, so boundaries move with the content: an insertion only
+  changes the chunks around it. Chunks are between MIN_CHUNK and MAX_CHUNK
+  bytes, about 16 KiB on average. Each chunk is identified by its SHA-256.
+
+  Servers and clients must chunk identically, so the parameters are fixed
+  here rather than negotiated.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <array>
+#include <string>
+#include <vector>
+
+constexpr size_t MIN_CHUNK = 4 * 1024;
+constexpr size_t MAX_CHUNK = 64 * 1024;
+constexpr size_t HASH_SIZE = 32;
+
+using Hash = std::array<uint8_t, HASH_SIZE>;
+
+// For unordered containers keyed by Hash; the hash is already uniform.
+struct HashHasher {
+  size_t operator()(const Hash &hash) const {
+    size_t h;
+    memcpy(&h, hash.data(), sizeof(h));
+    return h;
+  }
+};
+
+struct Chunk {
+  uint64_t offset;
+  uint32_t size;
+  Hash hash;
+};
+
+class ChunkIndex {
+ public:
+  // Chunk the `size` bytes of `fd`. Returns false on error, having reported
+  // it.
+  bool build(int fd, off_t size);
+
+  // Load the index of `path`, open as `fd`, from `path`.chunks, or build it
+  // and save it there if that is missing or older than the file.
+  bool open(const char *path, int fd);
+
+  const std::vector<Chunk> &chunks() const { return chunks_; }
+
+ private:
+  bool load(const std::string &indexPath, const struct stat &st);
+  void save(const std::string &indexPath, const struct stat &st) const;
+
+  std::vector<Chunk> chunks_;
+};
+
+#endif
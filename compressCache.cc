@@ -0,0 +1,133 @@
+#include "compressCache.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <mutex>
+
+namespace {
+
+// Bytes each cached block is charged beyond its data, so incompressible
+// ones count too.
+constexpr size_t ENTRY_OVERHEAD = 128;
+
+}  // namespace
+
+CompressCache::CompressCache(unsigned threads, size_t capacity)
+    : capacity(capacity) {
+  for (unsigned i = 0; i < threads; ++i) {
+    this->threads.emplace_back(&CompressCache::t_compress, this);
+  }
+}
+
+CompressCache::~CompressCache() {
+  {
+    std::lock_guard<boost::fibers::mutex> lock(mu);
+    stopping = true;
+  }
+  queued.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+std::shared_ptr<CompressCache::Entry> CompressCache::queue(const Key &key,
+                                                           int fd) {
+  const auto it = entries.find(key);
+  if (it != entries.end()) {
+    return it->second;
+  } else if (jobs.size() >= COMPRESS_QUEUE) {
+    return nullptr;
+  }
+  std::shared_ptr<Entry> entry(new Entry());
+  entries.emplace(key, entry);
+  jobs.push_back(Job{key, fd, entry});
+  queued.notify_one();
+  return entry;
+}
+
+void CompressCache::prefetch(const Key &key, int fd) {
+  std::lock_guard<boost::fibers::mutex> lock(mu);
+  queue(key, fd);
+}
+
+std::shared_ptr<const CompressCache::Block> CompressCache::get(
+    const Key &key, int fd) {
+  std::unique_lock<boost::fibers::mutex> lock(mu);
+  const std::shared_ptr<Entry> entry = queue(key, fd);
+  if (entry == nullptr) {
+    busy++;
+    return nullptr;
+  } else if (entry->ready) {
+    hits++;
+    lru.splice(lru.begin(), lru, entry->lru);
+    return entry->block;
+  }
+  misses++;
+  done.wait(lock, [&entry]() { return entry->ready; });
+  return entry->block;
+}
+
+void CompressCache::t_compress() {
+  std::vector<uint8_t> raw(COMPRESS_BLOCK);
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<boost::fibers::mutex> lock(mu);
+      queued.wait(lock, [this]() { return stopping || !jobs.empty(); });
+      if (stopping) {
+        return;
+      }
+      job = jobs.front();
+      jobs.pop_front();
+    }
+    std::shared_ptr<Block> block(new Block());
+    const ssize_t n = pread(job.fd, raw.data(), raw.size(),
+                            job.key.block * COMPRESS_BLOCK);
+    if (n == -1) {
+      // Sent raw, so sendfile() reports the error.
+      perror("compress pread");
+    }
+    block->incompressible =
+        n <= 0 ||
+        !compressBlock(job.key.compression, raw.data(), n, block->data) ||
+        block->data.size() >= n * COMPRESS_MAX_RATIO;
+    if (block->incompressible) {
+      block->data = std::vector<uint8_t>();
+    } else {
+      block->data.shrink_to_fit();
+    }
+    {
+      std::lock_guard<boost::fibers::mutex> lock(mu);
+      (block->incompressible ? incompressible : compressed)++;
+      job.entry->block = block;
+      job.entry->ready = true;
+      job.entry->lru = lru.insert(lru.begin(), job.key);
+      bytes += block->data.size() + ENTRY_OVERHEAD;
+      // Senders still holding an evicted block keep it until they're done.
+      while (bytes > capacity && lru.size() > 1) {
+        const auto victim = entries.find(lru.back());
+        bytes -= victim->second->block->data.size() + ENTRY_OVERHEAD;
+        entries.erase(victim);
+        lru.pop_back();
+        evicted++;
+      }
+    }
+    done.notify_all();
+  }
+}
+
+std::string CompressCache::format() {
+  std::lock_guard<boost::fibers::mutex> lock(mu);
+  char lines[512];
+  snprintf(lines, sizeof(lines),
+           "compress_hits %" PRIu64 "\ncompress_misses %" PRIu64
+           "\ncompress_busy %" PRIu64 "\ncompress_blocks %" PRIu64
+           "\ncompress_incompressible %" PRIu64
+           "\ncompress_evicted %" PRIu64 "\ncompress_cached_bytes %zu\n"
+           "compress_queued %zu\n",
+           hits, misses, busy, compressed, incompressible, evicted, bytes,
+           jobs.size());
+  return lines;
+}
@@ -0,0 +1,119 @@
+#ifndef COMPRESSCACHE_H
+#define COMPRESSCACHE_H
+/*
+  Compressed blocks of served files, for compressed responses.
+
+  A pool of threads compresses blocks queued by prefetch() or get(), reading
+  them with pread(), and the results are kept keyed by file, block and
+  algorithm, so a hot block is compressed once however often it's sent.
+  Blocks that don't compress to under COMPRESS_MAX_RATIO of their size are
+  kept as incompressible, without their data, to be sent raw. The compressed
+  bytes held are bounded by the capacity; the least recently used blocks are
+  evicted first.
+
+  Receivers prefetch the blocks of each request as it's queued, so they're
+  compressed in parallel by the time it's sent. A sender that finds a block
+  neither cached nor queued, with the queue full, gets nothing and should
+  send it raw rather than wait.
+
+  Files are identified by device and inode; they mustn't change while
+  served.
+
+  Waiting uses Boost.Fiber primitives, which park a fiber and block a plain
+  thread, so one cache serves either kind of connection.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+
+#include "compression.h"
+
+// Blocks the pool may have queued at once.
+constexpr size_t COMPRESS_QUEUE = 4096;
+
+class CompressCache {
+ public:
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+    uint64_t block;
+    Compression compression;
+
+    bool operator==(const Key &other) const {
+      return dev == other.dev && ino == other.ino && block == other.block &&
+             compression == other.compression;
+    }
+  };
+  struct Block {
+    bool incompressible = false;
+    std::vector<uint8_t> data;
+  };
+
+  CompressCache(unsigned threads, size_t capacity);
+  ~CompressCache();
+
+  // Queue block `key.block` of `fd`, the file `key` names, for compression
+  // unless it's cached or queued, or the queue is full.
+  void prefetch(const Key &key, int fd);
+  // The block, waiting for it to be compressed if need be, or null if the
+  // queue is too full to take it.
+  std::shared_ptr<const Block> get(const Key &key, int fd);
+
+  // Cache and pool statistics, one "name value" per line.
+  std::string format();
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      return std::hash<uint64_t>()(key.ino * 31 + key.dev) ^
+             std::hash<uint64_t>()(key.block * 4 + uint64_t(key.compression));
+    }
+  };
+  struct Entry {
+    bool ready = false;
+    std::shared_ptr<Block> block;
+    std::list<Key>::iterator lru;
+  };
+  struct Job {
+    Key key;
+    int fd;
+    std::shared_ptr<Entry> entry;
+  };
+
+  // Queue `key` unless it's known; the lock is held. Returns its entry, or
+  // null if the queue is full.
+  std::shared_ptr<Entry> queue(const Key &key, int fd);
+  void t_compress();
+
+  const size_t capacity;
+  boost::fibers::mutex mu;
+  // Signalled when a job is queued, and when one is done.
+  boost::fibers::condition_variable queued;
+  boost::fibers::condition_variable done;
+  std::unordered_map<Key, std::shared_ptr<Entry>, KeyHash> entries;
+  // Ready entries, most recently used first.
+  std::list<Key> lru;
+  std::deque<Job> jobs;
+  size_t bytes = 0;
+  bool stopping = false;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t busy = 0;
+  uint64_t compressed = 0;
+  uint64_t incompressible = 0;
+  uint64_t evicted = 0;
+  std::vector<std::thread> threads;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include "compression.h"
+
+#include <string.h>
+
+#include <lz4.h>
+#include <zstd.h>
+
+namespace {
+
+// zstd contexts hold its tables; one per thread avoids rebuilding them for
+// every block.
+struct ZstdContexts {
+  ZSTD_CCtx *compress = nullptr;
+  ZSTD_DCtx *decompress = nullptr;
+  ~ZstdContexts() {
+    ZSTD_freeCCtx(compress);
+    ZSTD_freeDCtx(decompress);
+  }
+};
+thread_local ZstdContexts zstd;
+
+}  // namespace
+
+bool parseCompression(const char *name, Compression &compression) {
+  if (strcmp(name, "lz4") == 0) {
+    compression = Compression::LZ4;
+  } else if (strcmp(name, "zstd") == 0) {
+    compression = Compression::ZSTD;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *compressionName(Compression compression) {
+  switch (compression) {
+    case Compression::LZ4:
+      return "lz4";
+    case Compression::ZSTD:
+      return "zstd";
+    default:
+      return "none";
+  }
+}
+
+bool compressBlock(Compression compression, const uint8_t *src, size_t size,
+                   std::vector<uint8_t> &out) {
+  if (compression == Compression::LZ4) {
+    out.resize(LZ4_compressBound(size));
+    const int n = LZ4_compress_default(reinterpret_cast<const char *>(src),
+                                       reinterpret_cast<char *>(out.data()),
+                                       size, out.size());
+    if (n <= 0) {
+      return false;
+    }
+    out.resize(n);
+    return true;
+  } else if (compression == Compression::ZSTD) {
+    if (zstd.compress == nullptr &&
+        (zstd.compress = ZSTD_createCCtx()) == nullptr) {
+      return false;
+    }
+    out.resize(ZSTD_compressBound(size));
+    const size_t n = ZSTD_compressCCtx(zstd.compress, out.data(), out.size(),
+                                       src, size, ZSTD_LEVEL);
+    if (ZSTD_isError(n)) {
+      return false;
+    }
+    out.resize(n);
+    return true;
+  }
+  return false;
+}
+
+long decompressBlock(Compression compression, const uint8_t *src,
+                     size_t size, uint8_t *dst, size_t capacity) {
+  if (compression == Compression::LZ4) {
+    const int n = LZ4_decompress_safe(reinterpret_cast<const char *>(src),
+                                      reinterpret_cast<char *>(dst), size,
+                                      capacity);
+    return n < 0 ? -1 : n;
+  } else if (compression == Compression::ZSTD) {
+    if (zstd.decompress == nullptr &&
+        (zstd.decompress = ZSTD_createDCtx()) == nullptr) {
+      return -1;
+    }
+    const size_t n =
+        ZSTD_decompressDCtx(zstd.decompress, dst, capacity, src, size);
+    return ZSTD_isError(n) ? -1 : long(n);
+  }
+  return -1;
+}
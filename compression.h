@@ -0,0 +1,40 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+/*
+  Block compression for compressed responses; see COMPRESSED in wire.h.
+
+  A file is compressed in COMPRESS_BLOCK-aligned blocks, each on its own, so
+  any block can be sent, cached or decompressed without its neighbours. The
+  last block is cut at the end of the file.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+constexpr size_t COMPRESS_BLOCK = 64 * 1024;
+// A block that doesn't compress to less than this fraction of its size is
+// sent raw instead.
+constexpr double COMPRESS_MAX_RATIO = 0.875;
+constexpr int ZSTD_LEVEL = 1;
+
+// Algorithms, as negotiated on the wire.
+enum class Compression : uint32_t { NONE = 0, LZ4 = 1, ZSTD = 2 };
+
+// Parse "lz4" or "zstd". Returns false for anything else.
+bool parseCompression(const char *name, Compression &compression);
+const char *compressionName(Compression compression);
+
+// Compress `size` bytes at `src`, at most COMPRESS_BLOCK, into `out`.
+// Returns false on error.
+bool compressBlock(Compression compression, const uint8_t *src, size_t size,
+                   std::vector<uint8_t> &out);
+
+// Decompress the `size` bytes at `src` into at most `capacity` bytes at
+// `dst`. Returns the decompressed size, or -1 if `src` is corrupt or too
+// large.
+long decompressBlock(Compression compression, const uint8_t *src,
+                     size_t size, uint8_t *dst, size_t capacity);
+
+#endif
@@ -0,0 +1,614 @@
+/*
+  A TCP proxy that puts an emulated network between a client and a server,
+  without root, tc or netem, so that pipelining and readahead can be
+  measured at round-trip times loopback doesn't have.
+
+  Listens on port PROXY_PORT, or -p PORT, and forwards each connection to
+  TARGET's port 9999, or the port TARGET gives, e.g.:
+
+    delay-proxy -d 10 -b 12500000 127.0.0.1 &
+    seek-client -D -o out -n 4 127.0.0.1:9998
+
+  Each direction behaves like a link with a one-way delay of -d MS, so the
+  round trip takes twice that, plus up to -j MS of jitter drawn per segment.
+  Jitter never reorders bytes: a segment waits for the one before it, as
+  TCP would. With -b RATE, each direction carries at most RATE bytes per
+  second, shared by all connections as one link would be, behind a queue of
+  LINK_QUEUE bytes; while that's full, the proxy stops reading and senders'
+  windows close.
+
+  Bytes are spliced from socket to pipe and, once due, from pipe to socket,
+  so they wait in the kernel and are never copied through user space. Each
+  direction of a connection holds at most PROXY_BUFFER bytes in its pipes.
+  One thread serves every connection, waking from epoll for sockets and a
+  timerfd for the next segment due. TARGET is resolved once at startup, and
+  each connection to it is made without blocking, so a slow target holds up
+  only the connections waiting on it.
+
+  Connection setup isn't delayed.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define bail(...)                 \
+  do {                            \
+    fprintf(stderr, __VA_ARGS__); \
+    exit(1);                      \
+  } while (0)
+#define pbail(...)                \
+  do {                            \
+    fprintf(stderr, __VA_ARGS__); \
+    perror(" ");                  \
+    exit(1);                      \
+  } while (0)
+
+constexpr unsigned short PROXY_PORT = 9998;
+const char TARGET_PORT[] = "9999";
+// Bytes each direction of a connection holds at most.
+constexpr size_t PROXY_BUFFER = 16 * 1024 * 1024;
+// Most bytes read, and so timed, at once.
+constexpr size_t PROXY_SEGMENT = 64 * 1024;
+// Size asked of each pipe; the system limit for unprivileged users.
+constexpr int PIPE_SIZE = 1024 * 1024;
+// Bytes a rate-limited link queues before the proxy stops reading.
+constexpr uint64_t LINK_QUEUE = 1024 * 1024;
+
+int64_t delayNs = 0;
+int64_t jitterNs = 0;
+uint64_t rate = 0;
+unsigned seed = 1;
+
+int64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+struct Pipe {
+  int fds[2];
+  size_t capacity;
+  size_t queued = 0;
+  // Set once it can't take more; it's reused once empty.
+  bool full = false;
+};
+
+std::vector<Pipe *> freePipes;
+
+Pipe *takePipe() {
+  if (!freePipes.empty()) {
+    Pipe *pipe = freePipes.back();
+    freePipes.pop_back();
+    return pipe;
+  }
+  Pipe *pipe = new Pipe;
+  if (pipe2(pipe->fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+    perror("pipe2");
+    delete pipe;
+    return nullptr;
+  }
+  fcntl(pipe->fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+  pipe->capacity = fcntl(pipe->fds[1], F_GETPIPE_SZ);
+  return pipe;
+}
+
+void freePipe(Pipe *pipe) {
+  if (pipe->queued > 0) {
+    close(pipe->fds[0]);
+    close(pipe->fds[1]);
+    delete pipe;
+    return;
+  }
+  pipe->full = false;
+  freePipes.push_back(pipe);
+}
+
+// One direction of the emulated network, shared by all connections.
+struct Link {
+  // When the link finishes sending what it has been given.
+  int64_t freeNs = 0;
+};
+Link links[2];
+
+// Bytes received, and when they're due at the other end.
+struct Segment {
+  Pipe *pipe;
+  size_t size;
+  int64_t due;
+};
+
+// One direction of a connection.
+struct Flow {
+  int src;
+  int dst;
+  Link *link;
+  std::deque<Segment> segments;
+  // Oldest first; the last is being filled.
+  std::deque<Pipe *> pipes;
+  size_t queued = 0;
+  int64_t lastDue = 0;
+  bool eof = false;
+  // Set while `dst` can't take more.
+  bool blocked = false;
+  bool shut = false;
+};
+
+// When bytes received now on `flow` are due at the other end.
+int64_t dueTime(Flow &flow, size_t size) {
+  const int64_t now = nowNs();
+  int64_t sent = now;
+  if (rate != 0) {
+    flow.link->freeNs =
+        std::max(flow.link->freeNs, now) + int64_t(size * 1e9 / rate);
+    sent = flow.link->freeNs;
+  }
+  const int64_t jitter =
+      jitterNs > 0 ? int64_t(rand_r(&seed) / (RAND_MAX + 1.0) * jitterNs) : 0;
+  flow.lastDue = std::max(flow.lastDue, sent + delayNs + jitter);
+  return flow.lastDue;
+}
+
+// Whether `flow` may read now; if only its link's queue stops it, lowers
+// `wake` to when it may.
+bool wantsRead(const Flow &flow, int64_t now, int64_t &wake) {
+  if (flow.eof || flow.queued >= PROXY_BUFFER) {
+    return false;
+  } else if (rate == 0) {
+    return true;
+  }
+  const int64_t queueNs = int64_t(LINK_QUEUE * 1e9 / rate);
+  if (flow.link->freeNs - now < queueNs) {
+    return true;
+  }
+  wake = std::min(wake, flow.link->freeNs - queueNs);
+  return false;
+}
+
+// Splice what the source has into the flow's pipes, timing each segment.
+// Returns false on error, having reported it.
+bool fill(Flow &flow) {
+  int64_t ignored = INT64_MAX;
+  while (wantsRead(flow, nowNs(), ignored)) {
+    if (flow.pipes.empty() || flow.pipes.back()->full) {
+      Pipe *pipe = takePipe();
+      if (pipe == nullptr) {
+        return false;
+      }
+      flow.pipes.push_back(pipe);
+    }
+    Pipe *pipe = flow.pipes.back();
+    const size_t room = std::min(
+        {PROXY_SEGMENT, pipe->capacity - pipe->queued,
+         PROXY_BUFFER - flow.queued});
+    if (room == 0) {
+      pipe->full = true;
+      continue;
+    }
+    const ssize_t n = splice(flow.src, nullptr, pipe->fds[1], nullptr, room,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0) {
+      flow.eof = true;
+      break;
+    } else if (n == -1) {
+      int ready = 0;
+      if (errno != EAGAIN) {
+        perror("splice from socket");
+        return false;
+      } else if (ioctl(flow.src, FIONREAD, &ready) == 0 && ready > 0) {
+        // The pipe ran out of pages before bytes.
+        pipe->full = true;
+        continue;
+      }
+      break;
+    }
+    pipe->queued += n;
+    flow.queued += n;
+    flow.segments.push_back(Segment{pipe, size_t(n), dueTime(flow, n)});
+  }
+  return true;
+}
+
+// Splice the segments due by `now` to the destination, and shut it down
+// once the source has ended and everything is sent. Returns false on error,
+// having reported it.
+bool drain(Flow &flow, int64_t now) {
+  while (!flow.blocked && !flow.segments.empty() &&
+         flow.segments.front().due <= now) {
+    Segment &segment = flow.segments.front();
+    const ssize_t n =
+        splice(segment.pipe->fds[0], nullptr, flow.dst, nullptr,
+               segment.size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        flow.blocked = true;
+        break;
+      }
+      perror("splice to socket");
+      return false;
+    }
+    segment.size -= n;
+    segment.pipe->queued -= n;
+    flow.queued -= n;
+    if (segment.size > 0) {
+      continue;
+    }
+    Pipe *pipe = segment.pipe;
+    flow.segments.pop_front();
+    // Pipes fill in order, so a drained full one is the oldest.
+    if (pipe->full && pipe->queued == 0) {
+      flow.pipes.pop_front();
+      freePipe(pipe);
+    }
+  }
+  if (flow.eof && flow.segments.empty() && !flow.shut) {
+    shutdown(flow.dst, SHUT_WR);
+    flow.shut = true;
+  }
+  return true;
+}
+
+struct Connection;
+
+// What an epoll event is for: a connection's socket, the listener or the
+// timer.
+struct Endpoint {
+  Connection *connection;
+  int side;
+};
+
+struct Connection {
+  // The client's socket, then the server's.
+  int fds[2];
+  // Client to server, then server to client.
+  Flow flows[2];
+  Endpoint endpoints[2];
+  uint32_t interest[2] = {0, 0};
+  bool watched[2] = {true, true};
+  // Set until the connection to the target is made; `address` is the one
+  // being tried.
+  bool connecting = true;
+  const struct addrinfo *address = nullptr;
+  bool failed = false;
+};
+
+int epfd;
+std::vector<Connection *> connections;
+// The target's addresses, resolved at startup.
+struct addrinfo *targets = nullptr;
+
+void resolveTarget(const std::string &host, const std::string &port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  const int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &targets);
+  if (err != 0) {
+    bail("getaddrinfo %s: %s\n", host.c_str(), gai_strerror(err));
+  }
+}
+
+void watch(int fd, uint32_t events, Endpoint *endpoint) {
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = endpoint;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    pbail("epoll_ctl");
+  }
+}
+
+// Start connecting `c` to the target, trying its addresses from `from` on.
+// epoll reports the server's socket writable once the attempt is done.
+// Returns false if none could be tried.
+bool startConnect(Connection &c, const struct addrinfo *from) {
+  for (const struct addrinfo *info = from; info != nullptr;
+       info = info->ai_next) {
+    const int sfd = socket(info->ai_family,
+                           info->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           info->ai_protocol);
+    if (sfd == -1) {
+      continue;
+    }
+    if (connect(sfd, info->ai_addr, info->ai_addrlen) == 0 ||
+        errno == EINPROGRESS) {
+      c.fds[1] = sfd;
+      c.address = info;
+      c.interest[1] = EPOLLOUT;
+      watch(sfd, EPOLLOUT, &c.endpoints[1]);
+      return true;
+    }
+    close(sfd);
+  }
+  c.fds[1] = -1;
+  fprintf(stderr, "failed to connect to the target\n");
+  return false;
+}
+
+// The server's socket is writable: the attempt to connect is done. On
+// success, start forwarding; otherwise try the next address. Returns false
+// if there's none left.
+bool finishConnect(Connection &c) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(c.fds[1], SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+    err = errno;
+  }
+  if (err != 0) {
+    fprintf(stderr, "connect: %s\n", strerror(err));
+    close(c.fds[1]);
+    return startConnect(c, c.address->ai_next);
+  }
+  c.connecting = false;
+  for (int side = 0; side < 2; ++side) {
+    const int one = 1;
+    setsockopt(c.fds[side], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    Flow &flow = c.flows[side];
+    flow.src = c.fds[side];
+    flow.dst = c.fds[1 - side];
+    flow.link = &links[side];
+  }
+  return true;
+}
+
+void acceptAll(int listenFd) {
+  while (true) {
+    const int client =
+        accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client == -1) {
+      if (errno != EAGAIN) {
+        perror("accept");
+      }
+      return;
+    }
+    Connection *c = new Connection;
+    c->fds[0] = client;
+    for (int side = 0; side < 2; ++side) {
+      c->endpoints[side] = Endpoint{c, side};
+    }
+    // Nothing is read from the client until the server is connected.
+    watch(client, 0, &c->endpoints[0]);
+    if (!startConnect(*c, targets)) {
+      close(client);
+      delete c;
+      continue;
+    }
+    connections.push_back(c);
+  }
+}
+
+// Drain what's due, and watch each socket for what its flows wait on.
+// Lowers `wake` to when the connection next needs attention. Returns false
+// once it's finished or failed.
+bool service(Connection &c, int64_t now, int64_t &wake) {
+  if (c.connecting) {
+    return !c.failed;
+  }
+  for (Flow &flow : c.flows) {
+    if (!c.failed && !drain(flow, now)) {
+      c.failed = true;
+    }
+  }
+  if (c.failed || (c.flows[0].shut && c.flows[1].shut)) {
+    return false;
+  }
+  for (int side = 0; side < 2; ++side) {
+    const Flow &in = c.flows[side];
+    const Flow &out = c.flows[1 - side];
+    if (in.eof && out.shut) {
+      // Done both ways, but epoll would report the hangup until the other
+      // socket is done too.
+      if (c.watched[side]) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c.fds[side], nullptr);
+        c.watched[side] = false;
+      }
+      continue;
+    }
+    const uint32_t interest =
+        (wantsRead(in, now, wake) ? uint32_t(EPOLLIN) : 0) |
+        (out.blocked ? uint32_t(EPOLLOUT) : 0);
+    if (!out.blocked && !out.segments.empty()) {
+      wake = std::min(wake, out.segments.front().due);
+    }
+    if (interest != c.interest[side]) {
+      struct epoll_event event;
+      event.events = interest;
+      event.data.ptr = &c.endpoints[side];
+      if (epoll_ctl(epfd, EPOLL_CTL_MOD, c.fds[side], &event) == -1) {
+        pbail("epoll_ctl");
+      }
+      c.interest[side] = interest;
+    }
+  }
+  return true;
+}
+
+void closeConnection(Connection *c) {
+  for (int side = 0; side < 2; ++side) {
+    if (c->fds[side] != -1) {
+      close(c->fds[side]);
+    }
+    for (Pipe *pipe : c->flows[side].pipes) {
+      freePipe(pipe);
+    }
+  }
+  delete c;
+}
+
+int listenOn(unsigned short port) {
+  const int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    pbail("socket");
+  }
+  const int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port);
+  addr.sin6_addr = in6addr_any;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    pbail("bind");
+  }
+  if (listen(fd, SOMAXCONN) == -1) {
+    pbail("listen");
+  }
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+
+  unsigned short port = PROXY_PORT;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:d:j:b:")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = strtoul(optarg, nullptr, 0);
+        break;
+      case 'd':
+        delayNs = int64_t(strtod(optarg, nullptr) * 1e6);
+        break;
+      case 'j':
+        jitterNs = int64_t(strtod(optarg, nullptr) * 1e6);
+        break;
+      case 'b':
+        rate = strtoull(optarg, nullptr, 0);
+        break;
+      default:
+        bail("usage: %s [-p port] [-d delay_ms] [-j jitter_ms] "
+             "[-b bytes_per_second] target[:port]\n",
+             argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    bail("expected a target\n");
+  } else if (delayNs < 0 || jitterNs < 0) {
+    bail("-d and -j can't be negative\n");
+  }
+  std::string host = argv[optind];
+  std::string targetPort = TARGET_PORT;
+  const size_t colon = host.rfind(':');
+  if (colon != std::string::npos && host.find(':') == colon) {
+    targetPort = host.substr(colon + 1);
+    host.resize(colon);
+  }
+
+  resolveTarget(host, targetPort);
+
+  // Each direction of a connection can hold PROXY_BUFFER / PIPE_SIZE pipes.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  const int listenFd = listenOn(port);
+  const int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK |
+                                                          TFD_CLOEXEC);
+  if (epfd == -1 || timerFd == -1) {
+    pbail("epoll_create1 or timerfd_create");
+  }
+  // The listener's and the timer's events carry these.
+  Endpoint listener{nullptr, 0};
+  Endpoint timer{nullptr, 1};
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = &listener;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listenFd, &event);
+  event.data.ptr = &timer;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, timerFd, &event);
+  printf("proxying port %u to %s port %s: delay %.3f ms, jitter %.3f ms, "
+         "rate %" PRIu64 " B/s\n",
+         port, host.c_str(), targetPort.c_str(), delayNs / 1e6,
+         jitterNs / 1e6, rate);
+  fflush(stdout);
+
+  struct epoll_event events[64];
+  while (true) {
+    const int n = epoll_wait(epfd, events, 64, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      pbail("epoll_wait");
+    }
+    for (int i = 0; i < n; ++i) {
+      Endpoint *endpoint = (Endpoint *)events[i].data.ptr;
+      if (endpoint == &listener) {
+        acceptAll(listenFd);
+        continue;
+      } else if (endpoint == &timer) {
+        uint64_t expirations;
+        if (read(timerFd, &expirations, sizeof(expirations)) == -1 &&
+            errno != EAGAIN) {
+          pbail("timerfd read");
+        }
+        continue;
+      }
+      Connection &c = *endpoint->connection;
+      if (c.connecting) {
+        if (c.failed) {
+          continue;
+        } else if (endpoint->side == 1) {
+          c.failed = !finishConnect(c);
+        } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          // The client left first.
+          c.failed = true;
+        }
+        continue;
+      }
+      if (events[i].events & EPOLLERR) {
+        c.failed = true;
+      }
+      if (!c.failed && (events[i].events & (EPOLLIN | EPOLLHUP)) &&
+          !fill(c.flows[endpoint->side])) {
+        c.failed = true;
+      }
+      if (events[i].events & EPOLLOUT) {
+        c.flows[1 - endpoint->side].blocked = false;
+      }
+    }
+
+    const int64_t now = nowNs();
+    int64_t wake = INT64_MAX;
+    for (auto it = connections.begin(); it != connections.end();) {
+      if (service(**it, now, wake)) {
+        ++it;
+      } else {
+        closeConnection(*it);
+        it = connections.erase(it);
+      }
+    }
+    struct itimerspec when;
+    memset(&when, 0, sizeof(when));
+    if (wake != INT64_MAX) {
+      // Zero would disarm the timer.
+      wake = std::max<int64_t>(wake, 1);
+      when.it_value.tv_sec = wake / 1000000000;
+      when.it_value.tv_nsec = wake % 1000000000;
+    }
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &when, nullptr) == -1) {
+      pbail("timerfd_settime");
+    }
+  }
+}
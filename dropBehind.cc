@@ -0,0 +1,131 @@
+#include "dropBehind.h"
+
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "stats.h"
+
+namespace {
+
+const size_t PAGE = sysconf(_SC_PAGESIZE);
+
+}  // namespace
+
+bool parseDropPolicy(const char *spec, DropPolicy &policy) {
+  if (strcmp(spec, "bulk") == 0) {
+    policy = DropPolicy::BULK;
+  } else if (strcmp(spec, "all") == 0) {
+    policy = DropPolicy::ALL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+DropBehind::DropBehind(int sock_fd, int fd) : sock_fd(sock_fd), fd(fd) {}
+
+DropBehind::DropBehind(int sock_fd, void *map, int advice)
+    : sock_fd(sock_fd), map(static_cast<uint8_t *>(map)), advice(advice) {}
+
+void DropBehind::sent(off_t offset, size_t size, bool drop) {
+  written += size;
+  unpolled += size;
+  if (!drop || size == 0) {
+    return;
+  }
+  if (!pending.empty()) {
+    Range &back = pending.back();
+    if (back.end == written - size && back.offset + off_t(back.size) == offset) {
+      back.end = written;
+      back.size += size;
+      return;
+    }
+  }
+  pending.push_back(Range{written, offset, size});
+}
+
+void DropBehind::poll() {
+  if (unpolled < POLL_BYTES || pending.empty()) {
+    return;
+  }
+  unpolled = 0;
+  int unacked;
+  if (ioctl(sock_fd, SIOCOUTQ, &unacked) == -1) {
+    perror("SIOCOUTQ");
+    return;
+  }
+  stats::add(stats::SYSCALLS);
+  dropThrough(written - unacked);
+}
+
+void DropBehind::flush() { dropThrough(written); }
+
+// Drop the ranges, or page-aligned prefixes of them, that lie before stream
+// position `acked`.
+void DropBehind::dropThrough(uint64_t acked) {
+  off_t runOffset = 0;
+  size_t runSize = 0;
+  while (!pending.empty()) {
+    Range &range = pending.front();
+    const uint64_t start = range.end - range.size;
+    if (start >= acked) {
+      break;
+    }
+    size_t n = std::min<uint64_t>(acked - start, range.size);
+    if (n < range.size) {
+      // Keep the partial page; dropping it now would leave its remainder
+      // behind for good.
+      n -= (range.offset + n) % PAGE;
+      if (n == 0) {
+        break;
+      }
+    }
+    if (runSize > 0 && runOffset + off_t(runSize) != range.offset) {
+      drop(runOffset, runSize);
+      runSize = 0;
+    }
+    if (runSize == 0) {
+      runOffset = range.offset;
+    }
+    runSize += n;
+    if (n < range.size) {
+      range.offset += n;
+      range.size -= n;
+      break;
+    }
+    pending.pop_front();
+  }
+  if (runSize > 0) {
+    drop(runOffset, runSize);
+  }
+}
+
+void DropBehind::drop(off_t offset, size_t size) {
+  if (map == nullptr) {
+    const int err = posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+    if (err) {
+      fprintf(stderr, "drop-behind fadvise: %s\n", strerror(err));
+    }
+    stats::add(stats::FADVISE);
+  } else {
+    // madvise() needs a page-aligned start; only whole pages are dropped.
+    const off_t begin = (offset + PAGE - 1) / PAGE * PAGE;
+    const off_t end = (offset + size) / PAGE * PAGE;
+    if (end <= begin) {
+      return;
+    }
+    if (madvise(map + begin, end - begin, advice) == -1) {
+      perror("drop-behind madvise");
+    }
+    stats::add(stats::MADVISE);
+  }
+  stats::add(stats::SYSCALLS);
+  stats::add(stats::DROPPED_BYTES, size);
+}
@@ -0,0 +1,78 @@
+#ifndef DROPBEHIND_H
+#define DROPBEHIND_H
+/*
+  Drop-behind: give a file's pages back once the peer has acknowledged them,
+  so a large one-pass stream doesn't push everything else out of the page
+  cache.
+
+  The sender reports each range as it hands it to the socket, in stream
+  order. The socket's count of unacknowledged bytes (SIOCOUTQ) tells how far
+  the peer has acknowledged the stream; ranges behind that point get
+  POSIX_FADV_DONTNEED, or for a mapping madvise() with MADV_COLD or
+  MADV_PAGEOUT. Contiguous ranges are coalesced into one call.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+
+// Which requests a server drops behind.
+enum class DropPolicy {
+  NONE,
+  // Only requests the client marked with LREQ_BULK.
+  BULK,
+  ALL,
+};
+
+// Parse the argument of a -d option: "bulk" or "all".
+bool parseDropPolicy(const char *spec, DropPolicy &policy);
+
+inline bool dropsBehind(DropPolicy policy, bool bulk) {
+  return policy == DropPolicy::ALL || (policy == DropPolicy::BULK && bulk);
+}
+
+class DropBehind {
+ public:
+  // Drop pages of `fd` as they are acknowledged on `sock_fd`.
+  DropBehind(int sock_fd, int fd);
+  // Drop pages of the mapping at `map` with madvise(`advice`).
+  DropBehind(int sock_fd, void *map, int advice);
+
+  // Record that `size` bytes of the file at `offset` were just written to the
+  // socket. With `drop` false they are only counted as stream bytes.
+  void sent(off_t offset, size_t size, bool drop = true);
+
+  // Drop whatever the peer has acknowledged. Cheap to call after every send:
+  // the socket is only queried once per POLL_BYTES sent.
+  void poll();
+
+  // Drop everything sent so far, acknowledged or not; for the end of a
+  // connection.
+  void flush();
+
+ private:
+  static constexpr size_t POLL_BYTES = 1024 * 1024;
+
+  struct Range {
+    // Stream position just past the range.
+    uint64_t end;
+    off_t offset;
+    size_t size;
+  };
+
+  void dropThrough(uint64_t acked);
+  void drop(off_t offset, size_t size);
+
+  const int sock_fd;
+  const int fd = -1;
+  uint8_t *const map = nullptr;
+  const int advice = 0;
+  // Bytes written to the socket since construction.
+  uint64_t written = 0;
+  // Bytes written since the socket was last queried.
+  size_t unpolled = 0;
+  std::deque<Range> pending;
+};
+
+#endif
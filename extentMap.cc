@@ -0,0 +1,44 @@
+#include "extentMap.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+bool ExtentMap::build(int fd, off_t size) {
+  extents.clear();
+  holes = 0;
+  off_t offset = 0;
+  while (offset < size) {
+    const off_t start = lseek(fd, offset, SEEK_DATA);
+    if (start == -1 || start >= size) {
+      if (start != -1 || errno == ENXIO) {
+        // No data past `offset`; the rest is a hole.
+        break;
+      }
+      perror("SEEK_DATA");
+      allData(size);
+      return false;
+    }
+    off_t end = lseek(fd, start, SEEK_HOLE);
+    if (end == -1) {
+      perror("SEEK_HOLE");
+      allData(size);
+      return false;
+    }
+    end = std::min(end, size);
+    extents.push_back(Extent{start, end});
+    holes += start - offset;
+    offset = end;
+  }
+  if (offset < size) {
+    holes += size - offset;
+  }
+  return true;
+}
+
+void ExtentMap::allData(off_t size) {
+  extents.assign(1, Extent{0, size});
+  holes = 0;
+}
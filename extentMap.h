@@ -0,0 +1,63 @@
+#ifndef EXTENTMAP_H
+#define EXTENTMAP_H
+/*
+  The data extents of a sparse file, found once with SEEK_DATA/SEEK_HOLE so
+  that requests can be split into data and holes without a syscall each.
+  The map is a snapshot; it goes stale if the file is written afterwards.
+*/
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <vector>
+
+class ExtentMap {
+ public:
+  // Map `fd`, which is `size` bytes long. Returns false on error, having
+  // reported it; the map then treats the whole file as data.
+  bool build(int fd, off_t size);
+
+  // Treat the first `size` bytes as data, for files that change while served.
+  void allData(off_t size);
+
+  // Bytes of the file that are holes.
+  off_t holeBytes() const { return holes; }
+  size_t numExtents() const { return extents.size(); }
+
+  // Call fn(offset, size, isHole) for each data and hole piece of
+  // [offset, offset + size), in order.
+  template <class Fn>
+  void split(off_t offset, size_t size, Fn fn) const {
+    const off_t end = offset + size;
+    // First extent that ends after `offset`.
+    auto it = std::upper_bound(
+        extents.begin(), extents.end(), offset,
+        [](off_t o, const Extent &extent) { return o < extent.end; });
+    while (offset < end) {
+      if (it == extents.end() || it->start >= end) {
+        fn(offset, size_t(end - offset), true);
+        return;
+      }
+      if (it->start > offset) {
+        fn(offset, size_t(it->start - offset), true);
+        offset = it->start;
+      }
+      const off_t dataEnd = std::min(it->end, end);
+      fn(offset, size_t(dataEnd - offset), false);
+      offset = dataEnd;
+      ++it;
+    }
+  }
+
+ private:
+  struct Extent {
+    off_t start;
+    off_t end;
+  };
+
+  // Sorted and disjoint.
+  std::vector<Extent> extents;
+  off_t holes = 0;
+};
+
+#endif
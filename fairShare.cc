@@ -0,0 +1,197 @@
+#include "fairShare.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+
+#include <boost/fiber/operations.hpp>
+
+struct FairShare::Client {
+  in_addr_t addr;
+  Policy policy;
+  // Virtual finish time of the client's last chunk.
+  double finish = 0;
+  double tokens = FAIR_BURST;
+  int64_t refilled;
+  uint64_t bytes = 0;
+  uint64_t turns = 0;
+  int64_t waitNs = 0;
+  int64_t maxWaitNs = 0;
+  int64_t throttledNs = 0;
+};
+
+namespace {
+
+int64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+}  // namespace
+
+bool parseFairPolicy(const char *spec, in_addr_t &addr,
+                     FairShare::Policy &policy) {
+  const char *eq = strchr(spec, '=');
+  if (eq == nullptr) {
+    return false;
+  }
+  const std::string host(spec, eq - spec);
+  struct in_addr in;
+  if (inet_pton(AF_INET, host.c_str(), &in) != 1) {
+    return false;
+  }
+  char *end;
+  const double weight = strtod(eq + 1, &end);
+  if (end == eq + 1 || weight <= 0) {
+    return false;
+  }
+  if (*end == ',') {
+    const char *rate = end + 1;
+    policy.rate = strtoull(rate, &end, 0);
+    if (end == rate) {
+      return false;
+    }
+  }
+  if (*end != '\0') {
+    return false;
+  }
+  addr = in.s_addr;
+  policy.weight = weight;
+  return true;
+}
+
+FairShare::FairShare(unsigned slots, uint64_t rate, Policy defaults)
+    : slots(slots), rate(rate), defaults(defaults) {}
+
+FairShare::~FairShare() = default;
+
+void FairShare::setPolicy(in_addr_t addr, Policy policy) {
+  std::unique_lock<boost::fibers::mutex> lock(mu);
+  policies[addr] = policy;
+}
+
+FairShare::Client *FairShare::client(int sock_fd) {
+  struct sockaddr_in peer;
+  socklen_t size = sizeof(peer);
+  in_addr_t addr = INADDR_ANY;
+  if (getpeername(sock_fd, (struct sockaddr *)&peer, &size) == 0 &&
+      peer.sin_family == AF_INET) {
+    addr = peer.sin_addr.s_addr;
+  }
+  std::unique_lock<boost::fibers::mutex> lock(mu);
+  auto &client = clients[addr];
+  if (!client) {
+    client.reset(new Client);
+    client->addr = addr;
+    const auto it = policies.find(addr);
+    client->policy = it != policies.end() ? it->second : defaults;
+    client->refilled = nowNs();
+  }
+  return client.get();
+}
+
+// Wait until `client` has `size` tokens, and take them.
+void FairShare::throttle(Client *client, size_t size) {
+  if (client->policy.rate == 0) {
+    return;
+  }
+  const int64_t start = nowNs();
+  while (true) {
+    int64_t sleepNs;
+    {
+      std::unique_lock<boost::fibers::mutex> lock(mu);
+      const int64_t now = nowNs();
+      client->tokens =
+          std::min(double(FAIR_BURST),
+                   client->tokens + (now - client->refilled) * 1e-9 *
+                                        client->policy.rate);
+      client->refilled = now;
+      if (client->tokens >= size) {
+        client->tokens -= size;
+        client->throttledNs += now - start;
+        return;
+      }
+      sleepNs = (size - client->tokens) * 1e9 / client->policy.rate;
+    }
+    boost::this_fiber::sleep_for(std::chrono::nanoseconds(sleepNs));
+  }
+}
+
+void FairShare::acquire(Client *client, size_t size) {
+  throttle(client, size);
+  const int64_t start = nowNs();
+  std::unique_lock<boost::fibers::mutex> lock(mu);
+  const double tag = std::max(vtime, client->finish);
+  client->finish = tag + size / client->policy.weight;
+  const uint64_t ticket = nextTicket++;
+  waiting.push(Waiter{tag, ticket});
+  int64_t now;
+  while (true) {
+    if (busy >= slots || waiting.top().ticket != ticket) {
+      turns.wait(lock);
+      continue;
+    }
+    now = nowNs();
+    if (now >= nextStartNs) {
+      break;
+    }
+    // Next in line; a chunk with an earlier tag may still overtake it.
+    turns.wait_for(lock, std::chrono::nanoseconds(nextStartNs - now));
+  }
+  waiting.pop();
+  vtime = tag;
+  busy++;
+  if (rate != 0) {
+    nextStartNs = std::max(nextStartNs, now) + int64_t(size * 1e9 / rate);
+  }
+  const int64_t waited = now - start;
+  client->bytes += size;
+  client->turns++;
+  client->waitNs += waited;
+  client->maxWaitNs = std::max(client->maxWaitNs, waited);
+  // The next in line may also have a free slot.
+  if (!waiting.empty()) {
+    turns.notify_all();
+  }
+}
+
+void FairShare::release() {
+  {
+    std::unique_lock<boost::fibers::mutex> lock(mu);
+    busy--;
+  }
+  turns.notify_all();
+}
+
+std::string FairShare::format() {
+  std::unique_lock<boost::fibers::mutex> lock(mu);
+  std::string out;
+  for (const auto &entry : clients) {
+    const Client &client = *entry.second;
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in;
+    in.s_addr = client.addr;
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+    char lines[512];
+    snprintf(lines, sizeof(lines),
+             "client.%s.weight %.6f\n"
+             "client.%s.bytes %" PRIu64 "\n"
+             "client.%s.turns %" PRIu64 "\n"
+             "client.%s.wait_us_mean %.3f\n"
+             "client.%s.wait_us_max %.3f\n"
+             "client.%s.throttled_us %.3f\n",
+             addr, client.policy.weight, addr, client.bytes, addr,
+             client.turns, addr,
+             client.turns > 0 ? client.waitNs / 1e3 / client.turns : 0.0,
+             addr, client.maxWaitNs / 1e3, addr, client.throttledNs / 1e3);
+    out += lines;
+  }
+  return out;
+}
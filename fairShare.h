@@ -0,0 +1,107 @@
+#ifndef FAIRSHARE_H
+#define FAIRSHARE_H
+/*
+  Weighted fair sharing of a server's sending between clients.
+
+  Connections are grouped into clients by peer address. A connection sends
+  in chunks of at most FAIR_CHUNK bytes, and waits for a turn before each.
+  Turns are handed out by start-time fair queueing: each chunk is tagged with
+  a virtual start time, and a client's tags advance by size / weight. So
+  backlogged clients get bandwidth in proportion to their weights however
+  many connections or requests each keeps outstanding, and a client that
+  returns after idling starts level with the others instead of with credit.
+  At most `slots` chunks are sent at once.
+
+  The queue only orders chunks while the server is the bottleneck. Where the
+  link is, backlogs build in socket buffers and the network instead, and
+  their connections share it however TCP does. A total rate just under the
+  link's moves the backlog into the queue: turns are then paced to it.
+
+  A client can also have a rate limit, enforced with a token bucket of
+  FAIR_BURST bytes before its chunks join the queue.
+
+  Each client's time spent waiting for turns and for tokens is added to stats
+  dumps. Clients are remembered for the life of the server.
+
+  Waiting uses Boost.Fiber primitives, which park a fiber and block a plain
+  thread, so one FairShare serves either kind of connection.
+*/
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+
+constexpr size_t FAIR_CHUNK = 64 * 1024;
+constexpr uint64_t FAIR_BURST = 1024 * 1024;
+
+class FairShare {
+ public:
+  struct Policy {
+    double weight = 1;
+    // Bytes per second, or 0 for no limit.
+    uint64_t rate = 0;
+  };
+  struct Client;
+
+  // `defaults` applies to clients without a policy of their own. `rate` is
+  // the total in bytes per second, or 0 for no limit.
+  FairShare(unsigned slots, uint64_t rate, Policy defaults);
+  ~FairShare();
+
+  // Set the policy of the client at `addr`. Call before serving.
+  void setPolicy(in_addr_t addr, Policy policy);
+  // The client `sock_fd` is connected to.
+  Client *client(int sock_fd);
+
+  // Wait for a turn to send `size` bytes, at most FAIR_CHUNK, for `client`.
+  // Each acquire() must be followed by a release() once the chunk is sent.
+  void acquire(Client *client, size_t size);
+  void release();
+
+  // Per-client statistics, one "name value" per line.
+  std::string format();
+
+ private:
+  struct Waiter {
+    double tag;
+    uint64_t ticket;
+  };
+  struct Later {
+    bool operator()(const Waiter &a, const Waiter &b) const {
+      return a.tag != b.tag ? a.tag > b.tag : a.ticket > b.ticket;
+    }
+  };
+
+  void throttle(Client *client, size_t size);
+
+  const unsigned slots;
+  const uint64_t rate;
+  const Policy defaults;
+  boost::fibers::mutex mu;
+  boost::fibers::condition_variable turns;
+  std::map<in_addr_t, Policy> policies;
+  // By address, in network order.
+  std::map<in_addr_t, std::unique_ptr<Client>> clients;
+  std::priority_queue<Waiter, std::vector<Waiter>, Later> waiting;
+  // Tag of the chunk last given a turn.
+  double vtime = 0;
+  uint64_t nextTicket = 0;
+  unsigned busy = 0;
+  // When the total rate allows the next turn to start.
+  int64_t nextStartNs = 0;
+};
+
+// Parse the argument of a -W option, ADDRESS=WEIGHT[,RATE], into `addr` and
+// `policy`, leaving the rate alone if it's not given.
+bool parseFairPolicy(const char *spec, in_addr_t &addr,
+                     FairShare::Policy &policy);
+
+#endif
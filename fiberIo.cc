@@ -0,0 +1,149 @@
+#include "fiberIo.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/fiber/algo/round_robin.hpp>
+#include <boost/fiber/algo/work_stealing.hpp>
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <boost/fiber/operations.hpp>
+
+#include "io.h"
+
+namespace fiberio {
+
+namespace {
+
+constexpr int EVENTS_PER_WAIT = 256;
+
+struct IoEvent {
+  boost::fibers::mutex mu;
+  boost::fibers::condition_variable cv;
+  bool readable = true;
+  bool writable = true;
+};
+
+int epollFd = -1;
+// Indexed by fd. Entries are reused, never freed, so the epoll thread can't
+// see one go away under it.
+std::vector<std::unique_ptr<IoEvent>> events;
+
+void t_poll() {
+  struct epoll_event ready[EVENTS_PER_WAIT];
+  while (true) {
+    const int n = epoll_wait(epollFd, ready, EVENTS_PER_WAIT, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (int i = 0; i < n; ++i) {
+      IoEvent &event = *events[ready[i].data.fd];
+      const uint32_t e = ready[i].events;
+      std::unique_lock<boost::fibers::mutex> lock(event.mu);
+      if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        event.readable = true;
+      }
+      if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        event.writable = true;
+      }
+      event.cv.notify_all();
+    }
+  }
+}
+
+// Keep a worker's scheduler running; it only ever runs stolen fibers.
+void t_worker(unsigned threads) {
+  boost::fibers::use_scheduling_algorithm<
+      boost::fibers::algo::work_stealing>(threads, true);
+  boost::fibers::mutex mu;
+  boost::fibers::condition_variable idle;
+  std::unique_lock<boost::fibers::mutex> lock(mu);
+  idle.wait(lock, []() { return false; });
+}
+
+}  // namespace
+
+void start(unsigned threads) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+      perror("setrlimit");
+    }
+  }
+  getrlimit(RLIMIT_NOFILE, &limit);
+  events.resize(limit.rlim_cur);
+
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd == -1) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  ioWaiter() = wait;
+  std::thread(t_poll).detach();
+  for (unsigned i = 1; i < threads; ++i) {
+    std::thread(t_worker, threads).detach();
+  }
+  // work_stealing needs another thread to steal from, and spins looking for
+  // one otherwise.
+  if (threads == 1) {
+    boost::fibers::use_scheduling_algorithm<
+        boost::fibers::algo::round_robin>();
+    return;
+  }
+  // Returns once every worker has joined the scheduler.
+  boost::fibers::use_scheduling_algorithm<
+      boost::fibers::algo::work_stealing>(threads, true);
+}
+
+void add(int fd) {
+  if (size_t(fd) >= events.size()) {
+    fprintf(stderr, "fd %d is over the open file limit\n", fd);
+    exit(1);
+  }
+  if (!events[fd]) {
+    events[fd].reset(new IoEvent);
+  } else {
+    // A previous connection's; assume ready until a call says otherwise.
+    std::unique_lock<boost::fibers::mutex> lock(events[fd]->mu);
+    events[fd]->readable = true;
+    events[fd]->writable = true;
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.fd = fd;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    perror("epoll_ctl add");
+    exit(1);
+  }
+}
+
+void remove(int fd) {
+  if (epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr) == -1) {
+    perror("epoll_ctl del");
+  }
+}
+
+void wait(int fd, short what) {
+  IoEvent &event = *events[fd];
+  bool &ready = what & POLLOUT ? event.writable : event.readable;
+  std::unique_lock<boost::fibers::mutex> lock(event.mu);
+  event.cv.wait(lock, [&]() { return ready; });
+  ready = false;
+}
+
+}  // namespace fiberio
@@ -0,0 +1,38 @@
+#ifndef FIBERIO_H
+#define FIBERIO_H
+/*
+  Nonblocking socket I/O for fibers on a fixed pool of threads.
+
+  start() runs Boost.Fiber's work-stealing scheduler on the calling thread and
+  on threads - 1 workers, so a fiber launched from any of them may be resumed
+  on any other. Sockets registered with add() are watched by one epoll thread.
+  A fiber whose call on one fails with EAGAIN parks in wait() (installed as
+  the io.h waiter) until epoll reports the socket ready, and the thread moves
+  on to another fiber meanwhile.
+
+  Readiness is edge-triggered: a wakeup is consumed by the wait it ends, and
+  a stale one only costs another EAGAIN.
+
+  Fibers can change threads between calls, and the compiler may keep the
+  address of a thread_local across them, so per-thread statistics can be
+  slightly off in this mode.
+*/
+
+namespace fiberio {
+
+// Raise the open file limit as far as allowed, start the epoll thread and
+// the scheduler, and install wait() as the io.h waiter. Call once, from the
+// thread that will launch the first fibers.
+void start(unsigned threads);
+
+// Watch `fd`, which must be nonblocking, until remove().
+void add(int fd);
+void remove(int fd);
+
+// Park the calling fiber until `fd` is ready for `events` (POLLIN or
+// POLLOUT).
+void wait(int fd, short events);
+
+}  // namespace fiberio
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef IO_H
+#define IO_H
+/*
+  Socket calls for both blocking sockets and the nonblocking sockets of
+  connections served on fibers (see fiberIo.h). A call that fails with EAGAIN
+  parks the caller in the installed waiter until the socket is ready, then
+  is retried. With no waiter installed, EAGAIN is returned like any error.
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+using IoWaiter = void (*)(int fd, short events);
+
+inline IoWaiter &ioWaiter() {
+  static IoWaiter waiter = nullptr;
+  return waiter;
+}
+
+// Make `call` until it doesn't fail with EAGAIN, waiting for `events` on
+// `fd` in between.
+template <class Call>
+ssize_t retryIo(int fd, short events, Call call) {
+  while (true) {
+    const ssize_t n = call();
+    if (n != -1 || errno != EAGAIN || ioWaiter() == nullptr) {
+      return n;
+    }
+    ioWaiter()(fd, events);
+  }
+}
+
+// Receive `size` bytes, or fewer if the peer closes first. Returns the number
+// received, or -1 on error. Adds the recv() calls made to `syscalls`.
+inline ssize_t recvFull(int fd, void *buf, size_t size, int flags = 0,
+                        uint64_t *syscalls = nullptr) {
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t n = retryIo(fd, POLLIN, [&]() {
+      if (syscalls != nullptr) {
+        ++*syscalls;
+      }
+      return recv(fd, static_cast<uint8_t *>(buf) + done, size - done,
+                  flags | MSG_WAITALL);
+    });
+    if (n <= 0) {
+      return n == 0 ? ssize_t(done) : -1;
+    }
+    // A peek returns the same bytes again; wait for the rest instead.
+    if (flags & MSG_PEEK) {
+      if (size_t(n) == size || ioWaiter() == nullptr) {
+        return n;
+      }
+      ioWaiter()(fd, POLLIN);
+      continue;
+    }
+    done += n;
+  }
+  return done;
+}
+
+// Send all `size` bytes. Returns false on error.
+inline bool sendFull(int fd, const void *buf, size_t size, int flags = 0) {
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t n = retryIo(fd, POLLOUT, [&]() {
+      return send(fd, static_cast<const uint8_t *>(buf) + done, size - done,
+                  flags | MSG_NOSIGNAL);
+    });
+    if (n == -1) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef LOCALRING_H
+#define LOCALRING_H
+/*
+  Shared-memory rings of the local transport, for clients on the server's
+  host.
+
+  A client connects to the server's Unix socket and receives two descriptors
+  with SCM_RIGHTS: the served file, read-only, and a sealed memfd holding a
+  LocalShared, which both sides map. The client queues the ranges it wants
+  on `requests`; the server makes each one resident in the page cache and
+  queues it back on `completions`. The client then reads the range straight
+  from its own mapping of the file: nothing is copied, and once its pages
+  are mapped, a read costs no syscall.
+
+  Each ring has one producer and one consumer. The producer fills slots from
+  `head` while they're free of `tail`, then publishes them by advancing
+  `head`; the consumer frees them by advancing `tail`. Indexes are 32 bits
+  and wrap, so that a side with nothing to do can sleep on the other's index
+  with a futex. It's only woken if it said it was sleeping, so a busy pair
+  makes no syscalls at all. Sleeps time out after LOCAL_WAIT_MS, so a side
+  can check whether its peer is still connected.
+*/
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+constexpr uint32_t LOCAL_MAGIC = 0x4c4f4353;  // "SCOL"
+constexpr uint32_t LOCAL_VERSION = 1;
+// Slots in each ring; a power of two, so indexes wrap cleanly.
+constexpr uint32_t LOCAL_RING = 1024;
+constexpr int LOCAL_WAIT_MS = 100;
+
+// A request, or its completion.
+struct LocalSlot {
+  int64_t offset;
+  uint64_t size;
+  // The client's, returned with the completion.
+  uint64_t tag;
+  // Set by the server on completion.
+  uint32_t status;
+  uint32_t reserved;
+};
+
+enum LocalStatus : uint32_t { LOCAL_OK = 0, LOCAL_INVALID = 1 };
+
+struct LocalRing {
+  alignas(64) std::atomic<uint32_t> head;
+  // Set while the consumer sleeps on `head`.
+  std::atomic<uint32_t> consumerSleeping;
+  alignas(64) std::atomic<uint32_t> tail;
+  // Set while the producer sleeps on `tail`.
+  std::atomic<uint32_t> producerSleeping;
+  alignas(64) LocalSlot slots[LOCAL_RING];
+
+  // Producer: queue `slot`. Returns false if the ring is full.
+  bool push(const LocalSlot &slot) {
+    const uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == LOCAL_RING) {
+      return false;
+    }
+    slots[h % LOCAL_RING] = slot;
+    head.store(h + 1, std::memory_order_seq_cst);
+    if (consumerSleeping.load(std::memory_order_seq_cst)) {
+      wake(head);
+    }
+    return true;
+  }
+
+  // Consumer: take the next slot. Returns false if the ring is empty.
+  bool pop(LocalSlot &slot) {
+    const uint32_t t = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == t) {
+      return false;
+    }
+    slot = slots[t % LOCAL_RING];
+    tail.store(t + 1, std::memory_order_seq_cst);
+    if (producerSleeping.load(std::memory_order_seq_cst)) {
+      wake(tail);
+    }
+    return true;
+  }
+
+  // Consumer: sleep until there's something to pop, or the timeout.
+  void awaitItems() {
+    const uint32_t t = tail.load(std::memory_order_relaxed);
+    park(consumerSleeping, head, t);
+  }
+
+  // Producer: sleep until there's room to push, or the timeout.
+  void awaitSpace() {
+    const uint32_t full = head.load(std::memory_order_relaxed) - LOCAL_RING;
+    park(producerSleeping, tail, full);
+  }
+
+ private:
+  // Sleep on `word` while it's `value`, having set `sleeping` so the other
+  // side wakes us.
+  static void park(std::atomic<uint32_t> &sleeping,
+                   std::atomic<uint32_t> &word, uint32_t value) {
+    sleeping.store(1, std::memory_order_seq_cst);
+    if (word.load(std::memory_order_seq_cst) == value) {
+      struct timespec timeout = {0, LOCAL_WAIT_MS * 1000000L};
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT,
+              value, &timeout, nullptr, 0);
+    }
+    sleeping.store(0, std::memory_order_relaxed);
+  }
+
+  static void wake(std::atomic<uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, 1,
+            nullptr, nullptr, 0);
+  }
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "ring indexes are futex words shared between processes");
+
+// The memfd's contents.
+struct LocalShared {
+  uint32_t magic;
+  uint32_t version;
+  // Of the served file; requests must lie within it.
+  uint64_t fileSize;
+  // From the client to the server, and back.
+  LocalRing requests;
+  LocalRing completions;
+};
+
+// Whether the peer on `conn`, over which nothing is sent after setup, has
+// gone.
+inline bool peerGone(int conn) {
+  struct pollfd pfd;
+  pfd.fd = conn;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) == 1;
+}
+
+// Server side of setup: pass the file and the memfd over `conn`. Returns
+// false on error.
+inline bool sendLocal(int conn, int fileFd, int memfd) {
+  const int fds[2] = {fileFd, memfd};
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  return sendmsg(conn, &msg, MSG_NOSIGNAL) == 1;
+}
+
+// Client side: receive them. Returns false if they didn't come.
+inline bool receiveLocal(int conn, int &fileFd, int &memfd) {
+  int fds[2];
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != 1) {
+    return false;
+  }
+  const struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    return false;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  fileFd = fds[0];
+  memfd = fds[1];
+  return true;
+}
+
+#endif
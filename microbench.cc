@@ -0,0 +1,229 @@
+/*
+  Microbenchmarks for the primitives the servers are built from.
+  Build with `make microbench`; needs Google Benchmark.
+
+    ./microbench --benchmark_filter=Crc32
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/fiber/buffered_channel.hpp>
+#include <cppchannel/channel>
+
+#include "crcutil_blockword.h"
+#include "flatbuffers/flatbuffers.h"
+#include "wire.h"
+
+namespace {
+
+constexpr size_t PAGE = 4096;
+constexpr int NUMBLOCKS = 64;
+
+// Page-aligned buffer of `size` bytes plus `slack` so callers can misalign.
+struct Buffer {
+  explicit Buffer(size_t size, size_t slack = 64) {
+    if (posix_memalign(&mem, PAGE, size + slack)) {
+      abort();
+    }
+    memset(mem, 0xa5, size + slack);
+  }
+  ~Buffer() { free(mem); }
+  uint8_t *data() { return static_cast<uint8_t *>(mem); }
+  void *mem;
+};
+
+void BM_Crc32(benchmark::State &state) {
+  const size_t size = state.range(0);
+  const size_t align = state.range(1);
+  Buffer buf(size);
+  uint32_t crc = 0;
+  for (auto _ : state) {
+    crc = crc32(crc, buf.data() + align, size);
+    benchmark::DoNotOptimize(crc);
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * size);
+}
+BENCHMARK(BM_Crc32)
+    ->ArgsProduct({benchmark::CreateRange(64, 1 << 20, 8), {0, 1, 3, 8}});
+
+// One producer thread hands LReqs to the benchmark thread, as t_recv does to
+// t_read.
+void BM_CppChannel(benchmark::State &state) {
+  cpp::channel<LReq, NUMBLOCKS> reqs;
+  const int64_t n = state.max_iterations;
+  std::thread producer([&]() {
+    for (int64_t i = 0; i < n; ++i) {
+      reqs.send(LReq{.offset = i, .size = 0, .trace = 0});
+    }
+  });
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(reqs.recv());
+  }
+  producer.join();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CppChannel)->UseRealTime();
+
+void BM_BoostBufferedChannel(benchmark::State &state) {
+  boost::fibers::buffered_channel<LReq> reqs(NUMBLOCKS);
+  const int64_t n = state.max_iterations;
+  std::thread producer([&]() {
+    for (int64_t i = 0; i < n; ++i) {
+      reqs.push(LReq{.offset = i, .size = 0, .trace = 0});
+    }
+  });
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(reqs.value_pop());
+  }
+  producer.join();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BoostBufferedChannel)->UseRealTime();
+
+void buildReq(flatbuffers::FlatBufferBuilder &fbb,
+              std::vector<Server::Range> &ranges, int64_t numRanges) {
+  fbb.Clear();
+  if (numRanges == 0) {
+    fbb.FinishSizePrefixed(Server::CreateReq(fbb, 1 << 20, 64 * 1024));
+    return;
+  }
+  ranges.clear();
+  for (int64_t i = 0; i < numRanges; ++i) {
+    ranges.push_back(Server::Range(i << 20, 4096));
+  }
+  auto rangesOffset = fbb.CreateVectorOfStructs(ranges);
+  fbb.FinishSizePrefixed(Server::CreateReq(fbb, 0, 0, rangesOffset));
+}
+
+// Arg: number of gather ranges, 0 for a plain request.
+void BM_FlatbufferEncode(benchmark::State &state) {
+  flatbuffers::FlatBufferBuilder fbb;
+  std::vector<Server::Range> ranges;
+  for (auto _ : state) {
+    buildReq(fbb, ranges, state.range(0));
+    benchmark::DoNotOptimize(fbb.GetBufferPointer());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FlatbufferEncode)->Arg(0)->Arg(16);
+
+// Verify and unpack, as the servers' t_recv does.
+void BM_FlatbufferDecode(benchmark::State &state) {
+  flatbuffers::FlatBufferBuilder fbb;
+  std::vector<Server::Range> ranges;
+  buildReq(fbb, ranges, state.range(0));
+  std::vector<uint8_t> msg(fbb.GetBufferPointer(),
+                           fbb.GetBufferPointer() + fbb.GetSize());
+  std::vector<LReq> lreqs;
+  for (auto _ : state) {
+    flatbuffers::Verifier verifier(msg.data(), msg.size());
+    if (!Server::VerifySizePrefixedReqBuffer(verifier)) {
+      state.SkipWithError("invalid flatbuffer");
+      break;
+    }
+    unpackReq(*Server::GetSizePrefixedReq(msg.data()), lreqs);
+    benchmark::DoNotOptimize(lreqs.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FlatbufferDecode)->Arg(0)->Arg(16);
+
+// Page-cache resident file shared by the block benchmarks.
+constexpr size_t FILE_SIZE = 64 << 20;
+
+int cachedFile() {
+  static int fd = -1;
+  if (fd != -1) {
+    return fd;
+  }
+  char path[] = "/tmp/microbench.XXXXXX";
+  fd = mkstemp(path);
+  if (fd == -1) {
+    perror("mkstemp");
+    abort();
+  }
+  unlink(path);
+  Buffer block(1 << 20, 0);
+  for (size_t off = 0; off < FILE_SIZE; off += 1 << 20) {
+    if (pwrite(fd, block.data(), 1 << 20, off) != 1 << 20) {
+      perror("pwrite");
+      abort();
+    }
+  }
+  return fd;
+}
+
+// Offset of the next block, walking the file so the source isn't always
+// CPU cache-hot. Block sizes divide FILE_SIZE.
+size_t nextOffset(size_t &offset, size_t size) {
+  const size_t current = offset;
+  offset = (offset + size) % FILE_SIZE;
+  return current;
+}
+
+void BM_Memcpy(benchmark::State &state) {
+  const size_t size = state.range(0);
+  Buffer src(FILE_SIZE, 0);
+  Buffer dst(size);
+  size_t offset = 0;
+  for (auto _ : state) {
+    memcpy(dst.data(), src.data() + nextOffset(offset, size), size);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * size);
+}
+BENCHMARK(BM_Memcpy)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+// Map the block, read one word per page and unmap, as mmap_per_read does.
+void BM_MmapTouch(benchmark::State &state) {
+  const size_t size = state.range(0);
+  const int fd = cachedFile();
+  size_t offset = 0;
+  for (auto _ : state) {
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd,
+                     nextOffset(offset, size));
+    if (map == MAP_FAILED) {
+      state.SkipWithError("mmap failed");
+      break;
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < size; i += PAGE) {
+      sum += *reinterpret_cast<volatile uint64_t *>(
+          static_cast<uint8_t *>(map) + i);
+    }
+    benchmark::DoNotOptimize(sum);
+    munmap(map, size);
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * size);
+}
+BENCHMARK(BM_MmapTouch)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+void BM_Pread(benchmark::State &state) {
+  const size_t size = state.range(0);
+  const int fd = cachedFile();
+  Buffer dst(size);
+  size_t offset = 0;
+  for (auto _ : state) {
+    if (pread(fd, dst.data(), size, nextOffset(offset, size)) !=
+        ssize_t(size)) {
+      state.SkipWithError("pread failed");
+      break;
+    }
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * size);
+}
+BENCHMARK(BM_Pread)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+}  // namespace
+
+BENCHMARK_MAIN();
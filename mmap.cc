@@ -1,6 +1,16 @@
 /*
   Sends requested blocks from the input file repeatedly over a TCP socket.
-  Uses mmap() + send().
+  Uses mmap() + sendmsg().
+
+  With -d all, acknowledged ranges of the mapping are deactivated with
+  MADV_COLD so they are reclaimed first; with -d bulk, only for requests the
+  client marks as bulk. -p pages them out right away with MADV_PAGEOUT
+  instead. See dropBehind.h.
+
+  With -w FILE, the set of the file's pages resident in the page cache is saved
+  to FILE every -i seconds (default 60) and on SIGTERM or SIGINT. At startup
+  the saved pages are prefetched by -j threads (default 4), at most -r MiB/s
+  if given, while connections are already being served. See warmup.h.
 */
 
 #include <arpa/inet.h>
@@ -17,17 +27,23 @@
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <array>
+#include <atomic>
 #include <cinttypes>
 #include <thread>
 
 #include <cppchannel/channel>
 
+#include "dropBehind.h"
 #include "flatbuffers/flatbuffers.h"
 #include "log.h"
+#include "stats.h"
+#include "trace.h"
+#include "warmup.h"
 #include "wire.h"
 
 #define bail(...)                 \
@@ -48,104 +64,258 @@
 const unsigned short PORT = 9999;
 constexpr size_t BLOCKSIZE = 64 * 1024;
 constexpr int NUMBLOCKS = 64;
+// Limits on a single sendmsg() batch.
+constexpr size_t MAX_BATCH_IOV = NUMBLOCKS;
+constexpr size_t MAX_BATCH_BYTES = 1024 * 1024;
 
 using Channel = cpp::channel<LReq, NUMBLOCKS>;
 
+DropPolicy dropPolicy = DropPolicy::NONE;
+int dropAdvice = MADV_COLD;
+
 /* Receive requested read size from client, madvise() & send().
    Requests will be returned on the wire in the order they were received,
    but madvise() calls can be issued as soon as we receive a request. We'll have
-   a single thread issuing send() calls on the socket but multiple threads
+   a single thread issuing sendmsg() calls on the socket but multiple threads
    can issue madvise() calls.
+
+   `queued` counts requests in or about to enter the channel. The receiver
+   increments it just before send() and the sender decrements it after each
+   recv(), so it never wraps, and the sender can take that many requests
+   waiting at most for a send() already under way.
+
+   Errors on a connection only end that connection. The receiver always
+   finishes by queueing END_OF_REQUESTS, and the sender keeps draining the
+   channel until it sees it so the receiver can never block on a full channel.
 */
 
-using flatbuffers::uoffset_t;
+// Advise on `lreq`'s range, widened to whole pages as madvise() requires.
+// The advice is only a hint, so failing to give it doesn't fail the request.
+void advise(void *fmap, const LReq &lreq, int advice) {
+  static const off_t page = sysconf(_SC_PAGESIZE);
+  const off_t start = lreq.offset - lreq.offset % page;
+  const size_t len = lreq.size + (lreq.offset - start);
+  if (madvise(static_cast<uint8_t *>(fmap) + start, len, advice)) {
+    perror("madvise");
+  }
+  stats::add(stats::MADVISE);
+  stats::add(stats::SYSCALLS);
+}
 
-void t_recv(void *fmap, int sock_fd, Channel &reqs, off_t filesize) {
-  std::vector<uint8_t> reqBuf;
+template <class Codec>
+void t_recv(void *fmap, int sock_fd, Channel &reqs, std::atomic<size_t> &queued,
+            off_t filesize, Codec codec) {
+  std::vector<LReq> lreqs;
 
   uint64_t count = 0;
-  while (true) {
-    // read the size field
-    std::array<uint8_t, sizeof(uoffset_t)> msgSizeBuf;
-    ssize_t bytesRead = recv(sock_fd, msgSizeBuf.data(), msgSizeBuf.size(),
-                             MSG_PEEK | MSG_WAITALL);
-    if (bytesRead == -1) {
-      pbail("recv");
-    } else if (bytesRead != msgSizeBuf.size()) {
-      bail("partial recv on req %" PRIu64 "; expected %zd, got %zd", count,
-           msgSizeBuf.size(), bytesRead);
+  while (codec.receive(sock_fd)) {
+    stats::add(stats::SYSCALLS, codec.syscalls);
+    codec.syscalls = 0;
+    const uint64_t traceId = trace::sample();
+    trace::record(traceId, trace::RECEIVED);
+    if (!codec.decode(lreqs, traceId)) {
+      break;
     }
-    const uoffset_t msgSize =
-        flatbuffers::ReadScalar<uoffset_t>(msgSizeBuf.data());
-    DLOG("incoming message size: %d (not including %zd-byte prefix)\n", msgSize,
-         sizeof(uoffset_t));
-    const size_t totalSize = msgSize + sizeof(uoffset_t);
-    DLOG("receiving %zd bytes (including %zd-byte prefix)\n", totalSize,
-         sizeof(uoffset_t));
-    reqBuf.resize(totalSize);
-    bytesRead = recv(sock_fd, &reqBuf[0], reqBuf.size(), MSG_WAITALL);
-    if (bytesRead == -1) {
-      pbail("recv");
-    } else if ((unsigned)bytesRead != reqBuf.size()) {
-      bail("partial recv");
-    }
-    const auto *req = Server::GetSizePrefixedReq(reqBuf.data());
-    flatbuffers::Verifier verifier(reqBuf.data(), reqBuf.size());
-    if (!Server::VerifySizePrefixedReqBuffer(verifier)) {
-      bail("invalid flatbuffer");
+    trace::record(traceId, trace::VERIFIED);
+    bool valid = true;
+    bool unsupported = false;
+    for (const auto &lreq : lreqs) {
+      unsupported |= (lreq.flags & (LREQ_SPARSE | LREQ_DELTA | LREQ_PUT |
+                                    LREQ_CANCEL)) ||
+                     lreq.id != 0;
+      DLOG("req offset: 0x%" PRIx64 " size: 0x%" PRIx64 "\n", lreq.offset,
+           lreq.size);
+      if (!inFile(lreq, filesize)) {
+        fprintf(stderr,
+                "invalid read requested; filesize: %ld, offset: %" PRId64
+                ", request size: %" PRIu64 "\n",
+                filesize, lreq.offset, lreq.size);
+        valid = false;
+      }
     }
-    DLOG("req offset: 0x%" PRIx64 " size: 0x%" PRIx32 "\n", req->offset(),
-         req->size());
-    if (req->offset() + req->size() > filesize) {
+    if (unsupported) {
+      // Only seekable frames or reorders its responses, or accepts writes.
       fprintf(stderr,
-              "invalid read requested; filesize: %ld, offset: %" PRId64
-              ", request size: %" PRIu32 "\n",
-              filesize, req->offset(), req->size());
+              "sparse, delta, write and scheduled requests are not "
+              "supported\n");
+      break;
+    }
+    if (!valid) {
       continue;
     }
-    if (madvise(static_cast<uint8_t *>(fmap) + req->offset(), req->size(),
-                MADV_SEQUENTIAL)) {
-      pbail("madvise");
+    // Advise on every range before queueing any of them so the kernel sees
+    // the whole set of a gather request at once.
+    const int advice = lreqs.size() > 1 ? MADV_WILLNEED : MADV_SEQUENTIAL;
+    for (const auto &lreq : lreqs) {
+      advise(fmap, lreq, advice);
+    }
+    trace::record(traceId, trace::ADVISED);
+    for (const auto &lreq : lreqs) {
+      // Counted before it's sent, so the sender can't count it out first
+      // and wrap.
+      queued++;
+      stats::adjust(stats::QUEUE_DEPTH, 1);
+      reqs.send(lreq);
     }
-    LReq lreq{.offset = req->offset(), .size = req->size()};
-    reqs.send(lreq);
+    trace::record(traceId, trace::ENQUEUED);
     count++;
+    stats::add(stats::REQUESTS);
   }
+  DLOG("connection ended after %" PRIu64 " requests\n", count);
+  queued++;
+  reqs.send(END_OF_REQUESTS);
 }
 
-void t_read(void *fmap, int sock_fd, Channel &reqs) {
-  while (true) {
-    auto req = reqs.recv();
-    off_t offset = req.offset;
-    size_t size = req.size;
-    size_t remaining = req.size;
-    while (remaining > 0) {
-      ssize_t sent =
-          send(sock_fd, static_cast<uint8_t *>(fmap) + offset, size, 0);
+// Consume `sent` bytes from the front of `msg`'s iovecs. Each iovec is one
+// request, so the return value is the number of requests completed.
+size_t advance(struct msghdr &msg, size_t sent) {
+  size_t completed = 0;
+  while (msg.msg_iovlen > 0 && msg.msg_iov->iov_len <= sent) {
+    sent -= msg.msg_iov->iov_len;
+    msg.msg_iov++;
+    msg.msg_iovlen--;
+    completed++;
+  }
+  if (sent > 0) {
+    msg.msg_iov->iov_base = static_cast<uint8_t *>(msg.msg_iov->iov_base) + sent;
+    msg.msg_iov->iov_len -= sent;
+  }
+  return completed;
+}
+
+void t_read(void *fmap, int sock_fd, Channel &reqs,
+            std::atomic<size_t> &queued) {
+  std::array<struct iovec, MAX_BATCH_IOV> iov;
+  std::array<LReq, MAX_BATCH_IOV> batch;
+  DropBehind dropBehind(sock_fd, fmap, dropAdvice);
+  bool done = false;
+  bool failed = false;
+  while (!done) {
+    // Block for one request, then take whatever else is already queued so
+    // small responses share a single sendmsg() straight from the mapping.
+    size_t niov = 0;
+    size_t batchBytes = 0;
+    do {
+      const auto req = reqs.recv();
+      queued--;
+      if (req.offset == END_OF_REQUESTS.offset) {
+        done = true;
+        break;
+      }
+      stats::adjust(stats::QUEUE_DEPTH, -1);
+      if (failed) {
+        continue;
+      }
+      trace::record(req.trace, trace::DEQUEUED);
+      batch[niov] = req;
+      iov[niov].iov_base = static_cast<uint8_t *>(fmap) + req.offset;
+      iov[niov].iov_len = req.size;
+      batchBytes += req.size;
+      niov++;
+    } while (niov < iov.size() && batchBytes < MAX_BATCH_BYTES && queued > 0);
+    if (niov == 0) {
+      continue;
+    }
+    DLOG("sending %zd requests, %zd bytes\n", niov, batchBytes);
+
+    struct msghdr msg;
+    zero(msg);
+    msg.msg_iov = iov.data();
+    msg.msg_iovlen = niov;
+    size_t completed = 0;
+    for (size_t i = 0; i < niov; ++i) {
+      trace::record(batch[i].trace, trace::SEND_START);
+    }
+    while (completed < niov) {
+      ssize_t sent = sendmsg(sock_fd, &msg, 0);
+      stats::add(stats::SYSCALLS);
       if (sent == -1) {
-        pbail("send failed");
+        perror("sendmsg failed");
+        // Unblock the receiver; it will queue END_OF_REQUESTS.
+        shutdown(sock_fd, SHUT_RDWR);
+        failed = true;
+        break;
+      }
+      stats::add(stats::BYTES, sent);
+      const size_t through = completed + advance(msg, sent);
+      for (; completed < through; ++completed) {
+        const LReq &req = batch[completed];
+        trace::record(req.trace, trace::SEND_DONE);
+        dropBehind.sent(req.offset, req.size,
+                        dropsBehind(dropPolicy, req.flags & LREQ_BULK));
+      }
+      if (completed < niov) {
+        stats::add(stats::PARTIAL_SENDS);
       }
-      remaining -= sent;
-      offset += sent;
     }
+    dropBehind.poll();
   }
+  dropBehind.flush();
 }
 
+// Serve one connection to completion.
 void serve(int socket_dest_fd, void *fmap, off_t filesize) {
+  // Compression is always declined.
+  Compression compression;
+  CodecKind codec;
+  if (!acceptCompression(socket_dest_fd, false, compression) ||
+      !acceptCodec(socket_dest_fd, codec)) {
+    return;
+  }
   Channel reqs;
-  std::thread reader(t_read, fmap, socket_dest_fd, std::ref(reqs));
-  std::thread receiver(t_recv, fmap, socket_dest_fd, std::ref(reqs), filesize);
+  std::atomic<size_t> queued(0);
+  std::thread reader(t_read, fmap, socket_dest_fd, std::ref(reqs),
+                     std::ref(queued));
+  if (codec == CodecKind::FIXED) {
+    t_recv(fmap, socket_dest_fd, reqs, queued, filesize, FixedCodec());
+  } else {
+    t_recv(fmap, socket_dest_fd, reqs, queued, filesize, FlatbufferCodec());
+  }
   reader.join();
-  receiver.join();
 }
 
 int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
+  stats::start();
+  trace::start();
 
-  if (argc != 2) {
+  const char *hotSet = nullptr;
+  unsigned saveInterval = 60;
+  unsigned warmThreads = 4;
+  size_t warmRate = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:pw:i:j:r:")) != -1) {
+    switch (opt) {
+      case 'w':
+        hotSet = optarg;
+        break;
+      case 'i':
+        saveInterval = strtoul(optarg, nullptr, 0);
+        break;
+      case 'j':
+        warmThreads = strtoul(optarg, nullptr, 0);
+        break;
+      case 'r':
+        warmRate = strtoull(optarg, nullptr, 0) * 1024 * 1024;
+        break;
+      case 'd':
+        if (!parseDropPolicy(optarg, dropPolicy)) {
+          bail("-d takes bulk or all");
+        }
+        break;
+      case 'p':
+        dropAdvice = MADV_PAGEOUT;
+        break;
+      default:
+        bail("usage: %s [-d bulk|all [-p]] [-w hotset [-i secs] [-j threads] "
+             "[-r MiB/s]] file",
+             argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
     bail("expected a file path\n");
   }
-  const int fd = open(argv[1], O_RDONLY);
+  const int fd = open(argv[optind], O_RDONLY);
   if (fd == -1) {
     pbail("open failed");
   }
@@ -160,6 +330,10 @@ int main(int argc, char **argv) {
   if (fmap == MAP_FAILED) {
     pbail("mmap failed");
   }
+  if (hotSet != nullptr) {
+    warmup::keep(hotSet, fmap, statbuf.st_size, saveInterval);
+    warmup::warm(hotSet, fmap, statbuf.st_size, warmThreads, warmRate);
+  }
 
   const int sock = socket(AF_INET, SOCK_STREAM, 0);
   if (sock == -1) {
@@ -192,9 +366,8 @@ int main(int argc, char **argv) {
     }
 
     fprintf(stderr, "accepted\n");
-    while (true) {
-      serve(s_fd, fmap, statbuf.st_size);
-    }
+    serve(s_fd, fmap, statbuf.st_size);
+    close(s_fd);
   }
   return 0;
 }
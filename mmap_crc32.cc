@@ -29,6 +29,7 @@
 #include "crcutil_blockword.h"
 #include "flatbuffers/flatbuffers.h"
 #include "log.h"
+#include "stats.h"
 #include "wire.h"
 
 #define bail(...)                 \
@@ -61,8 +62,22 @@ using Channel = cpp::channel<LReq, NUMBLOCKS>;
 
 using flatbuffers::uoffset_t;
 
+// Advise on `lreq`'s range, widened to whole pages as madvise() requires.
+// The advice is only a hint, so failing to give it doesn't fail the request.
+void advise(void *fmap, const LReq &lreq, int advice) {
+  static const off_t page = sysconf(_SC_PAGESIZE);
+  const off_t start = lreq.offset - lreq.offset % page;
+  const size_t len = lreq.size + (lreq.offset - start);
+  if (madvise(static_cast<uint8_t *>(fmap) + start, len, advice)) {
+    perror("madvise");
+  }
+  stats::add(stats::MADVISE);
+  stats::add(stats::SYSCALLS);
+}
+
 void t_recv(void *fmap, int sock_fd, Channel &reqs, off_t filesize) {
   std::vector<uint8_t> reqBuf;
+  std::vector<LReq> lreqs;
 
   uint64_t count = 0;
   while (true) {
@@ -90,33 +105,49 @@ void t_recv(void *fmap, int sock_fd, Channel &reqs, off_t filesize) {
     } else if ((unsigned)bytesRead != reqBuf.size()) {
       bail("partial recv");
     }
+    stats::add(stats::SYSCALLS, 2);
     const auto *req = Server::GetSizePrefixedReq(reqBuf.data());
     flatbuffers::Verifier verifier(reqBuf.data(), reqBuf.size());
     if (!Server::VerifySizePrefixedReqBuffer(verifier)) {
       bail("invalid flatbuffer");
     }
-    DLOG("req offset: 0x%" PRIx64 " size: 0x%" PRIx32 "\n", req->offset(),
-         req->size());
-    if (req->offset() + req->size() > filesize) {
-      fprintf(stderr,
-              "invalid read requested; filesize: %ld, offset: %" PRId64
-              ", request size: %" PRIu32 "\n",
-              filesize, req->offset(), req->size());
+    unpackReq(*req, lreqs);
+    bool valid = true;
+    for (const auto &lreq : lreqs) {
+      if ((lreq.flags &
+           (LREQ_SPARSE | LREQ_DELTA | LREQ_PUT | LREQ_CANCEL)) ||
+          lreq.id) {
+        bail("sparse, delta, write and scheduled requests are not supported");
+      }
+      DLOG("req offset: 0x%" PRIx64 " size: 0x%" PRIx64 "\n", lreq.offset,
+           lreq.size);
+      if (!inFile(lreq, filesize)) {
+        fprintf(stderr,
+                "invalid read requested; filesize: %ld, offset: %" PRId64
+                ", request size: %" PRIu64 "\n",
+                filesize, lreq.offset, lreq.size);
+        valid = false;
+      }
+    }
+    if (!valid) {
       continue;
     }
-    if (madvise(static_cast<uint8_t *>(fmap) + req->offset(), req->size(),
-                MADV_SEQUENTIAL)) {
-      pbail("madvise");
+    for (const auto &lreq : lreqs) {
+      advise(fmap, lreq, MADV_SEQUENTIAL);
+    }
+    for (const auto &lreq : lreqs) {
+      reqs.send(lreq);
+      stats::adjust(stats::QUEUE_DEPTH, 1);
     }
-    LReq lreq{.offset = req->offset(), .size = req->size()};
-    reqs.send(lreq);
     count++;
+    stats::add(stats::REQUESTS);
   }
 }
 
 void t_read(void *fmap, int sock_fd, Channel &reqs) {
   while (true) {
     const auto req = reqs.recv();
+    stats::adjust(stats::QUEUE_DEPTH, -1);
     off_t offset = req.offset;
     size_t size = req.size;
     size_t remaining = req.size;
@@ -124,9 +155,14 @@ void t_read(void *fmap, int sock_fd, Channel &reqs) {
     while (remaining > 0) {
       ssize_t sent =
           send(sock_fd, static_cast<uint8_t *>(fmap) + offset, size, 0);
+      stats::add(stats::SYSCALLS);
       if (sent == -1) {
         pbail("send failed");
       }
+      stats::add(stats::BYTES, sent);
+      if ((size_t)sent < remaining) {
+        stats::add(stats::PARTIAL_SENDS);
+      }
       remaining -= sent;
       size -= sent;
       offset += sent;
@@ -144,6 +180,7 @@ void serve(int socket_dest_fd, void *fmap, off_t filesize) {
 
 int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
+  stats::start();
 
   if (argc != 2) {
     bail("expected a file path\n");
@@ -28,6 +28,7 @@
 
 #include "flatbuffers/flatbuffers.h"
 #include "log.h"
+#include "stats.h"
 #include "wire.h"
 
 #define bail(...)                 \
@@ -62,6 +63,7 @@ using flatbuffers::uoffset_t;
 
 void t_recv(int sock_fd, Channel &reqs, off_t filesize) {
   std::vector<uint8_t> reqBuf;
+  std::vector<LReq> lreqs;
 
   uint64_t count = 0;
   while (true) {
@@ -89,18 +91,31 @@ void t_recv(int sock_fd, Channel &reqs, off_t filesize) {
     } else if ((unsigned)bytesRead != reqBuf.size()) {
       bail("partial recv");
     }
+    stats::add(stats::SYSCALLS, 2);
     const auto *req = Server::GetSizePrefixedReq(reqBuf.data());
     flatbuffers::Verifier verifier(reqBuf.data(), reqBuf.size());
     if (!Server::VerifySizePrefixedReqBuffer(verifier)) {
       bail("invalid flatbuffer");
     }
-    DLOG("req offset: 0x%" PRIx64 " size: 0x%" PRIx32 "\n", req->offset(),
-         req->size());
-    if (req->offset() + req->size() > filesize) {
-      fprintf(stderr,
-              "invalid read requested; filesize: %ld, offset: %" PRId64
-              ", request size: %" PRIu32 "\n",
-              filesize, req->offset(), req->size());
+    unpackReq(*req, lreqs);
+    bool valid = true;
+    for (const auto &lreq : lreqs) {
+      if ((lreq.flags &
+           (LREQ_SPARSE | LREQ_DELTA | LREQ_PUT | LREQ_CANCEL)) ||
+          lreq.id) {
+        bail("sparse, delta, write and scheduled requests are not supported");
+      }
+      DLOG("req offset: 0x%" PRIx64 " size: 0x%" PRIx64 "\n", lreq.offset,
+           lreq.size);
+      if (!inFile(lreq, filesize)) {
+        fprintf(stderr,
+                "invalid read requested; filesize: %ld, offset: %" PRId64
+                ", request size: %" PRIu64 "\n",
+                filesize, lreq.offset, lreq.size);
+        valid = false;
+      }
+    }
+    if (!valid) {
       continue;
     }
 
@@ -108,15 +123,19 @@ void t_recv(int sock_fd, Channel &reqs, off_t filesize) {
     //             MADV_SEQUENTIAL)) {
     //   pbail("madvise");
     // }
-    LReq lreq{.offset = req->offset(), .size = req->size()};
-    reqs.send(lreq);
+    for (const auto &lreq : lreqs) {
+      reqs.send(lreq);
+      stats::adjust(stats::QUEUE_DEPTH, 1);
+    }
     count++;
+    stats::add(stats::REQUESTS);
   }
 }
 
 void t_read(int sock_fd, int read_fd, Channel &reqs) {
   while (true) {
     auto req = reqs.recv();
+    stats::adjust(stats::QUEUE_DEPTH, -1);
     off_t offset = req.offset;
     size_t size = req.size;
     size_t remaining = req.size;
@@ -124,12 +143,19 @@ void t_read(int sock_fd, int read_fd, Channel &reqs) {
     if (fmap == MAP_FAILED) {
       pbail("mmap failed");
     }
+    // mmap() and munmap()
+    stats::add(stats::SYSCALLS, 2);
     while (remaining > 0) {
       ssize_t sent =
           send(sock_fd, static_cast<uint8_t *>(fmap), size, 0);
+      stats::add(stats::SYSCALLS);
       if (sent == -1) {
         pbail("send failed");
       }
+      stats::add(stats::BYTES, sent);
+      if ((size_t)sent < remaining) {
+        stats::add(stats::PARTIAL_SENDS);
+      }
       remaining -= sent;
       offset += sent;
     }
@@ -147,6 +173,7 @@ void serve(int socket_dest_fd, int read_fd, off_t filesize) {
 
 int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
+  stats::start();
 
   if (argc != 2) {
     bail("expected a file path\n");
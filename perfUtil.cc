@@ -0,0 +1,102 @@
+#include "perfUtil.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cinttypes>
+
+namespace {
+
+struct EventSpec {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+const EventSpec specs[PerfCounters::NUM_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+int openEvent(const EventSpec &spec, bool excludeKernel) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = spec.type;
+  attr.config = spec.config;
+  attr.inherit = 1;
+  attr.exclude_kernel = excludeKernel;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+}  // namespace
+
+PerfCounters::PerfCounters() {
+  for (int i = 0; i < NUM_EVENTS; ++i) {
+    userOnly[i] = false;
+    fds[i] = openEvent(specs[i], false);
+    if (fds[i] == -1) {
+      userOnly[i] = true;
+      fds[i] = openEvent(specs[i], true);
+    }
+    if (fds[i] == -1) {
+      fprintf(stderr, "perf counter %s unavailable: %s\n", specs[i].name,
+              strerror(errno));
+    }
+  }
+}
+
+PerfCounters::~PerfCounters() {
+  for (int fd : fds) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+}
+
+PerfCounters::Sample PerfCounters::read() const {
+  Sample sample;
+  for (int i = 0; i < NUM_EVENTS; ++i) {
+    sample.values[i] = 0;
+    uint64_t buf[3];  // value, time enabled, time running
+    if (fds[i] == -1 || ::read(fds[i], buf, sizeof(buf)) != sizeof(buf)) {
+      continue;
+    }
+    // Scale up if the event was multiplexed with others.
+    sample.values[i] =
+        buf[2] == 0 ? 0 : uint64_t(double(buf[0]) * buf[1] / buf[2]);
+  }
+  return sample;
+}
+
+std::string PerfCounters::format(const Sample &start, const Sample &end,
+                                 uint64_t bytes) const {
+  const double gibs = bytes / (1024.0 * 1024 * 1024);
+  std::string out;
+  for (int i = 0; i < NUM_EVENTS; ++i) {
+    char field[128];
+    if (fds[i] == -1) {
+      snprintf(field, sizeof(field), "%s: n/a", specs[i].name);
+    } else {
+      const uint64_t delta = end.values[i] - start.values[i];
+      snprintf(field, sizeof(field), "%s%s: %" PRIu64 " (%.0f/GiB)",
+               specs[i].name, userOnly[i] ? " (user)" : "", delta,
+               gibs > 0 ? delta / gibs : 0.0);
+    }
+    if (!out.empty()) {
+      out += "; ";
+    }
+    out += field;
+  }
+  return out;
+}
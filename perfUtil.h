@@ -0,0 +1,45 @@
+#ifndef PERFUTIL_H
+#define PERFUTIL_H
+#include <stdint.h>
+
+#include <string>
+
+/* CPU cost counters for the calling process via perf_event_open().
+   Counters are inherited by threads created after construction; their counts
+   are folded in when those threads exit. Events that can't be opened (perf
+   restricted by perf_event_paranoid, no PMU in a VM, ...) are reported as
+   unavailable. If kernel events are not permitted, user-only counts are used
+   and marked as such.
+*/
+class PerfCounters {
+ public:
+  enum Event {
+    CYCLES,
+    INSTRUCTIONS,
+    CACHE_MISSES,
+    CONTEXT_SWITCHES,
+    PAGE_FAULTS,
+    NUM_EVENTS
+  };
+
+  struct Sample {
+    // Scaled for multiplexing; meaningless where the event is unavailable.
+    uint64_t values[NUM_EVENTS];
+  };
+
+  PerfCounters();
+  ~PerfCounters();
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  Sample read() const;
+
+  // "cycles: N (N/GiB); ..." for the interval between two samples.
+  std::string format(const Sample &start, const Sample &end,
+                     uint64_t bytes) const;
+
+ private:
+  int fds[NUM_EVENTS];
+  bool userOnly[NUM_EVENTS];
+};
+#endif
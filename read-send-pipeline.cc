@@ -2,6 +2,9 @@
   Sends the entire input file repeatedly over a TCP socket.
   One thread reads 64-kiB blocks from the file while another thread sends
   blocks over the network.
+
+  With -d, each block is dropped from the page cache once the client has
+  acknowledged it; see dropBehind.h.
 */
 
 #include <arpa/inet.h>
@@ -24,6 +27,9 @@
 
 #include <boost/fiber/buffered_channel.hpp>
 
+#include "dropBehind.h"
+#include "perfUtil.h"
+#include "stats.h"
 #include "tvUtil.h"
 
 #define bail(...)                 \
@@ -49,41 +55,60 @@ using channel_t = boost::fibers::buffered_channel<int>;
 using slot_t = struct {
   std::array<uint8_t, BLOCKSIZE> block;
   size_t blocksize;
+  off_t offset;
 };
 
+bool drop = false;
+
 void t_read(int fd, channel_t &available, channel_t &filled,
             std::array<slot_t, NUMBLOCKS - 1> &slots, size_t count) {
+  off_t offset = 0;
   for (auto slot_index : available) {
     if (count <= 0) {
       break;
     }
     auto &slot = slots[slot_index];
     ssize_t bytes_read = read(fd, slot.block.data(), BLOCKSIZE);
+    stats::add(stats::SYSCALLS);
     if (bytes_read == -1) {
       pbail("read failed");
     }
     slot.blocksize = bytes_read;
+    slot.offset = offset;
+    offset += bytes_read;
     count -= bytes_read;
     filled.push(slot_index);
+    stats::adjust(stats::QUEUE_DEPTH, 1);
   }
   filled.close();
 }
 
 void t_write(int fd, channel_t &available, channel_t &filled,
-             std::array<slot_t, NUMBLOCKS - 1> &slots) {
+             std::array<slot_t, NUMBLOCKS - 1> &slots,
+             DropBehind &dropBehind) {
   for (auto slot_index : filled) {
+    stats::adjust(stats::QUEUE_DEPTH, -1);
     auto &slot = slots[slot_index];
     size_t remaining = slot.blocksize;
     size_t sent = 0;
     while (remaining > 0) {
       ssize_t bytes_sent =
           send(fd, slot.block.data() + sent, slot.blocksize - sent, 0);
+      stats::add(stats::SYSCALLS);
       if (bytes_sent == -1) {
         pbail("send failed");
       }
+      stats::add(stats::BYTES, bytes_sent);
+      if ((size_t)bytes_sent < remaining) {
+        stats::add(stats::PARTIAL_SENDS);
+      }
       sent += bytes_sent;
       remaining -= bytes_sent;
     }
+    if (drop) {
+      dropBehind.sent(slot.offset, slot.blocksize);
+      dropBehind.poll();
+    }
     slot.blocksize = 0;
     available.push(slot_index);
   }
@@ -91,7 +116,8 @@ void t_write(int fd, channel_t &available, channel_t &filled,
 }
 
 // Send `count` bytes from `src_fd` to `socket_dest_fd`, starting from `offset`.
-ssize_t sendfile(int socket_dest_fd, int src_fd, size_t count) {
+ssize_t sendfile(int socket_dest_fd, int src_fd, size_t count,
+                 DropBehind &dropBehind) {
   if (lseek(src_fd, 0, SEEK_SET) == -1) {
     pbail("lseek failed");
   }
@@ -113,7 +139,7 @@ ssize_t sendfile(int socket_dest_fd, int src_fd, size_t count) {
   std::thread reader(t_read, src_fd, std::ref(available), std::ref(filled),
                      std::ref(slots), count);
   std::thread writer(t_write, socket_dest_fd, std::ref(available),
-                     std::ref(filled), std::ref(slots));
+                     std::ref(filled), std::ref(slots), std::ref(dropBehind));
   reader.join();
   writer.join();
   return count;
@@ -121,11 +147,23 @@ ssize_t sendfile(int socket_dest_fd, int src_fd, size_t count) {
 
 int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
+  stats::start();
 
-  if (argc != 2) {
+  int opt;
+  while ((opt = getopt(argc, argv, "d")) != -1) {
+    switch (opt) {
+      case 'd':
+        drop = true;
+        break;
+      default:
+        bail("usage: %s [-d] file\n", argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
     bail("expected a file path\n");
   }
-  const int fd = open(argv[1], O_RDONLY);
+  const char *path = argv[optind];
+  const int fd = open(path, O_RDONLY);
   if (fd == -1) {
     pbail("open failed");
   }
@@ -157,6 +195,7 @@ int main(int argc, char **argv) {
     pbail("listen failed");
   }
   struct rusage usage1, usage2;
+  PerfCounters perf;
 
   while (true) {
     socklen_t so_size = sizeof(s_addr);
@@ -166,16 +205,19 @@ int main(int argc, char **argv) {
       pbail("accept failed");
     }
 
+    DropBehind dropBehind(s_fd, fd);
     while (true) {
-      printf("sending %s\n", argv[1]);
+      printf("sending %s\n", path);
       struct timespec ts_start;
       if (getrusage(RUSAGE_SELF, &usage1) == -1) {
         pbail("getrusage failed");
       }
+      const PerfCounters::Sample perf1 = perf.read();
       clock_gettime(CLOCK_MONOTONIC, &ts_start);
-      ssize_t sent = sendfile(s_fd, fd, statbuf.st_size);
+      ssize_t sent = sendfile(s_fd, fd, statbuf.st_size, dropBehind);
       struct timespec ts_end;
       clock_gettime(CLOCK_MONOTONIC, &ts_end);
+      const PerfCounters::Sample perf2 = perf.read();
       if (getrusage(RUSAGE_SELF, &usage2) == -1) {
         pbail("getrusage failed");
       }
@@ -188,6 +230,7 @@ int main(int argc, char **argv) {
              elapsed, sent / 1024 / 1024 / elapsed,
              tvDouble(tvDiff(usage2.ru_utime, usage1.ru_utime)),
              tvDouble(tvDiff(usage2.ru_stime, usage1.ru_stime)));
+      printf("  %s\n", perf.format(perf1, perf2, sent).c_str());
     }
   }
   return 0;
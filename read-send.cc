@@ -8,6 +8,7 @@
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/sendfile.h>
@@ -20,6 +21,8 @@
 
 #include <array>
 
+#include "perfUtil.h"
+#include "stats.h"
 #include "tvUtil.h"
 
 #define bail(...)                 \
@@ -50,6 +53,7 @@ ssize_t sendfile(int socket_dest_fd, int src_fd, off_t *offset, size_t count) {
   ssize_t result = 0;
   while (count > 0) {
     ssize_t bytes_read = read(src_fd, buf.data(), blocksize);
+    stats::add(stats::SYSCALLS);
     if (bytes_read == -1) {
       pbail("read failed");
     }
@@ -59,9 +63,14 @@ ssize_t sendfile(int socket_dest_fd, int src_fd, off_t *offset, size_t count) {
     while (remaining > 0) {
       ssize_t bytes_sent =
           send(socket_dest_fd, buf.data() + sent, bytes_read - sent, 0);
+      stats::add(stats::SYSCALLS);
       if (bytes_sent == -1) {
         pbail("send failed");
       }
+      stats::add(stats::BYTES, bytes_sent);
+      if ((size_t)bytes_sent < remaining) {
+        stats::add(stats::PARTIAL_SENDS);
+      }
       sent += bytes_sent;
       remaining -= bytes_sent;
     }
@@ -72,6 +81,7 @@ ssize_t sendfile(int socket_dest_fd, int src_fd, off_t *offset, size_t count) {
 
 int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
+  stats::start();
 
   if (argc != 2) {
     bail("expected a file path\n");
@@ -108,6 +118,7 @@ int main(int argc, char **argv) {
     pbail("listen failed");
   }
   struct rusage usage1, usage2;
+  PerfCounters perf;
 
   while (true) {
     socklen_t so_size = sizeof(s_addr);
@@ -124,10 +135,12 @@ int main(int argc, char **argv) {
       if (getrusage(RUSAGE_SELF, &usage1) == -1) {
         pbail("getrusage failed");
       }
+      const PerfCounters::Sample perf1 = perf.read();
       clock_gettime(CLOCK_MONOTONIC, &ts_start);
       ssize_t sent = sendfile(s_fd, fd, &offset, statbuf.st_size);
       struct timespec ts_end;
       clock_gettime(CLOCK_MONOTONIC, &ts_end);
+      const PerfCounters::Sample perf2 = perf.read();
       if (getrusage(RUSAGE_SELF, &usage2) == -1) {
         pbail("getrusage failed");
       }
@@ -140,6 +153,7 @@ int main(int argc, char **argv) {
              elapsed, sent / 1024 / 1024 / elapsed,
              tvDouble(tvDiff(usage2.ru_utime, usage1.ru_utime)),
              tvDouble(tvDiff(usage2.ru_stime, usage1.ru_stime)));
+      printf("  %s\n", perf.format(perf1, perf2, sent).c_str());
     }
   }
   return 0;
@@ -0,0 +1,226 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+/*
+  Per-connection queue of ranges between a server's receiver and sender.
+
+  Ranges without an id are handed out in order, and nothing is reordered
+  across one, so clients that don't set ids see responses in request order
+  as before. Runs of ranges with ids are scheduled: the highest priority
+  class first, and earliest deadline first within a class. Ranges without a
+  deadline get an implicit one IMPLICIT_DEADLINE after they arrive, so a
+  stream of deadlines can't starve them. A class gains a level of priority
+  for each AGING_STEP its next range has waited, so a stream of urgent ranges
+  can't starve the classes below. A range whose deadline has passed is
+  handed out ahead of everything else in its run, with LREQ_EXPIRED set, so
+  that it's answered at once with an EXPIRED frame rather than sent late.
+
+  A request with an id can be cancelled while any of its ranges are queued
+  or being sent. Its queued ranges are then handed out ahead of everything
+  else in their run, like expired ones, and the sender checks cancelled()
+  between frames of the range it's sending. The sender reports each range
+  with an id done() once it's finished with it, so that the cancellation is
+  forgotten once the last one is, and the id can be reused.
+
+  Holds at most N ranges; send() blocks while it's full. Mutex and CondVar
+  are the std:: types, or boost::fibers:: ones for fibers.
+*/
+
+#include <time.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "wire.h"
+
+constexpr int64_t AGING_STEP = 10 * 1000 * 1000;
+constexpr int64_t IMPLICIT_DEADLINE = 1000 * 1000 * 1000;
+
+template <size_t N, class Mutex = std::mutex,
+          class CondVar = std::condition_variable>
+class Scheduler {
+ public:
+  void send(const LReq &req) {
+    std::unique_lock<Mutex> lock(mu);
+    notFull.wait(lock, [this]() { return size < N; });
+    const bool scheduled = req.id != 0;
+    if (runs.empty() || runs.back().scheduled != scheduled) {
+      runs.emplace_back();
+      runs.back().scheduled = scheduled;
+    }
+    Run &run = runs.back();
+    if (!scheduled) {
+      run.fifo.push_back(req);
+    } else {
+      const int64_t now = nowNs();
+      const int64_t deadline =
+          req.deadlineUs != 0 ? now + int64_t(req.deadlineUs) * 1000
+                              : now + IMPLICIT_DEADLINE;
+      if (cancelledIds.count(req.id) > 0) {
+        run.cancelled.push_back(req);
+      } else {
+        Class &queue = run.classes[req.priority];
+        queue.push_back(Entry{req, seq++, now, deadline});
+        std::push_heap(queue.begin(), queue.end(), Later());
+      }
+      outstanding[req.id]++;
+    }
+    size++;
+    notEmpty.notify_one();
+  }
+
+  LReq recv() {
+    std::unique_lock<Mutex> lock(mu);
+    notEmpty.wait(lock, [this]() { return size > 0; });
+    Run &run = runs.front();
+    LReq req;
+    if (!run.scheduled) {
+      req = run.fifo.front();
+      run.fifo.pop_front();
+      if (run.fifo.empty()) {
+        runs.pop_front();
+      }
+    } else {
+      if (!run.cancelled.empty()) {
+        req = run.cancelled.front();
+        run.cancelled.pop_front();
+      } else {
+        req = pick(run);
+      }
+      if (run.classes.empty() && run.cancelled.empty()) {
+        runs.pop_front();
+      }
+    }
+    size--;
+    notFull.notify_one();
+    return req;
+  }
+
+  // Cancel request `id`, if it has ranges queued or being sent. Its queued
+  // ranges move to the front of their runs, in the order they arrived.
+  void cancel(uint32_t id) {
+    std::unique_lock<Mutex> lock(mu);
+    if (outstanding.count(id) == 0 || !cancelledIds.insert(id).second) {
+      return;
+    }
+    std::vector<Entry> found;
+    for (Run &run : runs) {
+      if (!run.scheduled) {
+        continue;
+      }
+      found.clear();
+      for (auto it = run.classes.begin(); it != run.classes.end();) {
+        Class &queue = it->second;
+        const auto moved = std::stable_partition(
+            queue.begin(), queue.end(),
+            [id](const Entry &entry) { return entry.req.id != id; });
+        found.insert(found.end(), moved, queue.end());
+        queue.erase(moved, queue.end());
+        std::make_heap(queue.begin(), queue.end(), Later());
+        if (queue.empty()) {
+          it = run.classes.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      std::sort(found.begin(), found.end(),
+                [](const Entry &a, const Entry &b) { return a.seq < b.seq; });
+      for (const Entry &entry : found) {
+        run.cancelled.push_back(entry.req);
+      }
+    }
+  }
+
+  bool cancelled(uint32_t id) {
+    std::unique_lock<Mutex> lock(mu);
+    return cancelledIds.count(id) > 0;
+  }
+
+  void done(const LReq &req) {
+    std::unique_lock<Mutex> lock(mu);
+    const auto it = outstanding.find(req.id);
+    if (it != outstanding.end() && --it->second == 0) {
+      outstanding.erase(it);
+      cancelledIds.erase(req.id);
+    }
+  }
+
+ private:
+  struct Entry {
+    LReq req;
+    // Arrival order, to break ties.
+    uint64_t seq;
+    int64_t arrived;
+    int64_t deadline;
+  };
+  struct Later {
+    bool operator()(const Entry &a, const Entry &b) const {
+      return a.deadline != b.deadline ? a.deadline > b.deadline
+                                      : a.seq > b.seq;
+    }
+  };
+  // A heap ordered by Later, so that its front is due first.
+  using Class = std::vector<Entry>;
+  struct Run {
+    bool scheduled;
+    std::deque<LReq> fifo;
+    // By priority.
+    std::map<uint32_t, Class> classes;
+    // Ranges of cancelled requests, handed out first.
+    std::deque<LReq> cancelled;
+  };
+
+  static int64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+  }
+
+  LReq pick(Run &run) {
+    const int64_t now = nowNs();
+    auto best = run.classes.end();
+    int64_t bestLevel = 0;
+    for (auto it = run.classes.begin(); it != run.classes.end(); ++it) {
+      const Entry &head = it->second.front();
+      if (head.req.deadlineUs != 0 && head.deadline <= now) {
+        best = it;
+        break;
+      }
+      // Later classes win ties, being higher to begin with.
+      const int64_t level = it->first + (now - head.arrived) / AGING_STEP;
+      if (best == run.classes.end() || level >= bestLevel) {
+        best = it;
+        bestLevel = level;
+      }
+    }
+    Class &queue = best->second;
+    std::pop_heap(queue.begin(), queue.end(), Later());
+    const Entry head = queue.back();
+    queue.pop_back();
+    if (queue.empty()) {
+      run.classes.erase(best);
+    }
+    LReq req = head.req;
+    if (req.deadlineUs != 0 && head.deadline <= now) {
+      req.flags |= LREQ_EXPIRED;
+    }
+    return req;
+  }
+
+  Mutex mu;
+  CondVar notEmpty;
+  CondVar notFull;
+  std::deque<Run> runs;
+  size_t size = 0;
+  uint64_t seq = 0;
+  // Ranges queued or being sent, by id, and the ids cancelled among them.
+  std::unordered_map<uint32_t, size_t> outstanding;
+  std::unordered_set<uint32_t> cancelledIds;
+};
+
+#endif
@@ -1,34 +1,107 @@
 /*
   Requests and receives input over a TCP socket and discards it.
-  Assumes the source file is 1 GiB.
+  Assumes the source file is 1 GiB. The server is on port 9999 of the host
+  unless HOST:PORT gives another, e.g. a delay-proxy's.
+
+  With -g N, each request is a scatter-gather request for N equal pieces of a
+  block, spread evenly across the file.
+  With -c fixed, requests use the fixed 16-byte frame instead of flatbuffers;
+  see FixedCodec in wire.h.
+  With -B, requests are marked as bulk, for servers running with -d bulk.
+  With -z, requests ask for sparse responses, in which holes arrive as zero
+  runs; see Frame in wire.h.
+  With -o FILE, received data is written to FILE at its offset in the source
+  instead of being discarded. Zero runs are skipped, leaving holes.
+  With -k SINK, received data is consumed by SINK: copy (the default) recv()s
+  it into a buffer and pwrite()s that to the output file; splice moves it
+  through a pipe into the output file or /dev/null without copying; zerocopy
+  maps it with TCP_ZEROCOPY_RECEIVE, pwrite()ing from the mapping to the
+  output file, and falls back to copy where that's unavailable.
+  With -r OLD -o FILE, the server's file is fetched once into FILE as a delta
+  against the local copy OLD: only chunks OLD doesn't have are transferred.
+  The server must run with -x. See chunkIndex.h.
+  Reads go through the client library in seekClient.h: enough of them are
+  kept in flight to fill the window of each of its connections. With -n N,
+  it opens N connections. With -C N, it caches N blocks; hits are copied out
+  of memory and concurrent misses share a request.
+  With -D -o FILE, the file, or the range of it -R OFFSET:SIZE gives, is
+  downloaded into FILE over the -n connections, each reading its own share
+  of STRIPE_SIZE stripes. A connection that runs out of stripes steals from
+  the one with the most left. Each connection's throughput and the total
+  are reported. The server should serve connections concurrently; see -f.
+  With -I N, N interactive readers run alongside the benchmark's, each
+  reading a PROBE_SIZE block at a time at random offsets with a higher
+  priority than the benchmark's reads, and, with -T US, a deadline of US
+  microseconds. The latency of their reads, and how many expired, is
+  reported every REPORT_INTERVAL seconds. See scheduler.h.
+  With -P N[:PERCENT], N speculative readers run alongside the benchmark's,
+  each prefetching PREFETCH_SIZE bytes at a time at random offsets and, as if
+  it had guessed wrong, cancelling PERCENT (by default 50) percent of them
+  CANCEL_AFTER_US into the transfer. How many completed and were cancelled,
+  and how long cancelling took, are reported every REPORT_INTERVAL seconds;
+  the server's stats count the bytes it didn't send.
+  With -L FILE, the read requests a server captured to FILE (see capture.h)
+  are replayed instead, each at the time it was captured relative to the
+  first, over the -n connections, with at most REPLAY_OUTSTANDING per
+  connection outstanding; -A replays them as fast as that allows instead.
+  Each request's latency runs from when it was due, so a server that falls
+  behind is charged for the wait. The replay's throughput, latencies and how
+  far it fell behind are reported once it's done. Requests keep their ranges
+  and the flags they were captured with, LREQ_BULK and LREQ_SPARSE, which -B
+  and -z add to; with -C, reads go through the cache, which drops them.
+  With -Z lz4|zstd, responses may come compressed, a block at a time (see
+  COMPRESSED in wire.h); they're decompressed before the sink gets them. The
+  server must run with -Z. Throughput is reported both as data received,
+  the effective rate, and as bytes on the wire: every REPORT_INTERVAL
+  seconds, or once a download or replay is done.
+  With -U, the server is reached over its local transport instead, at the
+  Unix socket the argument names (see seekable -U): NUMBLOCKS readers each
+  read the next block forever, straight from a mapping of the file, either
+  writing it to the -o file or touching a byte of each page. Reads and
+  throughput are reported every REPORT_INTERVAL seconds.
+  With -u FILE, FILE is uploaded to the server's file in PUT_SIZE write
+  requests, each followed by its payload via sendfile(), and the upload is
+  timed until every range is acknowledged as durable. The server must run
+  with -w.
 */
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cinttypes>
-#include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <thread>
+#include <unordered_set>
+#include <vector>
 
+#include "capture.h"
+#include "chunkIndex.h"
+#include "crcutil_blockword.h"
 #include "flatbuffers/flatbuffers.h"
 #include "log.h"
+#include "seekClient.h"
 #include "wire.h"
 
 #define bail(...)                 \
@@ -45,103 +118,1048 @@
 
 #define zero(_x) memset(&_x, 0, sizeof(_x))
 
-const unsigned short PORT = 9999;
-const char PORT_STR[] = "9999";
 constexpr size_t BLOCKSIZE = 64 * 1024;
 constexpr int NUMBLOCKS = 64;
+constexpr uint64_t FILESIZE = 1024 * 1024 * 1024;
+// Size of each write request of an upload.
+constexpr uint32_t PUT_SIZE = 1024 * 1024;
+// Size of the stripes a download is split into.
+constexpr uint64_t STRIPE_SIZE = 4 * 1024 * 1024;
+// Size of an interactive reader's reads.
+constexpr uint32_t PROBE_SIZE = 4096;
+// Size of a speculative reader's reads, and how long it lets one it cancels
+// run first.
+constexpr uint64_t PREFETCH_SIZE = 64 * 1024 * 1024;
+constexpr unsigned CANCEL_AFTER_US = 2000;
+// Requests per connection a replay keeps outstanding at most.
+constexpr unsigned REPLAY_OUTSTANDING = 4 * NUMBLOCKS;
+constexpr unsigned REPORT_INTERVAL = 5;
+
+// Number of ranges per request; 1 means plain requests.
+uint32_t numRanges = 1;
+// LReq flags for every request.
+uint32_t reqFlags = 0;
+// Output file, or -1 to discard what is received.
+int outFd = -1;
+
+// Compression asked for with -Z.
+Compression compression = Compression::NONE;
+
+enum class SinkKind { COPY, SPLICE, ZEROCOPY };
+SinkKind sinkKind = SinkKind::COPY;
+// Size of the region TCP_ZEROCOPY_RECEIVE maps payloads into.
+constexpr size_t ZEROCOPY_REGION = 2 * 1024 * 1024;
+
+void recvAll(int sfd, uint8_t *buf, size_t size) {
+  const auto bytesRead = recv(sfd, buf, size, MSG_WAITALL);
+  if (bytesRead != ssize_t(size)) {
+    pbail("recv");
+  }
+}
+
+void writeOut(const uint8_t *buf, size_t size, off_t offset) {
+  if (pwrite(outFd, buf, size, offset) != ssize_t(size)) {
+    pbail("pwrite");
+  }
+}
+
+// Consumes payloads from a socket the way -k selects; one per receiving
+// thread.
+class Sink : public PayloadSink {
+ public:
+  explicit Sink(int sfd) : sfd(sfd), kind(sinkKind) {
+    if (kind == SinkKind::SPLICE) {
+      if (pipe(fds) == -1) {
+        pbail("pipe");
+      }
+      devNull = open("/dev/null", O_WRONLY);
+      if (devNull == -1) {
+        pbail("open /dev/null");
+      }
+    } else if (kind == SinkKind::ZEROCOPY) {
+      void *map = mmap(nullptr, ZEROCOPY_REGION, PROT_READ, MAP_SHARED, sfd, 0);
+      if (map == MAP_FAILED) {
+        perror("TCP_ZEROCOPY_RECEIVE unavailable; copying");
+        kind = SinkKind::COPY;
+      } else {
+        region = static_cast<uint8_t *>(map);
+      }
+    }
+  }
+
+  // Receive the `size` bytes at `offset` in the source that are next on the
+  // socket. The copy sink receives them into `buf`.
+  bool receive(size_t size, off_t offset, uint8_t *buf) override {
+    if (kind == SinkKind::SPLICE) {
+      spliceOut(size, offset);
+    } else if (kind == SinkKind::ZEROCOPY) {
+      mapOut(size, offset, buf);
+    } else {
+      recvAll(sfd, buf, size);
+      if (outFd != -1) {
+        writeOut(buf, size, offset);
+      }
+    }
+    return true;
+  }
+
+  // Decompressed data; the copy sink copies it into `buf` as well.
+  bool deliver(const uint8_t *data, size_t size, off_t offset,
+               uint8_t *buf) override {
+    if (kind == SinkKind::COPY && data != buf) {
+      memcpy(buf, data, size);
+    }
+    if (outFd != -1) {
+      writeOut(data, size, offset);
+    }
+    return true;
+  }
 
-int numOutstanding = 0;
-std::mutex mu;
-std::condition_variable cv;
+  bool copies() const override { return kind == SinkKind::COPY; }
 
-void t_req(int sfd) {
-  constexpr uint64_t filesize = 1024 * 1024 * 1024;
-  off_t offset = 0;
+ private:
+  void spliceOut(size_t size, loff_t offset) {
+    const int dest = outFd != -1 ? outFd : devNull;
+    while (size > 0) {
+      const ssize_t in = splice(sfd, nullptr, fds[1], nullptr, size,
+                                SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (in <= 0) {
+        pbail("splice from socket");
+      }
+      for (ssize_t moved = 0; moved < in;) {
+        const ssize_t out =
+            splice(fds[0], nullptr, dest, dest == outFd ? &offset : nullptr,
+                   in - moved, SPLICE_F_MOVE);
+        if (out <= 0) {
+          pbail("splice out");
+        }
+        moved += out;
+      }
+      size -= in;
+    }
+  }
+
+  // Map whole pages of payload; whatever the kernel can't map, such as a
+  // partial page, is copied through `buf` as it hints.
+  void mapOut(size_t size, off_t offset, uint8_t *buf) {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    while (size > 0) {
+      struct tcp_zerocopy_receive zc;
+      zero(zc);
+      zc.address = reinterpret_cast<uint64_t>(region);
+      // Never map past this payload into the next one.
+      zc.length = std::min(size, ZEROCOPY_REGION) / page * page;
+      if (zc.length > 0) {
+        socklen_t len = sizeof(zc);
+        if (getsockopt(sfd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &len)) {
+          perror("TCP_ZEROCOPY_RECEIVE failed; copying");
+          kind = SinkKind::COPY;
+          receive(size, offset, buf);
+          return;
+        }
+        if (outFd != -1 && zc.length > 0) {
+          writeOut(region, zc.length, offset);
+        }
+        offset += zc.length;
+        size -= zc.length;
+      } else {
+        // Less than a page left.
+        zc.recv_skip_hint = size;
+      }
+      const size_t copy = std::min(size_t(zc.recv_skip_hint), size);
+      if (copy > 0) {
+        recvAll(sfd, buf, copy);
+        if (outFd != -1) {
+          writeOut(buf, copy, offset);
+        }
+        offset += copy;
+        size -= copy;
+      } else if (zc.length == 0) {
+        // Nothing has arrived yet.
+        struct pollfd pfd;
+        pfd.fd = sfd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, -1);
+      }
+    }
+  }
+
+  int sfd;
+  SinkKind kind;
+  int fds[2] = {-1, -1};
+  int devNull = -1;
+  uint8_t *region = nullptr;
+};
+
+// One of the readers the benchmark keeps in flight, each requesting the next
+// block forever. Every request covers one block in total: `numRanges` pieces
+// of it, each from its own stride of the file.
+Task<void> reader(Pool &pool, std::atomic<uint64_t> &next,
+                  Schedule schedule) {
+  const uint64_t stride = FILESIZE / numRanges;
+  const uint32_t piece = BLOCKSIZE / numRanges;
+  std::vector<uint8_t> buf(BLOCKSIZE);
+  std::vector<LReq> ranges(numRanges);
   while (true) {
-    // lock scope
-    {
-      std::unique_lock<std::mutex> lock(mu);
-      while (numOutstanding >= NUMBLOCKS) {
-        cv.wait(lock, []() -> bool { return numOutstanding < NUMBLOCKS; });
-      }
-    }
-    // TODO: re-use a buffer for each flatbuffer
-    flatbuffers::FlatBufferBuilder fbb;
-    auto req = Server::CreateReq(fbb, offset, BLOCKSIZE);
-    fbb.FinishSizePrefixed(req);
-    DLOG("req offset: 0x%" PRIx64 " size: 0x%" PRIx32 "\n", offset,
-         (uint32_t)BLOCKSIZE);
-    DLOG("sending %d bytes\n", fbb.GetSize());
-    const auto bytesSent = send(sfd, fbb.GetBufferPointer(), fbb.GetSize(), 0);
-    if (bytesSent != fbb.GetSize()) {
+    const uint64_t offset = next++ % (stride / piece) * piece;
+    for (uint32_t i = 0; i < numRanges; ++i) {
+      ranges[i] = LReq{.offset = int64_t(i * stride + offset), .size = piece};
+    }
+    if (!co_await pool.readv(ranges, buf.data(), schedule)) {
+      bail("read failed\n");
+    }
+  }
+}
+
+// Blocks read over the local transport.
+std::atomic<uint64_t> localReads{0};
+
+// A reader of the local transport, reading the next block forever. Reads
+// cost no copy, so pages are touched, to be mapped, unless written out.
+Task<void> localReader(LocalClient &client, std::atomic<uint64_t> &next) {
+  static const size_t page = sysconf(_SC_PAGESIZE);
+  uint64_t sum = 0;
+  while (true) {
+    const uint64_t offset = next++ % (FILESIZE / BLOCKSIZE) * BLOCKSIZE;
+    const uint8_t *block = co_await client.read(offset, BLOCKSIZE);
+    if (block == nullptr) {
+      bail("read failed\n");
+    }
+    if (outFd != -1) {
+      writeOut(block, BLOCKSIZE, offset);
+    } else {
+      for (size_t i = 0; i < BLOCKSIZE; i += page) {
+        sum += *static_cast<const volatile uint8_t *>(block + i);
+      }
+    }
+    localReads++;
+  }
+}
+
+void t_reportLocal() {
+  uint64_t reads = 0;
+  while (true) {
+    sleep(REPORT_INTERVAL);
+    const uint64_t now = localReads;
+    fprintf(stderr, "local: %" PRIu64 " reads, %f MiB/s\n", now - reads,
+            (now - reads) * BLOCKSIZE / 1024.0 / 1024.0 / REPORT_INTERVAL);
+    reads = now;
+  }
+}
+
+// Report the rate of `data` bytes received, and of the `wire` bytes they
+// took, over `seconds`.
+void reportCompression(const char *what, uint64_t data, uint64_t wire,
+                       double seconds) {
+  fprintf(stderr,
+          "%s: %f MiB/s effective, %f MiB/s on the wire; %.2fx compression\n",
+          what, data / 1024.0 / 1024.0 / seconds,
+          wire / 1024.0 / 1024.0 / seconds, wire > 0 ? double(data) / wire : 1);
+}
+
+void t_reportCompression(Pool &pool) {
+  uint64_t data = 0;
+  uint64_t wire = 0;
+  while (true) {
+    sleep(REPORT_INTERVAL);
+    const uint64_t nowData = pool.dataBytes();
+    const uint64_t nowWire = pool.wireBytes();
+    reportCompression(compressionName(compression), nowData - data,
+                      nowWire - wire, REPORT_INTERVAL);
+    data = nowData;
+    wire = nowWire;
+  }
+}
+
+// Stripes of a download, dealt out to streams in contiguous shares up front.
+// A stream takes blocks from its current stripe, then from its next one.
+// Once it has none left, it steals the last stripe of whichever stream has
+// the most, so a slow stream doesn't set the finish time.
+class Stripes {
+ public:
+  Stripes(uint64_t offset, uint64_t size, unsigned streams)
+      : queues(streams), current(streams), stolen(streams) {
+    const uint64_t count = (size + STRIPE_SIZE - 1) / STRIPE_SIZE;
+    for (uint64_t i = 0; i < count; ++i) {
+      const uint64_t start = offset + i * STRIPE_SIZE;
+      queues[i * streams / count].push_back(
+          Stripe{start, std::min(start + STRIPE_SIZE, offset + size)});
+    }
+  }
+
+  // Take the next block for `stream`. Returns false once nothing is left.
+  bool take(unsigned stream, LReq &range) {
+    const std::lock_guard<std::mutex> lock(mu);
+    Stripe &stripe = current[stream];
+    if (stripe.offset == stripe.end) {
+      if (!queues[stream].empty()) {
+        stripe = queues[stream].front();
+        queues[stream].pop_front();
+      } else {
+        auto &victim = *std::max_element(
+            queues.begin(), queues.end(),
+            [](const std::deque<Stripe> &a, const std::deque<Stripe> &b) {
+              return a.size() < b.size();
+            });
+        if (victim.empty()) {
+          return false;
+        }
+        stripe = victim.back();
+        victim.pop_back();
+        stolen[stream]++;
+      }
+    }
+    range = LReq{.offset = int64_t(stripe.offset),
+                 .size = uint32_t(
+                     std::min(uint64_t(BLOCKSIZE), stripe.end - stripe.offset))};
+    stripe.offset += range.size;
+    return true;
+  }
+
+  unsigned stolenBy(unsigned stream) {
+    const std::lock_guard<std::mutex> lock(mu);
+    return stolen[stream];
+  }
+
+ private:
+  struct Stripe {
+    uint64_t offset;
+    uint64_t end;
+  };
+
+  std::mutex mu;
+  std::vector<std::deque<Stripe>> queues;
+  // What's left of the stripe each stream is on.
+  std::vector<Stripe> current;
+  std::vector<unsigned> stolen;
+};
+
+// One connection of a download.
+struct Stream {
+  std::unique_ptr<Pool> pool;
+  std::atomic<uint64_t> bytes{0};
+  // Readers still going, and the time the last one finished.
+  std::atomic<unsigned> active{NUMBLOCKS};
+  double elapsed = 0;
+};
+
+double monotonic() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One of a stream's readers. The sink writes each block to its offset in the
+// output file.
+Task<void> downloader(Stripes &stripes, Stream &stream, unsigned index,
+                      double start) {
+  std::vector<uint8_t> buf(BLOCKSIZE);
+  LReq range;
+  while (stripes.take(index, range)) {
+    if (!co_await stream.pool->read(range.offset, range.size, buf.data())) {
+      bail("read failed\n");
+    }
+    stream.bytes += range.size;
+  }
+  if (--stream.active == 0) {
+    stream.elapsed = monotonic() - start;
+  }
+}
+
+// Download `size` bytes from `offset` into the output file over `streams`
+// connections, and report each one's throughput and the total.
+void download(const char *host, const PoolOptions &options, unsigned streams,
+              uint64_t offset, uint64_t size) {
+  std::vector<Stream> stream(streams);
+  for (auto &s : stream) {
+    s.pool.reset(new Pool(options));
+    if (!s.pool->connect(host)) {
+      exit(1);
+    }
+  }
+  fprintf(stderr, "connected %u streams\n", streams);
+  Stripes stripes(offset, size, streams);
+  const double start = monotonic();
+  Latch done(streams * NUMBLOCKS);
+  for (unsigned i = 0; i < streams; ++i) {
+    for (int j = 0; j < NUMBLOCKS; ++j) {
+      spawn(downloader(stripes, stream[i], i, start), done);
+    }
+  }
+  done.wait();
+  const double elapsed = monotonic() - start;
+  for (unsigned i = 0; i < streams; ++i) {
+    const uint64_t bytes = stream[i].bytes;
+    printf("stream %u: %" PRIu64 " bytes in %fs; %f MiB/s; stole %u stripes\n",
+           i, bytes, stream[i].elapsed,
+           bytes / 1024.0 / 1024.0 / stream[i].elapsed, stripes.stolenBy(i));
+  }
+  printf("downloaded %" PRIu64 " bytes over %u streams in %fs; %f MiB/s\n",
+         size, streams, elapsed, size / 1024.0 / 1024.0 / elapsed);
+  if (compression != Compression::NONE) {
+    uint64_t data = 0;
+    uint64_t wire = 0;
+    for (const auto &s : stream) {
+      data += s.pool->dataBytes();
+      wire += s.pool->wireBytes();
+    }
+    reportCompression(compressionName(compression), data, wire, elapsed);
+  }
+}
+
+// Fetch the server's file as a delta against the local copy at `oldPath`,
+// writing it to the output file.
+void reconstruct(int sfd, const char *oldPath) {
+  ChunkIndex index;
+  const int oldFd = open(oldPath, O_RDONLY);
+  if (oldFd != -1) {
+    struct stat statbuf;
+    if (fstat(oldFd, &statbuf) || !index.build(oldFd, statbuf.st_size)) {
+      bail("failed to index %s\n", oldPath);
+    }
+  } else if (errno != ENOENT) {
+    pbail("open %s", oldPath);
+  }
+  // Offer each distinct chunk once; REF frames refer to them by position.
+  std::vector<uint8_t> have;
+  std::vector<const Chunk *> offered;
+  std::unordered_set<Hash, HashHasher> seen;
+  for (const Chunk &chunk : index.chunks()) {
+    if (seen.insert(chunk.hash).second) {
+      have.insert(have.end(), chunk.hash.begin(), chunk.hash.end());
+      offered.push_back(&chunk);
+    }
+  }
+  FlatbufferCodec codec;
+  const Bytes msg = codec.encodeDelta(Bytes{have.data(), have.size()}, reqFlags);
+  if (send(sfd, msg.data, msg.size, 0) != ssize_t(msg.size)) {
+    pbail("send");
+  }
+
+  Sink sink(sfd);
+  std::vector<uint8_t> buf;
+  uint64_t pos = 0;
+  uint64_t received = 0;
+  uint64_t reused = 0;
+  uint64_t frames = 0;
+  while (true) {
+    uint8_t header[Frame::HEADER_SIZE];
+    recvAll(sfd, header, sizeof(header));
+    frames++;
+    Frame frame;
+    if (!frame.decode(header)) {
+      bail("bad frame\n");
+    }
+    if (frame.kind == Frame::END) {
+      break;
+    } else if (frame.kind == Frame::DATA) {
+      buf.resize(frame.size);
+      sink.receive(frame.size, pos, buf.data());
+      pos += frame.size;
+      received += frame.size;
+    } else if (frame.kind == Frame::REF && frame.size < offered.size()) {
+      const Chunk &chunk = *offered[frame.size];
+      buf.resize(chunk.size);
+      if (pread(oldFd, buf.data(), chunk.size, chunk.offset) !=
+          ssize_t(chunk.size)) {
+        pbail("pread");
+      }
+      writeOut(buf.data(), chunk.size, pos);
+      pos += chunk.size;
+      reused += chunk.size;
+    } else {
+      bail("unexpected frame in delta response\n");
+    }
+  }
+  if (ftruncate(outFd, pos) == -1) {
+    pbail("ftruncate");
+  }
+  printf("reconstructed %" PRIu64 " bytes: %" PRIu64 " from %s, %" PRIu64
+         " received; %" PRIu64 " bytes on the wire\n",
+         pos, reused, oldPath, received,
+         msg.size + received + frames * Frame::HEADER_SIZE);
+}
+
+// Upload the local file at `path` to the server's file, pipelining write
+// requests while a second thread collects their acknowledgements.
+void upload(int sfd, const char *path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    pbail("open %s", path);
+  }
+  struct stat statbuf;
+  if (fstat(fd, &statbuf)) {
+    pbail("fstat");
+  }
+  const uint64_t size = statbuf.st_size;
+  const uint64_t numPuts = (size + PUT_SIZE - 1) / PUT_SIZE;
+  // Checksums read the file through a mapping; payloads go by sendfile().
+  uint8_t *map = nullptr;
+  if (size > 0) {
+    map = static_cast<uint8_t *>(
+        mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+    if (map == MAP_FAILED) {
+      pbail("mmap");
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t stored = 0;
+  uint64_t rejected = 0;
+  std::thread acks([&]() {
+    for (uint64_t i = 0; i < numPuts; ++i) {
+      uint8_t header[Frame::HEADER_SIZE];
+      recvAll(sfd, header, sizeof(header));
+      Frame frame;
+      if (!frame.decode(header) ||
+          (frame.kind != Frame::STORED && frame.kind != Frame::REJECTED)) {
+        bail("unexpected frame in write response\n");
+      }
+      if (frame.kind == Frame::STORED) {
+        stored += frame.size;
+      } else {
+        rejected++;
+      }
+    }
+  });
+  FlatbufferCodec codec;
+  for (uint64_t offset = 0; offset < size; offset += PUT_SIZE) {
+    const uint32_t n = std::min(uint64_t(PUT_SIZE), size - offset);
+    const Bytes msg = codec.encodePut(offset, n, crc32(0, map + offset, n));
+    if (send(sfd, msg.data, msg.size, MSG_MORE) != ssize_t(msg.size)) {
       pbail("send");
     }
+    off_t payload = offset;
+    while (payload < off_t(offset + n)) {
+      if (sendfile(sfd, fd, &payload, offset + n - payload) <= 0) {
+        pbail("sendfile");
+      }
+    }
+  }
+  acks.join();
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  const double elapsed =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("stored %" PRIu64 " of %" PRIu64 " bytes in %fs; %f MiB/s\n",
+         stored, size, elapsed, stored / 1024.0 / 1024.0 / elapsed);
+  if (rejected > 0) {
+    bail("%" PRIu64 " ranges were rejected\n", rejected);
+  }
+}
+
+// Latencies of the interactive readers' reads since the last report.
+struct Probes {
+  std::mutex mu;
+  std::vector<double> latencies;
+  uint64_t expired = 0;
+};
+
+// An interactive reader: one PROBE_SIZE read at a time, at random offsets.
+// A failed read is counted as expired; a broken connection stops the
+// benchmark's readers anyway.
+Task<void> prober(Pool &pool, Probes &probes, Schedule schedule,
+                  unsigned seed) {
+  std::vector<uint8_t> buf(PROBE_SIZE);
+  while (true) {
+    const uint64_t offset =
+        rand_r(&seed) % (FILESIZE / PROBE_SIZE) * PROBE_SIZE;
+    const double start = monotonic();
+    const bool ok =
+        co_await pool.read(offset, PROBE_SIZE, buf.data(), schedule);
+    const double latency = monotonic() - start;
+    const std::lock_guard<std::mutex> lock(probes.mu);
+    if (ok) {
+      probes.latencies.push_back(latency);
+    } else {
+      probes.expired++;
+    }
+  }
+}
+
+void t_report(Probes &probes) {
+  while (true) {
+    sleep(REPORT_INTERVAL);
+    std::vector<double> latencies;
+    uint64_t expired;
     {
-      const std::lock_guard<std::mutex> lock(mu);
-      numOutstanding++;
+      const std::lock_guard<std::mutex> lock(probes.mu);
+      latencies.swap(probes.latencies);
+      expired = probes.expired;
+      probes.expired = 0;
     }
-    offset += BLOCKSIZE;
-    if (offset + BLOCKSIZE > filesize) {
-      DLOG("resetting offset\n");
-      offset = 0;
+    if (latencies.empty()) {
+      fprintf(stderr, "interactive: no reads, %" PRIu64 " expired\n",
+              expired);
+      continue;
     }
-    fflush(stderr);
+    std::sort(latencies.begin(), latencies.end());
+    const auto at = [&](double q) {
+      return latencies[size_t(q * (latencies.size() - 1))] * 1e3;
+    };
+    fprintf(stderr,
+            "interactive: %zu reads, p50 %.3f ms, p99 %.3f ms, max %.3f ms, "
+            "%" PRIu64 " expired\n",
+            latencies.size(), at(0.5), at(0.99), latencies.back() * 1e3,
+            expired);
   }
 }
 
-void t_recv(int sfd) {
+// Speculative readers' reads since the last report.
+struct Prefetches {
+  std::mutex mu;
+  uint64_t completed = 0;
+  // Reads cancelled, and the seconds each took to fail once cancelled.
+  std::vector<double> cancelled;
+};
+
+Task<void> prefetch(Pool &pool, uint64_t offset, uint8_t *buf,
+                    Cancel &cancel, bool &ok) {
+  ok = co_await pool.read(offset, PREFETCH_SIZE, buf, Schedule(), &cancel);
+}
+
+// A speculative reader. Runs on a thread of its own, which can wait to cancel
+// a read while it's in flight.
+void t_prefetch(Pool &pool, Prefetches &prefetches, unsigned percent,
+                unsigned seed) {
+  std::vector<uint8_t> buf(PREFETCH_SIZE);
   while (true) {
-    std::array<uint8_t, BLOCKSIZE> buf;
-    const auto bytesRead = recv(sfd, buf.data(), BLOCKSIZE, MSG_WAITALL);
-    if (bytesRead != BLOCKSIZE) {
-      pbail("recv");
+    const uint64_t offset =
+        rand_r(&seed) % (FILESIZE / PREFETCH_SIZE) * PREFETCH_SIZE;
+    const bool wrong = unsigned(rand_r(&seed) % 100) < percent;
+    Cancel cancel;
+    Latch latch(1);
+    bool ok = false;
+    spawn(prefetch(pool, offset, buf.data(), cancel, ok), latch);
+    double cancelledAt = 0;
+    if (wrong) {
+      usleep(CANCEL_AFTER_US);
+      cancelledAt = monotonic();
+      cancel.cancel();
+    }
+    latch.wait();
+    const std::lock_guard<std::mutex> lock(prefetches.mu);
+    if (ok) {
+      // Includes those that finished before they could be cancelled.
+      prefetches.completed++;
+    } else if (wrong) {
+      prefetches.cancelled.push_back(monotonic() - cancelledAt);
+    } else {
+      bail("prefetch failed\n");
+    }
+  }
+}
+
+void t_reportPrefetches(Prefetches &prefetches) {
+  while (true) {
+    sleep(REPORT_INTERVAL);
+    std::vector<double> cancelled;
+    uint64_t completed;
+    {
+      const std::lock_guard<std::mutex> lock(prefetches.mu);
+      cancelled.swap(prefetches.cancelled);
+      completed = prefetches.completed;
+      prefetches.completed = 0;
+    }
+    if (cancelled.empty()) {
+      fprintf(stderr, "prefetch: %" PRIu64 " completed, none cancelled\n",
+              completed);
+      continue;
+    }
+    std::sort(cancelled.begin(), cancelled.end());
+    fprintf(stderr,
+            "prefetch: %" PRIu64 " completed, %zu cancelled, taking p50 "
+            "%.3f ms, max %.3f ms\n",
+            completed, cancelled.size(),
+            cancelled[cancelled.size() / 2] * 1e3, cancelled.back() * 1e3);
+  }
+}
+
+// Requests of a replay that have finished.
+struct Replayed {
+  std::mutex mu;
+  std::condition_variable cv;
+  size_t outstanding = 0;
+  std::vector<double> latencies;
+  uint64_t bytes = 0;
+  uint64_t failed = 0;
+};
+
+Task<void> replayRequest(Pool &pool, std::vector<LReq> ranges, uint64_t size,
+                         double due, Replayed &replayed) {
+  std::vector<uint8_t> buf(size);
+  const bool ok = co_await pool.readv(std::move(ranges), buf.data());
+  const double latency = monotonic() - due;
+  {
+    const std::lock_guard<std::mutex> lock(replayed.mu);
+    if (ok) {
+      replayed.latencies.push_back(latency);
+      replayed.bytes += size;
+    } else {
+      replayed.failed++;
+    }
+    replayed.outstanding--;
+  }
+  replayed.cv.notify_one();
+}
+
+// Replay the capture at `path` on `pool`, at its pace unless `asFast`.
+// Reads through the pool's cache, if `cached`, lose their captured flags.
+void replay(Pool &pool, const char *path, bool asFast, unsigned connections,
+            bool cached) {
+  std::vector<CaptureRecord> records;
+  if (!capture::load(path, records)) {
+    exit(1);
+  }
+  // A capture that ended mid-request leaves its last one cut short; that's
+  // still replayed, so it's counted too.
+  size_t requests = 0;
+  size_t flagged = 0;
+  for (size_t i = 0; i < records.size(); ++i) {
+    requests += records[i].more == 0 || i + 1 == records.size();
+    flagged += records[i].flags != 0;
+  }
+  if (requests == 0) {
+    bail("%s has no requests\n", path);
+  }
+  if (cached && flagged > 0) {
+    fprintf(stderr, "warning: with -C, the flags of %zu captured ranges are "
+            "ignored\n", flagged);
+  }
+  fprintf(stderr, "replaying %zu requests\n", requests);
+  Replayed replayed;
+  Latch done(requests);
+  const size_t limit = size_t(REPLAY_OUTSTANDING) * connections;
+  double behind = 0;
+  const double start = monotonic();
+  for (size_t i = 0; i < records.size();) {
+    std::vector<LReq> ranges;
+    uint64_t size = 0;
+    const CaptureRecord &first = records[i];
+    do {
+      ranges.push_back(LReq{.offset = records[i].offset,
+                            .size = records[i].size,
+                            .flags = records[i].flags});
+      size += records[i].size;
+    } while (records[i++].more > 0 && i < records.size());
+    double due = start + first.ns * 1e-9;
+    if (!asFast) {
+      const double wait = due - monotonic();
+      if (wait > 0) {
+        usleep(wait * 1e6);
+      }
     }
     {
-      const std::lock_guard<std::mutex> lock(mu);
-      numOutstanding--;
+      std::unique_lock<std::mutex> lock(replayed.mu);
+      replayed.cv.wait(lock, [&]() { return replayed.outstanding < limit; });
+      replayed.outstanding++;
+    }
+    const double now = monotonic();
+    if (asFast) {
+      due = now;
+    } else {
+      behind = std::max(behind, now - due);
     }
-    cv.notify_all();
+    spawn(replayRequest(pool, std::move(ranges), size, due, replayed), done);
+  }
+  done.wait();
+  const double elapsed = monotonic() - start;
+
+  auto &latencies = replayed.latencies;
+  std::sort(latencies.begin(), latencies.end());
+  const auto at = [&](double q) {
+    return latencies.empty()
+               ? 0
+               : latencies[size_t(q * (latencies.size() - 1))] * 1e3;
+  };
+  printf("replayed %zu requests, %" PRIu64 " bytes in %fs; %f MiB/s; "
+         "latency p50 %.3f ms, p99 %.3f ms, max %.3f ms; up to %.3f ms "
+         "behind; %" PRIu64 " failed\n",
+         requests, replayed.bytes, elapsed,
+         replayed.bytes / 1024.0 / 1024.0 / elapsed, at(0.5), at(0.99),
+         at(1), behind * 1e3, replayed.failed);
+  if (compression != Compression::NONE) {
+    reportCompression(compressionName(compression), pool.dataBytes(),
+                      pool.wireBytes(), elapsed);
   }
 }
 
 int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
 
-  if (argc != 2) {
-    bail("expected a hostname\n");
+  bool fixedCodec = false;
+  unsigned connections = 1;
+  size_t cacheBlocks = 0;
+  const char *oldPath = nullptr;
+  const char *outPath = nullptr;
+  const char *uploadPath = nullptr;
+  bool striped = false;
+  uint64_t rangeOffset = 0;
+  uint64_t rangeSize = FILESIZE;
+  unsigned probers = 0;
+  uint32_t deadlineUs = 0;
+  unsigned prefetchers = 0;
+  unsigned cancelPercent = 50;
+  const char *replayPath = nullptr;
+  bool asFast = false;
+  bool local = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "g:c:Bzo:r:u:k:n:C:DR:I:T:P:L:AZ:U")) != -1) {
+    switch (opt) {
+      case 'U':
+        local = true;
+        break;
+      case 'Z':
+        if (!parseCompression(optarg, compression)) {
+          bail("-Z takes lz4 or zstd\n");
+        }
+        break;
+      case 'L':
+        replayPath = optarg;
+        break;
+      case 'A':
+        asFast = true;
+        break;
+      case 'P': {
+        char *end;
+        prefetchers = strtoul(optarg, &end, 0);
+        if (*end == ':') {
+          cancelPercent = strtoul(end + 1, &end, 0);
+        }
+        if (*end != '\0' || cancelPercent > 100) {
+          bail("-P takes readers[:percent]\n");
+        }
+        break;
+      }
+      case 'I':
+        probers = strtoul(optarg, nullptr, 0);
+        break;
+      case 'T':
+        deadlineUs = strtoul(optarg, nullptr, 0);
+        break;
+      case 'n':
+        connections = strtoul(optarg, nullptr, 0);
+        if (connections == 0) {
+          bail("-n takes a connection count\n");
+        }
+        break;
+      case 'D':
+        striped = true;
+        break;
+      case 'R': {
+        char *end;
+        rangeOffset = strtoull(optarg, &end, 0);
+        if (*end != ':') {
+          bail("-R takes offset:size\n");
+        }
+        rangeSize = strtoull(end + 1, nullptr, 0);
+        break;
+      }
+      case 'C':
+        cacheBlocks = strtoull(optarg, nullptr, 0);
+        break;
+      case 'k':
+        if (strcmp(optarg, "splice") == 0) {
+          sinkKind = SinkKind::SPLICE;
+        } else if (strcmp(optarg, "zerocopy") == 0) {
+          sinkKind = SinkKind::ZEROCOPY;
+        } else if (strcmp(optarg, "copy") != 0) {
+          bail("unknown sink %s\n", optarg);
+        }
+        break;
+      case 'u':
+        uploadPath = optarg;
+        break;
+      case 'r':
+        oldPath = optarg;
+        break;
+      case 'B':
+        reqFlags |= LREQ_BULK;
+        break;
+      case 'z':
+        reqFlags |= LREQ_SPARSE;
+        break;
+      case 'o':
+        outPath = optarg;
+        break;
+      case 'c':
+        if (strcmp(optarg, "fixed") == 0) {
+          fixedCodec = true;
+        } else if (strcmp(optarg, "flatbuffers") != 0) {
+          bail("unknown codec %s\n", optarg);
+        }
+        break;
+      case 'g':
+        numRanges = strtoul(optarg, nullptr, 0);
+        if (numRanges == 0 || BLOCKSIZE % numRanges != 0) {
+          bail("-g must divide the block size (%zd)\n", BLOCKSIZE);
+        }
+        break;
+      default:
+        bail("usage: %s [-g ranges] [-c fixed|flatbuffers] [-B] [-z] "
+             "[-r old] [-o file] [-k copy|splice|zerocopy] [-u file] "
+             "[-n connections] [-C blocks] [-D [-R offset:size]] "
+             "[-I readers [-T deadline_us]] [-P readers[:percent]] "
+             "[-L capture [-A]] [-Z lz4|zstd] host[:port] | -U [-o file] "
+             "socket\n",
+             argv[0]);
+    }
   }
-
-  struct addrinfo hints;
-  zero(hints);
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  struct addrinfo *info_base;
-  if (getaddrinfo(argv[1], PORT_STR, &hints, &info_base) != 0) {
-    bail("getaddrinfo");
+  if (optind != argc - 1) {
+    bail("expected a host\n");
   }
-  struct addrinfo *info;
-  int sfd = -1;
-  for (info = info_base; info != nullptr; info = info->ai_next) {
-    sfd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
-    if (sfd == -1) {
-      continue;
+  if (oldPath != nullptr &&
+      (outPath == nullptr || strcmp(oldPath, outPath) == 0 || fixedCodec)) {
+    bail("-r needs an -o file other than the old copy, and flatbuffers\n");
+  }
+  if (uploadPath != nullptr && (fixedCodec || outPath != nullptr)) {
+    bail("-u needs flatbuffers and can't be combined with -o\n");
+  }
+  if (compression != Compression::NONE &&
+      (oldPath != nullptr || uploadPath != nullptr)) {
+    bail("-Z can't be combined with -r or -u\n");
+  }
+  if (cacheBlocks > 0 &&
+      (outPath != nullptr || sinkKind != SinkKind::COPY)) {
+    bail("-C can't be combined with -o or -k\n");
+  }
+  if (striped && (outPath == nullptr || oldPath != nullptr ||
+                  uploadPath != nullptr || cacheBlocks > 0 || numRanges > 1)) {
+    bail("-D needs -o and can't be combined with -r, -u, -C or -g\n");
+  }
+  if (probers > 0 && (fixedCodec || striped || oldPath != nullptr ||
+                      uploadPath != nullptr)) {
+    bail("-I needs flatbuffers and can't be combined with -D, -r or -u\n");
+  }
+  if (prefetchers > 0 && (fixedCodec || striped || oldPath != nullptr ||
+                          uploadPath != nullptr || cacheBlocks > 0)) {
+    bail("-P needs flatbuffers and can't be combined with -D, -r, -u or "
+         "-C\n");
+  }
+  if (replayPath != nullptr &&
+      (striped || oldPath != nullptr || uploadPath != nullptr ||
+       probers > 0 || prefetchers > 0)) {
+    bail("-L can't be combined with -D, -r, -u, -I or -P\n");
+  } else if (asFast && replayPath == nullptr) {
+    bail("-A requires -L\n");
+  }
+  if (local && (fixedCodec || reqFlags != 0 || numRanges > 1 ||
+                oldPath != nullptr || uploadPath != nullptr ||
+                sinkKind != SinkKind::COPY || connections > 1 ||
+                cacheBlocks > 0 || striped || probers > 0 ||
+                prefetchers > 0 || replayPath != nullptr ||
+                compression != Compression::NONE)) {
+    bail("-U can only be combined with -o\n");
+  }
+  if (rangeOffset + rangeSize > FILESIZE || rangeSize == 0) {
+    bail("-R must be a nonempty range of the file\n");
+  }
+  if (outPath != nullptr) {
+    outFd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd == -1) {
+      pbail("open %s", outPath);
     }
-    if (connect(sfd, info->ai_addr, info->ai_addrlen) == -1) {
-      continue;
+    // Whatever is never written stays a hole.
+    if (ftruncate(outFd, FILESIZE) == -1) {
+      pbail("ftruncate");
+    }
+  }
+
+  if (local) {
+    LocalClient client;
+    if (!client.connect(argv[optind])) {
+      exit(1);
+    }
+    if (client.fileSize() < FILESIZE) {
+      bail("the server's file is under %" PRIu64 " bytes\n", FILESIZE);
     }
     fprintf(stderr, "connected\n");
-    break;
+    std::atomic<uint64_t> next{0};
+    Latch done(NUMBLOCKS);
+    for (int i = 0; i < NUMBLOCKS; ++i) {
+      spawn(localReader(client, next), done);
+    }
+    std::thread(t_reportLocal).detach();
+    done.wait();
+    return 0;
   }
-  if (info == nullptr) {
-    bail("failed to connect");
+
+  if (oldPath != nullptr || uploadPath != nullptr) {
+    const int sfd = connectTo(argv[optind]);
+    if (sfd == -1) {
+      exit(1);
+    }
+    fprintf(stderr, "connected\n");
+    if (oldPath != nullptr) {
+      reconstruct(sfd, oldPath);
+    } else {
+      upload(sfd, uploadPath);
+    }
+    return 0;
   }
-  freeaddrinfo(info_base);
-  info_base = nullptr;
 
-  std::thread requester(t_req, sfd);
-  std::thread receiver(t_recv, sfd);
-  requester.join();
-  receiver.join();
+  PoolOptions options;
+  options.connections = connections;
+  options.window = NUMBLOCKS;
+  options.fixedCodec = fixedCodec;
+  options.compression = compression;
+  options.flags = reqFlags;
+  options.cacheBlocks = cacheBlocks;
+  options.fileSize = FILESIZE;
+  options.sink = [](int sock) {
+    return std::unique_ptr<PayloadSink>(new Sink(sock));
+  };
+  if (striped) {
+    // Each stream has a pool of its own, so its stats are its connection's.
+    options.connections = 1;
+    download(argv[optind], options, connections, rangeOffset, rangeSize);
+    return 0;
+  }
+  Pool pool(options);
+  if (!pool.connect(argv[optind])) {
+    exit(1);
+  }
+  fprintf(stderr, "connected\n");
+  if (replayPath != nullptr) {
+    replay(pool, replayPath, asFast, connections, cacheBlocks > 0);
+    return 0;
+  }
+  // Enough readers to fill every connection's window.
+  const unsigned readers = NUMBLOCKS * connections;
+  std::atomic<uint64_t> next{0};
+  // With interactive readers, the benchmark's reads are scheduled too, at
+  // the lowest priority, so the server can put the interactive ones first.
+  Schedule bulk;
+  if (probers > 0) {
+    bulk.priority = 1;
+  }
+  Latch done(readers + probers);
+  for (unsigned i = 0; i < readers; ++i) {
+    spawn(reader(pool, next, bulk), done);
+  }
+  Probes probes;
+  const Schedule interactive{.priority = 2, .deadlineUs = deadlineUs};
+  for (unsigned i = 0; i < probers; ++i) {
+    spawn(prober(pool, probes, interactive, i), done);
+  }
+  if (probers > 0) {
+    std::thread(t_report, std::ref(probes)).detach();
+  }
+  Prefetches prefetches;
+  for (unsigned i = 0; i < prefetchers; ++i) {
+    std::thread(t_prefetch, std::ref(pool), std::ref(prefetches),
+                cancelPercent, i)
+        .detach();
+  }
+  if (prefetchers > 0) {
+    std::thread(t_reportPrefetches, std::ref(prefetches)).detach();
+  }
+  if (compression != Compression::NONE) {
+    std::thread(t_reportCompression, std::ref(pool)).detach();
+  }
+  done.wait();
 
   return 0;
 }
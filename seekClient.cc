@@ -0,0 +1,968 @@
+#include "seekClient.h"
+
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <thread>
+
+#include "io.h"
+
+namespace {
+
+const char PORT_STR[] = "9999";
+
+class RecvSink : public PayloadSink {
+ public:
+  explicit RecvSink(int sock) : sock(sock) {}
+
+  bool receive(size_t size, off_t, uint8_t *buf) override {
+    const ssize_t n = recvFull(sock, buf, size);
+    if (n == -1) {
+      perror("recv");
+    } else if (size_t(n) != size) {
+      fprintf(stderr, "connection closed mid-response\n");
+    }
+    return size_t(n) == size;
+  }
+  bool copies() const override { return true; }
+
+ private:
+  int sock;
+};
+
+}  // namespace
+
+// A request and where its response goes.
+struct Op {
+  std::vector<LReq> ranges;
+  uint8_t *buf;
+  // Called once the response is in `buf`, on the receiver thread, or once
+  // the request has failed or expired.
+  std::function<void(bool ok)> done;
+  Schedule schedule;
+  Cancel *cancel = nullptr;
+  // Set when sent if `schedule` isn't the default or there's a `cancel`.
+  // The server answers each range separately, so this tracks the next one
+  // and where it goes.
+  uint32_t id = 0;
+  size_t nextRange = 0;
+  size_t pos = 0;
+  // Set once a range has been cut short by expiry or cancellation.
+  bool cut = false;
+};
+
+// A cache miss in flight and the reads waiting on it.
+struct Fetch {
+  struct Waiter {
+    uint32_t from;
+    uint32_t size;
+    uint8_t *buf;
+    Latch *latch;
+    std::atomic<bool> *failed;
+  };
+  uint64_t block;
+  std::vector<uint8_t> data;
+  std::vector<Waiter> waiters;
+  Op op;
+};
+
+// CLOCK over a fixed set of slots: a hit sets its slot's reference bit, and
+// the hand clears set bits until it comes to a clear one to evict.
+class BlockCache {
+ public:
+  explicit BlockCache(size_t slots)
+      : data(slots * CACHE_BLOCK), blocks(slots, EMPTY), referenced(slots) {}
+
+  // Copy `size` bytes from `from` in `block` into `buf`, if it's cached.
+  bool lookup(uint64_t block, uint32_t from, uint32_t size, uint8_t *buf) {
+    const auto it = index.find(block);
+    if (it == index.end()) {
+      return false;
+    }
+    referenced[it->second] = true;
+    memcpy(buf, &data[it->second * CACHE_BLOCK] + from, size);
+    return true;
+  }
+
+  void insert(uint64_t block, const uint8_t *bytes, size_t size) {
+    while (referenced[hand]) {
+      referenced[hand] = false;
+      hand = (hand + 1) % blocks.size();
+    }
+    const size_t slot = hand;
+    hand = (hand + 1) % blocks.size();
+    if (blocks[slot] != EMPTY) {
+      index.erase(blocks[slot]);
+    }
+    blocks[slot] = block;
+    index[block] = slot;
+    referenced[slot] = true;
+    memcpy(&data[slot * CACHE_BLOCK], bytes, size);
+  }
+
+ private:
+  static constexpr uint64_t EMPTY = UINT64_MAX;
+
+  std::vector<uint8_t> data;
+  // The block in each slot, or EMPTY.
+  std::vector<uint64_t> blocks;
+  std::vector<bool> referenced;
+  std::unordered_map<uint64_t, size_t> index;
+  size_t hand = 0;
+};
+
+class Connection {
+ public:
+  explicit Connection(const PoolOptions &options) : options(options) {}
+  ~Connection();
+
+  bool open(const char *host);
+  bool copies() const { return sink->copies(); }
+  uint64_t dataBytes() const { return data; }
+  uint64_t wireBytes() const { return wire; }
+
+  // Queue `op`, or fail it if the connection has failed.
+  void submit(Op *op);
+  // Requests queued or outstanding; the most possible once failed.
+  size_t load();
+  // Take `op` off the queue and return it, or if it's in flight, ask the
+  // server to stop sending it and return null. Its Cancel's lock is held.
+  Op *cancel(Op *op);
+
+ private:
+  void t_send();
+  void t_recv();
+  bool receive(const Op &op);
+  bool receiveScheduled();
+  bool receiveFrames(const LReq &range, uint8_t *buf, bool &cut);
+  bool receiveCompressed(uint32_t size, uint64_t offset, uint64_t end,
+                         uint8_t *buf, uint64_t &taken);
+  // Detach `op` from its Cancel and call its done().
+  void finish(Op *op, bool ok);
+  // Fail every request; receiver thread only, as it may be filling one.
+  void failAll();
+
+  const PoolOptions &options;
+  int sock = -1;
+  std::unique_ptr<PayloadSink> sink;
+  FlatbufferCodec flatbuffers;
+  FixedCodec fixed;
+  // What the server accepted, and a COMPRESSED frame's payload and block.
+  Compression compression = Compression::NONE;
+  std::vector<uint8_t> packed;
+  std::vector<uint8_t> unpacked;
+  std::atomic<uint64_t> data{0};
+  std::atomic<uint64_t> wire{0};
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<Op *> pending;
+  // Sent, in response order.
+  std::deque<Op *> inflight;
+  // Ids of requests in flight to cancel.
+  std::vector<uint32_t> cancels;
+  bool failed = false;
+  bool closing = false;
+  std::thread sender;
+  std::thread receiver;
+  uint32_t nextId = 1;
+};
+
+Connection::~Connection() {
+  {
+    const std::lock_guard<std::mutex> lock(mu);
+    closing = true;
+  }
+  cv.notify_all();
+  if (sock != -1) {
+    shutdown(sock, SHUT_RDWR);
+  }
+  if (sender.joinable()) {
+    sender.join();
+  }
+  if (receiver.joinable()) {
+    receiver.join();
+  }
+  if (sock != -1) {
+    close(sock);
+  }
+}
+
+bool Connection::open(const char *host) {
+  sock = connectTo(host);
+  if (sock == -1) {
+    return false;
+  }
+  if (options.compression != Compression::NONE) {
+    compression = options.compression;
+    if (!requestCompression(sock, compression) ||
+        compression != options.compression) {
+      fprintf(stderr, "server did not accept %s compression\n",
+              compressionName(options.compression));
+      return false;
+    }
+    unpacked.resize(COMPRESS_BLOCK);
+  }
+  if (options.fixedCodec && !requestFixedCodec(sock)) {
+    fprintf(stderr, "server did not accept the fixed codec\n");
+    return false;
+  }
+  if (options.sink) {
+    sink = options.sink(sock);
+  } else {
+    sink.reset(new RecvSink(sock));
+  }
+  sender = std::thread(&Connection::t_send, this);
+  receiver = std::thread(&Connection::t_recv, this);
+  return true;
+}
+
+void Connection::submit(Op *op) {
+  // Held until the op is queued, so cancel() finds it.
+  std::unique_lock<std::mutex> cancelLock;
+  if (op->cancel != nullptr) {
+    cancelLock = std::unique_lock<std::mutex>(op->cancel->mu);
+  }
+  {
+    const std::lock_guard<std::mutex> lock(mu);
+    if (!failed && !(op->cancel != nullptr && op->cancel->cancelled)) {
+      pending.push_back(op);
+      if (op->cancel != nullptr) {
+        op->cancel->connection = this;
+        op->cancel->op = op;
+      }
+      op = nullptr;
+    }
+  }
+  if (cancelLock) {
+    cancelLock.unlock();
+  }
+  if (op != nullptr) {
+    op->done(false);
+    return;
+  }
+  cv.notify_all();
+}
+
+size_t Connection::load() {
+  const std::lock_guard<std::mutex> lock(mu);
+  return failed ? SIZE_MAX : pending.size() + inflight.size();
+}
+
+Op *Connection::cancel(Op *op) {
+  const std::lock_guard<std::mutex> lock(mu);
+  const auto queued = std::find(pending.begin(), pending.end(), op);
+  if (queued != pending.end()) {
+    pending.erase(queued);
+    return op;
+  }
+  if (!failed && op->id != 0) {
+    cancels.push_back(op->id);
+    cv.notify_all();
+  }
+  return nullptr;
+}
+
+void Connection::t_send() {
+  std::vector<uint8_t> out;
+  std::vector<Op *> refused;
+  while (true) {
+    std::unique_lock<std::mutex> lock(mu);
+    cv.wait(lock, [this]() {
+      return failed || closing || !cancels.empty() ||
+             (!pending.empty() && inflight.size() < options.window);
+    });
+    if (failed || closing) {
+      return;
+    }
+    // Cancellations, then everything the window has room for, go out in one
+    // send().
+    out.clear();
+    for (const uint32_t id : cancels) {
+      const Bytes msg = flatbuffers.encodeCancel(id);
+      out.insert(out.end(), msg.data, msg.data + msg.size);
+    }
+    cancels.clear();
+    while (!pending.empty() && inflight.size() < options.window) {
+      Op *op = pending.front();
+      pending.pop_front();
+      inflight.push_back(op);
+      if (op->schedule.priority != 0 || op->schedule.deadlineUs != 0 ||
+          op->cancel != nullptr) {
+        op->id = nextId++;
+        nextId += nextId == 0;
+        for (auto &range : op->ranges) {
+          range.id = op->id;
+          range.priority = op->schedule.priority;
+          range.deadlineUs = op->schedule.deadlineUs;
+        }
+      }
+      const Bytes msg = options.fixedCodec ? fixed.encode(op->ranges)
+                                           : flatbuffers.encode(op->ranges);
+      if (msg.size == 0) {
+        // A size the codec can't carry; readv() should have refused it.
+        inflight.pop_back();
+        refused.push_back(op);
+        continue;
+      }
+      out.insert(out.end(), msg.data, msg.data + msg.size);
+    }
+    lock.unlock();
+    // The receiver may be waiting for something to be in flight.
+    cv.notify_all();
+    for (Op *op : refused) {
+      fprintf(stderr, "request too large to encode\n");
+      finish(op, false);
+    }
+    refused.clear();
+    if (!sendFull(sock, out.data(), out.size())) {
+      perror("send");
+      lock.lock();
+      failed = true;
+      lock.unlock();
+      // Wakes the receiver to fail the requests.
+      shutdown(sock, SHUT_RDWR);
+      cv.notify_all();
+      return;
+    }
+  }
+}
+
+void Connection::t_recv() {
+  while (true) {
+    Op *op;
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      cv.wait(lock,
+              [this]() { return failed || closing || !inflight.empty(); });
+      if (failed || closing) {
+        break;
+      }
+      op = inflight.front();
+    }
+    if (op->id != 0) {
+      if (!receiveScheduled()) {
+        break;
+      }
+      continue;
+    }
+    if (!receive(*op)) {
+      break;
+    }
+    {
+      const std::lock_guard<std::mutex> lock(mu);
+      inflight.pop_front();
+    }
+    cv.notify_all();
+    finish(op, true);
+  }
+  failAll();
+}
+
+bool Connection::receive(const Op &op) {
+  size_t pos = 0;
+  bool cut;
+  for (const auto &range : op.ranges) {
+    if ((range.flags & LREQ_SPARSE) || compression != Compression::NONE) {
+      if (!receiveFrames(range, op.buf + pos, cut)) {
+        return false;
+      }
+    } else if (!sink->receive(range.size, range.offset, op.buf + pos)) {
+      return false;
+    } else {
+      data += range.size;
+      wire += range.size;
+    }
+    pos += range.size;
+  }
+  return true;
+}
+
+// Receive the response to one range of a request with an id. It can be for
+// any of those sent before the first request without one, which is answered
+// in order.
+bool Connection::receiveScheduled() {
+  uint8_t header[Frame::HEADER_SIZE];
+  Frame frame;
+  if (recvFull(sock, header, sizeof(header)) != sizeof(header)) {
+    fprintf(stderr, "connection closed mid-response\n");
+    return false;
+  } else if (!frame.decode(header) || frame.kind != Frame::ID) {
+    fprintf(stderr, "expected an ID frame\n");
+    return false;
+  }
+  Op *op = nullptr;
+  {
+    const std::lock_guard<std::mutex> lock(mu);
+    for (Op *candidate : inflight) {
+      if (candidate->id == 0) {
+        break;
+      } else if (candidate->id == frame.size) {
+        op = candidate;
+        break;
+      }
+    }
+  }
+  if (op == nullptr) {
+    fprintf(stderr, "response for unknown id %" PRIu32 "\n", frame.size);
+    return false;
+  }
+  const LReq &range = op->ranges[op->nextRange];
+  bool cut;
+  if (!receiveFrames(range, op->buf + op->pos, cut)) {
+    return false;
+  }
+  op->cut |= cut;
+  op->pos += range.size;
+  if (++op->nextRange < op->ranges.size()) {
+    return true;
+  }
+  {
+    const std::lock_guard<std::mutex> lock(mu);
+    inflight.erase(std::find(inflight.begin(), inflight.end(), op));
+  }
+  cv.notify_all();
+  finish(op, !op->cut);
+  return true;
+}
+
+// Receive the frames of `range`, expanding zero runs into `buf` if the sink
+// copies and decompressing compressed blocks. An EXPIRED or CANCELLED frame
+// ends it early, setting `cut`.
+bool Connection::receiveFrames(const LReq &range, uint8_t *buf, bool &cut) {
+  cut = false;
+  uint64_t done = 0;
+  while (done < range.size) {
+    uint8_t header[Frame::HEADER_SIZE];
+    if (recvFull(sock, header, sizeof(header)) != sizeof(header)) {
+      fprintf(stderr, "connection closed mid-response\n");
+      return false;
+    }
+    Frame frame;
+    if (!frame.decode(header) || frame.size > range.size - done) {
+      fprintf(stderr, "bad frame\n");
+      return false;
+    } else if (frame.kind == Frame::EXPIRED ||
+               frame.kind == Frame::CANCELLED) {
+      cut = true;
+      return true;
+    } else if (frame.kind == Frame::COMPRESSED) {
+      uint64_t taken;
+      if (compression == Compression::NONE ||
+          !receiveCompressed(frame.size, range.offset + done,
+                             range.offset + range.size, buf + done, taken)) {
+        return false;
+      }
+      done += taken;
+      continue;
+    } else if (frame.kind != Frame::DATA && frame.kind != Frame::ZEROS) {
+      fprintf(stderr, "bad frame\n");
+      return false;
+    }
+    if (frame.kind == Frame::DATA) {
+      if (!sink->receive(frame.size, range.offset + done, buf + done)) {
+        return false;
+      }
+      data += frame.size;
+      wire += frame.size;
+    } else if (sink->copies()) {
+      memset(buf + done, 0, frame.size);
+    }
+    done += frame.size;
+  }
+  return true;
+}
+
+// Receive a COMPRESSED frame of `size` bytes, holding the block `offset` is
+// in, and deliver the block from `offset` to its end or `end`, whichever is
+// first. Sets `taken` to how much that is.
+bool Connection::receiveCompressed(uint32_t size, uint64_t offset,
+                                   uint64_t end, uint8_t *buf,
+                                   uint64_t &taken) {
+  packed.resize(size);
+  if (recvFull(sock, packed.data(), size) != ssize_t(size)) {
+    fprintf(stderr, "connection closed mid-response\n");
+    return false;
+  }
+  const uint64_t start = offset / COMPRESS_BLOCK * COMPRESS_BLOCK;
+  const size_t from = offset - start;
+  taken = std::min(end, start + COMPRESS_BLOCK) - offset;
+  // A whole block can go straight into the reader's buffer.
+  uint8_t *block = from == 0 && taken == COMPRESS_BLOCK && sink->copies()
+                       ? buf
+                       : unpacked.data();
+  const long n = decompressBlock(compression, packed.data(), size, block,
+                                 COMPRESS_BLOCK);
+  if (n < 0 || uint64_t(n) < from + taken) {
+    fprintf(stderr, "bad compressed frame\n");
+    return false;
+  }
+  data += taken;
+  wire += size;
+  return sink->deliver(block + from, taken, offset, buf);
+}
+
+void Connection::failAll() {
+  std::deque<Op *> ops;
+  {
+    const std::lock_guard<std::mutex> lock(mu);
+    failed = true;
+    ops.swap(inflight);
+    ops.insert(ops.end(), pending.begin(), pending.end());
+    pending.clear();
+  }
+  cv.notify_all();
+  shutdown(sock, SHUT_RDWR);
+  for (Op *op : ops) {
+    finish(op, false);
+  }
+}
+
+void Connection::finish(Op *op, bool ok) {
+  if (op->cancel != nullptr) {
+    const std::lock_guard<std::mutex> lock(op->cancel->mu);
+    op->cancel->connection = nullptr;
+    op->cancel->op = nullptr;
+  }
+  op->done(ok);
+}
+
+void Cancel::cancel() {
+  Op *dropped = nullptr;
+  {
+    const std::lock_guard<std::mutex> lock(mu);
+    cancelled = true;
+    if (connection != nullptr) {
+      dropped = connection->cancel(op);
+    }
+    if (dropped != nullptr) {
+      connection = nullptr;
+      op = nullptr;
+    }
+  }
+  if (dropped != nullptr) {
+    dropped->done(false);
+  }
+}
+
+int connectTo(const char *host) {
+  // A single colon separates a port; IPv6 addresses have several.
+  std::string name = host;
+  std::string port = PORT_STR;
+  const size_t colon = name.rfind(':');
+  if (colon != std::string::npos && name.find(':') == colon) {
+    port = name.substr(colon + 1);
+    name.resize(colon);
+  }
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *info_base;
+  const int err =
+      getaddrinfo(name.c_str(), port.c_str(), &hints, &info_base);
+  if (err != 0) {
+    fprintf(stderr, "getaddrinfo %s: %s\n", host, gai_strerror(err));
+    return -1;
+  }
+  int sfd = -1;
+  for (struct addrinfo *info = info_base; info != nullptr;
+       info = info->ai_next) {
+    sfd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (sfd == -1) {
+      continue;
+    }
+    if (connect(sfd, info->ai_addr, info->ai_addrlen) == 0) {
+      break;
+    }
+    close(sfd);
+    sfd = -1;
+  }
+  freeaddrinfo(info_base);
+  if (sfd == -1) {
+    fprintf(stderr, "failed to connect to %s\n", host);
+  }
+  return sfd;
+}
+
+Pool::Pool(const PoolOptions &options) : options(options) {
+  if (options.cacheBlocks > 0) {
+    cache.reset(new BlockCache(options.cacheBlocks));
+  }
+}
+
+Pool::~Pool() = default;
+
+bool Pool::connect(const char *host) {
+  if (cache && options.fileSize == 0) {
+    fprintf(stderr, "the cache needs the file size\n");
+    return false;
+  }
+  for (unsigned i = 0; i < options.connections; ++i) {
+    connections.emplace_back(new Connection(options));
+    if (!connections.back()->open(host)) {
+      return false;
+    }
+    if (cache && !connections.back()->copies()) {
+      fprintf(stderr, "the cache needs a sink that copies\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+uint64_t Pool::dataBytes() const {
+  uint64_t bytes = 0;
+  for (const auto &connection : connections) {
+    bytes += connection->dataBytes();
+  }
+  return bytes;
+}
+
+uint64_t Pool::wireBytes() const {
+  uint64_t bytes = 0;
+  for (const auto &connection : connections) {
+    bytes += connection->wireBytes();
+  }
+  return bytes;
+}
+
+void Pool::submit(Op *op) {
+  Connection *least = nullptr;
+  size_t leastLoad = SIZE_MAX;
+  for (const auto &connection : connections) {
+    const size_t load = connection->load();
+    if (least == nullptr || load < leastLoad) {
+      least = connection.get();
+      leastLoad = load;
+    }
+  }
+  if (least == nullptr) {
+    fprintf(stderr, "read before connect\n");
+    op->done(false);
+    return;
+  }
+  least->submit(op);
+}
+
+Task<bool> Pool::read(uint64_t offset, uint64_t size, uint8_t *buf,
+                      Schedule schedule, Cancel *cancel) {
+  std::vector<LReq> ranges(1);
+  ranges[0] = LReq{.offset = int64_t(offset), .size = size};
+  co_return co_await readv(std::move(ranges), buf, schedule, cancel);
+}
+
+Task<std::vector<uint8_t>> Pool::read(uint64_t offset, uint64_t size,
+                                      Schedule schedule, Cancel *cancel) {
+  std::vector<uint8_t> buf(size);
+  if (!co_await read(offset, size, buf.data(), schedule, cancel)) {
+    buf.clear();
+  }
+  co_return buf;
+}
+
+Task<bool> Pool::readv(std::vector<LReq> ranges, uint8_t *buf,
+                       Schedule schedule, Cancel *cancel) {
+  if (cancel != nullptr && (cache || options.fixedCodec)) {
+    fprintf(stderr, "reads through the cache or the fixed codec can't be "
+            "cancelled\n");
+    co_return false;
+  } else if (options.fixedCodec &&
+             (schedule.priority != 0 || schedule.deadlineUs != 0)) {
+    fprintf(stderr, "reads over the fixed codec can't be scheduled\n");
+    co_return false;
+  }
+  for (auto &range : ranges) {
+    // Servers drop reads past the end without a response.
+    if (range.offset < 0 ||
+        (options.fileSize > 0 &&
+         uint64_t(range.offset) + range.size > options.fileSize)) {
+      fprintf(stderr, "read of %" PRIu64 " bytes at %" PRId64
+              " is outside the file\n", range.size, range.offset);
+      co_return false;
+    } else if (range.size > UINT32_MAX &&
+               (ranges.size() > 1 || options.fixedCodec)) {
+      // Only a single flatbuffers range has a 64-bit size.
+      fprintf(stderr, "gather ranges and fixed codec reads must be under "
+              "4 GiB\n");
+      co_return false;
+    }
+    range = LReq{.offset = range.offset,
+                 .size = range.size,
+                 .flags = options.flags |
+                          (range.flags & (LREQ_BULK | LREQ_SPARSE))};
+  }
+  if (cache) {
+    co_return co_await readCached(ranges, buf, schedule);
+  }
+  Latch latch(1);
+  bool ok = false;
+  Op op{std::move(ranges), buf,
+        [&](bool result) {
+          ok = result;
+          latch.countDown();
+        },
+        schedule, cancel};
+  submit(&op);
+  co_await latch;
+  co_return ok;
+}
+
+// Serve each block `ranges` touch from the cache, joining the fetch of any
+// missing block already in flight and starting the rest.
+Task<bool> Pool::readCached(const std::vector<LReq> &ranges, uint8_t *buf,
+                            Schedule schedule) {
+  size_t parts = 0;
+  for (const auto &range : ranges) {
+    if (range.size > 0) {
+      parts += (range.offset + range.size - 1) / CACHE_BLOCK -
+               range.offset / CACHE_BLOCK + 1;
+    }
+  }
+  Latch latch(parts);
+  std::atomic<bool> failed{false};
+  std::vector<Fetch *> started;
+  size_t hit = 0;
+  {
+    const std::lock_guard<std::mutex> lock(cacheMu);
+    uint8_t *dest = buf;
+    for (const auto &range : ranges) {
+      const uint64_t end = range.offset + range.size;
+      for (uint64_t at = range.offset; at < end;) {
+        const uint64_t block = at / CACHE_BLOCK;
+        const uint32_t from = at % CACHE_BLOCK;
+        const uint32_t n = std::min(uint64_t(CACHE_BLOCK - from), end - at);
+        if (cache->lookup(block, from, n, dest)) {
+          hit++;
+        } else {
+          Fetch *&fetch = fetching[block];
+          if (fetch == nullptr) {
+            fetch = new Fetch;
+            fetch->block = block;
+            const uint64_t start = block * CACHE_BLOCK;
+            const uint32_t size =
+                std::min(uint64_t(CACHE_BLOCK), options.fileSize - start);
+            fetch->data.resize(size);
+            Fetch *f = fetch;
+            fetch->op = Op{{LReq{.offset = int64_t(start),
+                                 .size = size,
+                                 .flags = options.flags,
+                                 .trace = 0}},
+                           fetch->data.data(),
+                           [this, f](bool ok) { fetched(f, ok); }, schedule};
+            started.push_back(fetch);
+          }
+          fetch->waiters.push_back(
+              Fetch::Waiter{from, n, dest, &latch, &failed});
+        }
+        dest += n;
+        at += n;
+      }
+    }
+  }
+  hits += hit;
+  misses += parts - hit;
+  fetches += started.size();
+  for (size_t i = 0; i < hit; ++i) {
+    latch.countDown();
+  }
+  for (Fetch *fetch : started) {
+    submit(&fetch->op);
+  }
+  co_await latch;
+  co_return !failed;
+}
+
+void Pool::fetched(Fetch *fetch, bool ok) {
+  std::vector<Fetch::Waiter> waiters;
+  {
+    const std::lock_guard<std::mutex> lock(cacheMu);
+    fetching.erase(fetch->block);
+    if (ok) {
+      cache->insert(fetch->block, fetch->data.data(), fetch->data.size());
+    }
+    waiters.swap(fetch->waiters);
+  }
+  for (const auto &waiter : waiters) {
+    if (ok) {
+      memcpy(waiter.buf, fetch->data.data() + waiter.from, waiter.size);
+    } else {
+      waiter.failed->store(true);
+    }
+    waiter.latch->countDown();
+  }
+  delete fetch;
+}
+
+// Awaits a read's completion.
+struct LocalClient::Read {
+  LocalClient *client;
+  uint64_t offset;
+  uint64_t size;
+  std::coroutine_handle<> waiter;
+  const uint8_t *result = nullptr;
+
+  bool await_ready() { return false; }
+  bool await_suspend(std::coroutine_handle<> h) {
+    waiter = h;
+    return client->submit(this);
+  }
+  const uint8_t *await_resume() { return result; }
+};
+
+LocalClient::~LocalClient() {
+  closing = true;
+  if (completer.joinable()) {
+    completer.join();
+  }
+  if (shared != nullptr) {
+    munmap(shared, sizeof(LocalShared));
+  }
+  if (data != nullptr) {
+    munmap(const_cast<uint8_t *>(data), bytes);
+  }
+  if (sock != -1) {
+    close(sock);
+  }
+}
+
+bool LocalClient::connect(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path %s is too long\n", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+  sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1 ||
+      ::connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "failed to connect to %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  int fileFd;
+  int memfd;
+  if (!receiveLocal(sock, fileFd, memfd)) {
+    fprintf(stderr, "%s passed no file\n", path);
+    return false;
+  }
+  struct stat st;
+  void *ring = MAP_FAILED;
+  if (fstat(memfd, &st) == 0 && size_t(st.st_size) >= sizeof(LocalShared)) {
+    ring = mmap(nullptr, sizeof(LocalShared), PROT_READ | PROT_WRITE,
+                MAP_SHARED, memfd, 0);
+  }
+  close(memfd);
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "%s passed no ring\n", path);
+    close(fileFd);
+    return false;
+  }
+  shared = static_cast<LocalShared *>(ring);
+  if (shared->magic != LOCAL_MAGIC || shared->version != LOCAL_VERSION) {
+    fprintf(stderr, "%s isn't a local transport\n", path);
+    close(fileFd);
+    return false;
+  }
+  bytes = shared->fileSize;
+  if (bytes > 0) {
+    void *map = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fileFd, 0);
+    if (map == MAP_FAILED) {
+      perror("mmap");
+      close(fileFd);
+      return false;
+    }
+    data = static_cast<const uint8_t *>(map);
+  }
+  // The mapping keeps the file.
+  close(fileFd);
+  completer = std::thread(&LocalClient::t_complete, this);
+  return true;
+}
+
+Task<const uint8_t *> LocalClient::read(uint64_t offset, uint64_t size) {
+  co_return co_await Read{this, offset, size};
+}
+
+bool LocalClient::submit(Read *read) {
+  const std::lock_guard<std::mutex> lock(mu);
+  if (failed) {
+    return false;
+  }
+  if (inflight.size() < LOCAL_RING) {
+    send(read);
+  } else {
+    backlog.push_back(read);
+  }
+  return true;
+}
+
+// Push `read` onto the request ring; `mu` is held.
+void LocalClient::send(Read *read) {
+  const LocalSlot slot = {.offset = int64_t(read->offset),
+                          .size = read->size,
+                          .tag = reinterpret_cast<uintptr_t>(read)};
+  shared->requests.push(slot);
+  inflight.insert(read);
+}
+
+void LocalClient::t_complete() {
+  LocalSlot slot;
+  while (!closing) {
+    if (!shared->completions.pop(slot)) {
+      shared->completions.awaitItems();
+      if (peerGone(sock)) {
+        fprintf(stderr, "local server disconnected\n");
+        break;
+      }
+      continue;
+    }
+    // The tag is only dereferenced once it's known to be a read in flight,
+    // so a corrupt or repeated completion can't resume a finished one.
+    Read *read = reinterpret_cast<Read *>(slot.tag);
+    {
+      const std::lock_guard<std::mutex> lock(mu);
+      if (inflight.erase(read) == 0) {
+        read = nullptr;
+      } else if (!backlog.empty()) {
+        send(backlog.front());
+        backlog.pop_front();
+      }
+    }
+    if (read == nullptr) {
+      fprintf(stderr, "local completion for a read not in flight\n");
+      break;
+    }
+    if (slot.status == LOCAL_OK) {
+      read->result = data + read->offset;
+    } else {
+      fprintf(stderr, "invalid local read of %" PRIu64 " bytes at %" PRId64
+              "\n", slot.size, slot.offset);
+    }
+    read->waiter.resume();
+  }
+  failAll();
+}
+
+void LocalClient::failAll() {
+  std::unordered_set<Read *> reads;
+  {
+    const std::lock_guard<std::mutex> lock(mu);
+    failed = true;
+    reads.swap(inflight);
+    reads.insert(backlog.begin(), backlog.end());
+    backlog.clear();
+  }
+  for (Read *read : reads) {
+    read->waiter.resume();
+  }
+}
@@ -0,0 +1,395 @@
+#ifndef SEEKCLIENT_H
+#define SEEKCLIENT_H
+/*
+  Client library for seekable servers, built on C++20 coroutines.
+
+  A Pool holds connections to one server, and reads are awaited:
+
+    Task<bool> first(Pool &pool, uint8_t *buf) {
+      co_return co_await pool.read(0, 4096, buf);
+    }
+
+  Each connection has a sender and a receiver thread. Reads queue on the
+  least loaded connection and go out, coalesced into as few send() calls as
+  possible, while it has fewer than `window` requests outstanding: the depth
+  the server's queue takes without stalling its receiver. Responses return in
+  order, so every reader shares the connection's pipeline. A read resumes on
+  its connection's receiver thread once its bytes are in its buffer, so code
+  after co_await should be short or hand off to another thread.
+
+  A read with a Schedule gets an id, and the server may answer it out of
+  order by its priority and deadline; one that misses its deadline fails.
+  Reads without one are answered in order. See scheduler.h.
+
+  A read given a Cancel can be cancelled while queued or in flight, which
+  also gives it an id: the server stops sending it within
+  MAX_SCHEDULED_FRAME bytes, so a large read can be abandoned without
+  draining it.
+
+  With compression, the server may send blocks of the file compressed (see
+  COMPRESSED in wire.h), and they're decompressed on the receiver thread
+  before they reach the sink. Servers that don't support it must not be
+  asked for it.
+
+  With a cache, reads are served from CACHE_BLOCK-sized blocks of the file
+  held in memory and evicted by CLOCK. Concurrent misses on a block share a
+  single request for it.
+
+  A LocalClient instead reads from a server on the same host over its local
+  transport (see localRing.h): without copies, straight from a mapping of
+  the file, once the server has made the range resident.
+
+  Errors are reported on stderr. A read that fails returns false, and its
+  connection isn't used again.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "localRing.h"
+#include "wire.h"
+
+constexpr uint32_t CACHE_BLOCK = 64 * 1024;
+
+// A coroutine that runs when awaited, resuming its awaiter when done.
+template <class T>
+class Task;
+
+namespace detail {
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  struct Final {
+    bool await_ready() noexcept { return false; }
+    template <class P>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<P> h) noexcept {
+      return h.promise().continuation;
+    }
+    void await_resume() noexcept {}
+  };
+  Final final_suspend() noexcept { return {}; }
+  void unhandled_exception() { std::terminate(); }
+};
+
+template <class T>
+struct Result {
+  T value{};
+  void return_value(T v) { value = std::move(v); }
+  T take() { return std::move(value); }
+};
+
+template <>
+struct Result<void> {
+  void return_void() {}
+  void take() {}
+};
+
+// Runs as soon as it's called and frees itself when done.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+}  // namespace detail
+
+template <class T>
+class Task {
+ public:
+  struct promise_type : detail::PromiseBase, detail::Result<T> {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+  Task(Task &&other) : h(std::exchange(other.h, nullptr)) {}
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() {
+    if (h) {
+      h.destroy();
+    }
+  }
+
+  bool await_ready() { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+    h.promise().continuation = awaiter;
+    return h;
+  }
+  T await_resume() { return h.promise().take(); }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+
+  std::coroutine_handle<promise_type> h;
+};
+
+// Counts down from `count`; awaiting it, or wait(), returns once it reaches
+// zero. One waiter at a time. countDown() may be called from any thread, and
+// the last one resumes a waiting coroutine on that thread.
+class Latch {
+ public:
+  // The extra count is the waiter's, so whichever of it and the last
+  // countDown() comes second does the resuming.
+  explicit Latch(size_t count) : count(count + 1) {}
+
+  void countDown() {
+    if (count.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    if (waiter) {
+      waiter.resume();
+      return;
+    }
+    const std::lock_guard<std::mutex> lock(mu);
+    done = true;
+    cv.notify_all();
+  }
+
+  bool await_ready() { return false; }
+  bool await_suspend(std::coroutine_handle<> h) {
+    waiter = h;
+    return count.fetch_sub(1, std::memory_order_acq_rel) != 1;
+  }
+  void await_resume() {}
+
+  // Block the calling thread instead.
+  void wait() {
+    if (count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mu);
+    cv.wait(lock, [this]() { return done; });
+  }
+
+ private:
+  std::atomic<size_t> count;
+  std::coroutine_handle<> waiter;
+  std::mutex mu;
+  std::condition_variable cv;
+  bool done = false;
+};
+
+// Start `task` now, counting `latch` down when it finishes.
+inline detail::Detached spawn(Task<void> task, Latch &latch) {
+  co_await task;
+  latch.countDown();
+}
+
+// Run `task` to completion, blocking the calling thread.
+template <class T>
+T run(Task<T> task) {
+  Latch latch(1);
+  detail::Result<T> result;
+  [](Task<T> task, detail::Result<T> &result,
+     Latch &latch) -> detail::Detached {
+    if constexpr (std::is_void<T>::value) {
+      co_await task;
+    } else {
+      result.value = co_await task;
+    }
+    latch.countDown();
+  }(std::move(task), result, latch);
+  latch.wait();
+  return result.take();
+}
+
+// Consumes response payloads from a connection's socket. The default one
+// recv()s them into the reader's buffer.
+class PayloadSink {
+ public:
+  virtual ~PayloadSink() = default;
+  // Receive the `size` bytes at `offset` in the file, next on the socket,
+  // into `buf` if copies(). Returns false on error, having reported it.
+  virtual bool receive(size_t size, off_t offset, uint8_t *buf) = 0;
+  // Take the `size` bytes at `offset` in the file that have already been
+  // received to `data`, e.g. decompressed, copying them into `buf` if
+  // copies(). `data` may be `buf`.
+  virtual bool deliver(const uint8_t *data, size_t size, off_t offset,
+                       uint8_t *buf) {
+    if (copies() && data != buf) {
+      memcpy(buf, data, size);
+    }
+    return true;
+  }
+  virtual bool copies() const = 0;
+};
+
+// How the server is to schedule a read. The default, no priority and no
+// deadline, keeps it in order with the connection's other reads. Reads over
+// the fixed codec, which has no ids, can only have the default.
+struct Schedule {
+  uint8_t priority = 0;
+  // Microseconds the server may wait before sending, or 0 for no limit.
+  uint32_t deadlineUs = 0;
+};
+
+struct PoolOptions {
+  unsigned connections = 1;
+  // Requests each connection keeps outstanding.
+  unsigned window = 64;
+  // Requests in the fixed codec's 16-byte frames, which carry no id: reads
+  // can't then be scheduled or cancelled, and must be under 4 GiB.
+  bool fixedCodec = false;
+  // Compression to ask the server for; it fails to connect if refused.
+  Compression compression = Compression::NONE;
+  // LReq flags for every request; LREQ_BULK and LREQ_SPARSE.
+  uint32_t flags = 0;
+  // Blocks to cache, or 0 for no cache. The cache needs a sink that copies
+  // and the size of the server's file, which the last block is cut to.
+  size_t cacheBlocks = 0;
+  uint64_t fileSize = 0;
+  // Makes the sink for a connection's socket; null for the default.
+  std::function<std::unique_ptr<PayloadSink>(int sock)> sink;
+};
+
+// Connect to the server at `host`, HOST[:PORT] with port 9999 by default.
+// Returns the socket, or -1 having reported why.
+int connectTo(const char *host);
+
+class BlockCache;
+class Connection;
+struct Fetch;
+struct Op;
+
+// Cancels the read it's passed to; one read each. Not for reads through the
+// cache, whose fetches are shared, or over the fixed codec, which has no ids.
+class Cancel {
+ public:
+  // Fail the read unless it has finished. One not yet sent fails at once;
+  // one in flight fails once the server has stopped sending it. May be
+  // called from any thread, but must return before this is destroyed.
+  void cancel();
+
+ private:
+  friend class Connection;
+
+  std::mutex mu;
+  bool cancelled = false;
+  // Where the read is while it's queued or in flight.
+  Connection *connection = nullptr;
+  Op *op = nullptr;
+};
+
+class Pool {
+ public:
+  explicit Pool(const PoolOptions &options);
+  ~Pool();
+
+  // Open the connections to `host`. Returns false on error, having reported
+  // it.
+  bool connect(const char *host);
+
+  // Read `size` bytes at `offset` into `buf`.
+  Task<bool> read(uint64_t offset, uint64_t size, uint8_t *buf,
+                  Schedule schedule = Schedule(), Cancel *cancel = nullptr);
+  // The same into a new buffer, which is empty if the read failed.
+  Task<std::vector<uint8_t>> read(uint64_t offset, uint64_t size,
+                                  Schedule schedule = Schedule(),
+                                  Cancel *cancel = nullptr);
+  // Read `ranges` into `buf`, back to back, as one request. Only their
+  // offsets, sizes and flags are used: LREQ_BULK and LREQ_SPARSE, added to
+  // the pool's, and taken from the first range. Reads through the cache use
+  // the pool's alone. A range of a gather request, unlike a single one, must
+  // be under 4 GiB.
+  Task<bool> readv(std::vector<LReq> ranges, uint8_t *buf,
+                   Schedule schedule = Schedule(), Cancel *cancel = nullptr);
+
+  // Block reads served from the cache and not, and the requests made for
+  // the misses; concurrent misses on a block share one.
+  uint64_t cacheHits() const { return hits; }
+  uint64_t cacheMisses() const { return misses; }
+  uint64_t cacheFetches() const { return fetches; }
+
+  // Bytes of file data received, and the bytes they took on the wire, fewer
+  // where they came compressed. Zero runs count as neither.
+  uint64_t dataBytes() const;
+  uint64_t wireBytes() const;
+
+ private:
+  void submit(Op *op);
+  Task<bool> readCached(const std::vector<LReq> &ranges, uint8_t *buf,
+                        Schedule schedule);
+  void fetched(Fetch *fetch, bool ok);
+
+  PoolOptions options;
+  std::unique_ptr<BlockCache> cache;
+  // Guards the cache and `fetching`: the blocks being fetched, by index.
+  std::mutex cacheMu;
+  std::unordered_map<uint64_t, Fetch *> fetching;
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> fetches{0};
+  // Last, so they close, failing what they still hold, before the cache
+  // goes.
+  std::vector<std::unique_ptr<Connection>> connections;
+};
+
+// A connection to a server's local transport.
+class LocalClient {
+ public:
+  LocalClient() = default;
+  // Fails the reads still in flight.
+  ~LocalClient();
+
+  // Connect to the Unix socket at `path`. Returns false on error, having
+  // reported it.
+  bool connect(const char *path);
+  uint64_t fileSize() const { return bytes; }
+
+  // The `size` bytes at `offset`, in the client's mapping of the file, which
+  // lasts as long as the client; null if the read failed. Resumes on the
+  // client's completion thread.
+  Task<const uint8_t *> read(uint64_t offset, uint64_t size);
+
+ private:
+  struct Read;
+
+  // Queue `read` on the ring, or in the backlog if LOCAL_RING are already
+  // on it. Returns false if the client has failed.
+  bool submit(Read *read);
+  void send(Read *read);
+  void t_complete();
+  // Fail every read; completion thread only.
+  void failAll();
+
+  int sock = -1;
+  const uint8_t *data = nullptr;
+  uint64_t bytes = 0;
+  LocalShared *shared = nullptr;
+  // Guards the request ring, whose producer is whoever holds it, and the
+  // reads. At most LOCAL_RING are in flight, sent and not yet completed, so
+  // neither ring can fill and no side ever waits for space; the rest wait in
+  // the backlog.
+  std::mutex mu;
+  std::unordered_set<Read *> inflight;
+  std::deque<Read *> backlog;
+  bool failed = false;
+  std::atomic<bool> closing{false};
+  std::thread completer;
+};
+
+#endif
@@ -1,14 +1,91 @@
 /*
   Sends requested blocks from the input file repeatedly over a TCP socket.
   Uses sendfile().
+
+  With -s N, runs N shards instead of a single accept loop. Shard i listens on
+  its own SO_REUSEPORT socket, is pinned to the i-th CPU the process may run
+  on with a local NUMA memory policy, and serves each of its connections to
+  completion. N can't exceed the number of those CPUs; -s 0 runs one shard on
+  each. -b, which needs a shard on every CPU, additionally attaches a CBPF
+  program that steers each connection to the shard on the CPU that received
+  it.
+
+  With -d all, pages are dropped from the page cache once the client has
+  acknowledged them; with -d bulk, only for requests the client marks as bulk.
+  See dropBehind.h.
+
+  Each connection's ranges are queued for sending in a Scheduler: in order,
+  except that requests with an id are sent by priority and deadline, and
+  answered with an EXPIRED frame once too late. See scheduler.h. Requests
+  with an id can be cancelled: ranges not yet sent are skipped, and the one
+  being sent stops within MAX_SCHEDULED_FRAME bytes.
+
+  Requests with the sparse flag get framed responses in which holes in the
+  file are sent as zero runs instead of bytes; see Frame in wire.h.
+
+  With -x, the file's chunk index is loaded from FILE.chunks, or built and
+  saved there, and delta requests are served from it: only the chunks the
+  client doesn't already have are sent. See chunkIndex.h.
+
+  With -w, the file is opened for writing, created if missing, and write
+  requests are accepted. Each payload is spliced from the socket into the
+  file through a pipe, checked against the client's CRC-32 and acknowledged
+  once durable. Acknowledgements are held while the client keeps sending so
+  that one fdatasync() covers a batch of writes. -a preallocates each write's
+  range with fallocate() first. Reads are still checked against the file's
+  size at startup, and -w can't be combined with -x, whose index would go
+  stale.
+
+  With -f N, connections are served on fibers over N threads instead of on a
+  thread each: every connection's receiver and sender are fibers, scheduled
+  by work stealing, on nonblocking sockets that park the fiber rather than
+  the thread when they would block. Connections are served concurrently, so
+  tens of thousands can be open at once. See fiberIo.h.
+
+  With -F N[,RATE], clients share the sending fairly, whatever each one's
+  connections and pipeline depth: data goes out in FAIR_CHUNK turns, at most
+  N at once and at most RATE bytes per second in total, interleaved between
+  clients (peer addresses) in proportion to their weights. RATE should be
+  just under the link's, so that the backlog waits for turns rather than in
+  the network. -W ADDRESS=WEIGHT[,RATE] sets a client's weight, 1 by
+  default, and limits it to RATE bytes per second; -l RATE limits every other
+  client. Each client's wait for turns is added to stats dumps. See
+  fairShare.h.
+
+  With -L FILE, every read request received is captured to FILE: when, on
+  which connection, and its ranges, for seek-client -L to replay. See
+  capture.h.
+
+  With -Z THREADS[,CACHE_MIB], clients may negotiate compression, LZ4 or
+  zstd. Their reads get framed responses in which each COMPRESS_BLOCK of the
+  file goes as a COMPRESSED frame if it compresses well, and through
+  sendfile() as a DATA frame if not. Blocks are compressed by a pool of
+  THREADS threads as requests are received, and kept in a cache of at most
+  CACHE_MIB (by default COMPRESS_CACHE_MIB) MiB, so a hot block is
+  compressed once. -Z can't be combined with -w, whose writes would leave
+  cached blocks stale. See compressCache.h.
+
+  With -U PATH, clients on the same host can also connect to the Unix
+  socket at PATH. Each one is passed the file, read-only, and a ring in a
+  sealed memfd over which it queues ranges; a thread of its own makes each
+  range resident with MADV_POPULATE_READ on a mapping of the file and
+  queues it back, and the client reads it from a mapping of its own. See
+  localRing.h.
 */
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
@@ -16,17 +93,42 @@
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
+#include <memory>
+#include <new>
 #include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
-#include <cppchannel/channel>
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/fiber.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <boost/fiber/operations.hpp>
 
+#include "capture.h"
+#include "chunkIndex.h"
+#include "compressCache.h"
+#include "crcutil_blockword.h"
+#include "dropBehind.h"
+#include "extentMap.h"
+#include "fairShare.h"
+#include "fiberIo.h"
 #include "flatbuffers/flatbuffers.h"
+#include "io.h"
+#include "localRing.h"
 #include "log.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "trace.h"
 #include "wire.h"
 
 #define bail(...)                 \
@@ -48,7 +150,42 @@ const unsigned short PORT = 9999;
 constexpr size_t BLOCKSIZE = 64 * 1024;
 constexpr int NUMBLOCKS = 64;
 
-using Channel = cpp::channel<LReq, NUMBLOCKS>;
+using Channel = Scheduler<NUMBLOCKS>;
+using FiberChannel = Scheduler<NUMBLOCKS, boost::fibers::mutex,
+                               boost::fibers::condition_variable>;
+
+DropPolicy dropPolicy = DropPolicy::NONE;
+// Data extents of the served file, for sparse responses.
+ExtentMap extents;
+// Chunks of the served file, for delta requests; only loaded with -x.
+ChunkIndex chunkIndex;
+bool indexed = false;
+// Largest DATA frame a delta plan merges adjacent chunks into.
+constexpr uint32_t MAX_DATA_FRAME = 1024 * 1024;
+// Write requests are only accepted with -w; -a preallocates their ranges.
+bool writable = false;
+bool preallocate = false;
+// Acknowledgements of write requests wait for at most this many bytes to
+// share an fdatasync().
+constexpr uint64_t SYNC_BATCH = 64 * 1024 * 1024;
+// Capacity of the pipe write payloads are spliced through, if permitted.
+constexpr int INGEST_PIPE = 1024 * 1024;
+// Shares sending between clients; only with -F.
+std::unique_ptr<FairShare> fairShare;
+// Compressed blocks of the served file, identified by `servedDev` and
+// `servedIno`; only with -Z.
+std::unique_ptr<CompressCache> compressCache;
+dev_t servedDev;
+ino_t servedIno;
+constexpr size_t COMPRESS_CACHE_MIB = 256;
+// Blocks of a range queued for compression ahead of sending.
+constexpr uint64_t COMPRESS_AHEAD = 16;
+// The file, read-only, for local clients, and a mapping of it; only with
+// -U.
+int localFd = -1;
+uint8_t *localMap = nullptr;
+// Cleared if the kernel lacks MADV_POPULATE_READ.
+std::atomic<bool> populate(true);
 
 /* Receive requested read size from client, fadvise, read & send via
    sendfile().
@@ -56,112 +193,835 @@ using Channel = cpp::channel<LReq, NUMBLOCKS>;
    but fadvise() calls can be issued as soon as we receive a request. We'll have
    a single thread issuing sendfile() calls on the socket but multiple threads
    can issue fadvise() calls.
+   Errors on a connection only end that connection. The receiver always
+   finishes by queueing END_OF_REQUESTS, and the sender keeps draining the
+   channel until it sees it so the receiver can never block on a full channel.
 */
 
-using flatbuffers::uoffset_t;
+void pinToCpu(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (err) {
+    fprintf(stderr, "failed to pin to cpu %d: %s\n", cpu, strerror(err));
+  }
+}
+
+// Replace the delta request in `lreqs` with its plan: for each chunk of the
+// file in order, a REF step if the client has it and otherwise a DATA step,
+// merging adjacent DATA steps, then an END step. Returns false if the request
+// can't be served.
+bool planDelta(Bytes have, std::vector<LReq> &lreqs) {
+  if (!indexed) {
+    fprintf(stderr, "delta request without a chunk index; see -x\n");
+    return false;
+  } else if (have.size % HASH_SIZE != 0) {
+    fprintf(stderr, "malformed delta request\n");
+    return false;
+  }
+  std::unordered_map<Hash, uint32_t, HashHasher> held;
+  for (size_t i = 0; i < have.size / HASH_SIZE; ++i) {
+    Hash hash;
+    memcpy(hash.data(), have.data + i * HASH_SIZE, HASH_SIZE);
+    held.emplace(hash, uint32_t(i));
+  }
+  const LReq req = lreqs[0];
+  const uint32_t flags = req.flags & LREQ_BULK;
+  lreqs.clear();
+  for (const Chunk &chunk : chunkIndex.chunks()) {
+    const auto it = held.find(chunk.hash);
+    if (it != held.end()) {
+      lreqs.push_back(LReq{.offset = it->second,
+                           .size = chunk.size,
+                           .flags = flags | LREQ_CHUNK_REF,
+                           .trace = req.trace});
+      continue;
+    }
+    LReq *last = lreqs.empty() ? nullptr : &lreqs.back();
+    if (last != nullptr && (last->flags & LREQ_CHUNK_DATA) &&
+        uint64_t(last->offset) + last->size == chunk.offset &&
+        last->size + chunk.size <= MAX_DATA_FRAME) {
+      last->size += chunk.size;
+      continue;
+    }
+    lreqs.push_back(LReq{.offset = int64_t(chunk.offset),
+                         .size = chunk.size,
+                         .flags = flags | LREQ_CHUNK_DATA,
+                         .trace = req.trace});
+  }
+  lreqs.push_back(LReq{.offset = 0,
+                       .size = 0,
+                       .flags = LREQ_DELTA_END,
+                       .trace = req.trace});
+  return true;
+}
+
+bool openIngestPipe(int fds[2]) {
+  if (pipe(fds) == -1) {
+    perror("pipe");
+    return false;
+  }
+  // Keeps the default capacity if this is over pipe-max-size.
+  fcntl(fds[1], F_SETPIPE_SZ, INGEST_PIPE);
+  return true;
+}
+
+// CRC-32 of `size` bytes of `fd` at `offset`, read through a mapping so the
+// data isn't copied out of the page cache.
+bool crcRange(int fd, off_t offset, size_t size, uint32_t &crc) {
+  if (size == 0) {
+    crc = crc32(0, nullptr, 0);
+    return true;
+  }
+  static const off_t page = sysconf(_SC_PAGESIZE);
+  const off_t start = offset - offset % page;
+  const size_t len = size + (offset - start);
+  void *map = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, start);
+  if (map == MAP_FAILED) {
+    perror("crc mmap");
+    return false;
+  }
+  crc = crc32(0, static_cast<uint8_t *>(map) + (offset - start), size);
+  munmap(map, len);
+  return true;
+}
+
+// Land the payload of write request `put`, which follows it on the socket,
+// in the file by splicing it through `ingest`, and set `ack` to the response.
+// Returns false if the connection can't continue.
+bool receivePut(int fd, int sock_fd, const LReq &put, uint32_t crc,
+                int ingest[2], LReq &ack) {
+  ack = LReq{.offset = put.offset,
+             .size = put.size,
+             .flags = LREQ_STORED,
+             .trace = put.trace};
+  if (put.offset < 0) {
+    fprintf(stderr, "invalid write offset %" PRId64 "\n", put.offset);
+    return false;
+  } else if (put.size > UINT32_MAX) {
+    // Its STORED frame couldn't say how much was written.
+    fprintf(stderr, "write of %" PRIu64 " bytes is too large\n", put.size);
+    return false;
+  }
+  if (preallocate && put.size > 0) {
+    // Not fatal; the write allocates as it goes.
+    if (fallocate(fd, 0, put.offset, put.size) == -1) {
+      perror("fallocate");
+    }
+    stats::add(stats::SYSCALLS);
+  }
+  loff_t offset = put.offset;
+  for (size_t left = put.size; left > 0;) {
+    const ssize_t in = retryIo(sock_fd, POLLIN, [&]() {
+      stats::add(stats::SYSCALLS);
+      return splice(sock_fd, nullptr, ingest[1], nullptr, left,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+    });
+    if (in == 0) {
+      fprintf(stderr, "connection closed mid-payload\n");
+      return false;
+    } else if (in == -1) {
+      perror("splice from socket");
+      return false;
+    }
+    for (ssize_t moved = 0; moved < in;) {
+      const ssize_t out = splice(ingest[0], nullptr, fd, &offset, in - moved,
+                                 SPLICE_F_MOVE);
+      stats::add(stats::SYSCALLS);
+      if (out <= 0) {
+        perror("splice to file");
+        return false;
+      }
+      moved += out;
+    }
+    left -= in;
+  }
+  stats::add(stats::PUT_BYTES, put.size);
+  // Start writeback now so the batch's fdatasync() has less to wait for.
+  if (put.size > 0 && sync_file_range(fd, put.offset, put.size,
+                                      SYNC_FILE_RANGE_WRITE) == -1) {
+    perror("sync_file_range");
+  }
+  stats::add(stats::SYSCALLS);
+  // Check what landed in the page cache, not what passed through the pipe.
+  uint32_t landed;
+  if (!crcRange(fd, put.offset, put.size, landed) || landed != crc) {
+    fprintf(stderr, "CRC mismatch writing %" PRIu64 " bytes at %" PRId64 "\n",
+            put.size, put.offset);
+    ack.flags = LREQ_REJECTED;
+  }
+  return true;
+}
+
+// Make the writes behind `acks` durable with one fdatasync(), then queue the
+// acknowledgements.
+template <class Reqs>
+void commitPuts(int fd, std::vector<LReq> &acks, uint64_t &unsynced,
+                Reqs &reqs) {
+  if (acks.empty()) {
+    return;
+  }
+  const bool synced = fdatasync(fd) == 0;
+  if (!synced) {
+    perror("fdatasync");
+  }
+  stats::add(stats::SYNCS);
+  stats::add(stats::SYSCALLS);
+  for (auto ack : acks) {
+    if (!synced) {
+      ack.flags = LREQ_REJECTED;
+    }
+    reqs.send(ack);
+    stats::adjust(stats::QUEUE_DEPTH, 1);
+    trace::record(ack.trace, trace::ENQUEUED);
+  }
+  acks.clear();
+  unsynced = 0;
+}
+
+// Whether the client has already sent more.
+bool readable(int sock_fd) {
+  struct pollfd pfd;
+  pfd.fd = sock_fd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) == 1;
+}
+
+// Wait until `sock_fd` can take more, so a turn isn't spent blocked on it.
+void awaitSendSpace(int sock_fd) {
+  struct pollfd pfd;
+  pfd.fd = sock_fd;
+  pfd.events = POLLOUT;
+  while (poll(&pfd, 1, 0) == 0) {
+    if (ioWaiter() != nullptr) {
+      ioWaiter()(sock_fd, POLLOUT);
+    } else {
+      poll(&pfd, 1, -1);
+    }
+  }
+}
+
+CompressCache::Key blockKey(uint64_t block, Compression compression) {
+  return CompressCache::Key{servedDev, servedIno, block, compression};
+}
+
+// Queue the blocks of `size` bytes at `offset` for compression, up to
+// COMPRESS_AHEAD of them.
+void prefetchBlocks(int fd, off_t offset, uint64_t size,
+                    Compression compression) {
+  if (size == 0) {
+    return;
+  }
+  const uint64_t first = offset / COMPRESS_BLOCK;
+  const uint64_t last = (offset + size - 1) / COMPRESS_BLOCK;
+  for (uint64_t block = first;
+       block <= last && block < first + COMPRESS_AHEAD; ++block) {
+    compressCache->prefetch(blockKey(block, compression), fd);
+  }
+}
+
+// prefetchBlocks() for each run of data `lreq` covers; a sparse one's holes
+// go as ZEROS frames instead.
+void prefetchRequest(int fd, const LReq &lreq, Compression compression) {
+  if (!(lreq.flags & LREQ_SPARSE)) {
+    prefetchBlocks(fd, lreq.offset, lreq.size, compression);
+    return;
+  }
+  extents.split(lreq.offset, lreq.size,
+                [&](off_t offset, size_t size, bool isHole) {
+                  if (!isHole) {
+                    prefetchBlocks(fd, offset, size, compression);
+                  }
+                });
+}
 
-void t_recv(int fd, int sock_fd, Channel &reqs, off_t filesize) {
-  std::vector<uint8_t> reqBuf;
+template <class Codec, class Reqs>
+void t_recv(int fd, int sock_fd, Reqs &reqs, off_t filesize, Codec codec,
+            Compression compression) {
+  std::vector<LReq> lreqs;
+  // Acknowledgements of writes not yet synced, and their bytes.
+  std::vector<LReq> acks;
+  uint64_t unsynced = 0;
+  int ingest[2] = {-1, -1};
+  const uint32_t connection = capture::connection();
 
   uint64_t count = 0;
-  while (true) {
-    // read the size field
-    std::array<uint8_t, sizeof(uoffset_t)> msgSizeBuf;
-    ssize_t bytesRead = recv(sock_fd, msgSizeBuf.data(), msgSizeBuf.size(),
-                             MSG_PEEK | MSG_WAITALL);
-    if (bytesRead == -1) {
-      pbail("recv");
-    } else if (bytesRead != msgSizeBuf.size()) {
-      bail("partial recv on req %" PRIu64 "; expected %zd, got %zd", count,
-           msgSizeBuf.size(), bytesRead);
-    }
-    const uoffset_t msgSize =
-        flatbuffers::ReadScalar<uoffset_t>(msgSizeBuf.data());
-    DLOG("incoming message size: %d (not including %zd-byte prefix)\n", msgSize,
-         sizeof(uoffset_t));
-    const size_t totalSize = msgSize + sizeof(uoffset_t);
-    DLOG("receiving %zd bytes (including %zd-byte prefix)\n", totalSize,
-         sizeof(uoffset_t));
-    reqBuf.resize(totalSize);
-    bytesRead = recv(sock_fd, &reqBuf[0], reqBuf.size(), MSG_WAITALL);
-    if (bytesRead == -1) {
-      pbail("recv");
-    } else if (bytesRead != reqBuf.size()) {
-      bail("partial recv");
-    }
-    const auto *req = Server::GetSizePrefixedReq(reqBuf.data());
-    flatbuffers::Verifier verifier(reqBuf.data(), reqBuf.size());
-    if (!Server::VerifySizePrefixedReqBuffer(verifier)) {
-      bail("invalid flatbuffer");
-    }
-    DLOG("req offset: 0x%" PRIx64 " size: 0x%" PRIx32 "\n", req->offset(),
-         req->size());
-    if (req->offset() + req->size() > filesize) {
-      fprintf(stderr,
-              "invalid read requested; filesize: %zd, offset: %" PRId64
-              ", request size: %" PRIu32 "\n",
-              filesize, req->offset(), req->size());
+  while (codec.receive(sock_fd)) {
+    stats::add(stats::SYSCALLS, codec.syscalls);
+    codec.syscalls = 0;
+    const uint64_t traceId = trace::sample();
+    trace::record(traceId, trace::RECEIVED);
+    if (!codec.decode(lreqs, traceId)) {
+      break;
+    }
+    trace::record(traceId, trace::VERIFIED);
+    if (lreqs.size() == 1 && (lreqs[0].flags & LREQ_CANCEL)) {
+      // Takes effect at once, however much is queued ahead of it.
+      reqs.cancel(lreqs[0].id);
+      count++;
+      stats::add(stats::REQUESTS);
+      continue;
+    }
+    if (lreqs.size() == 1 && (lreqs[0].flags & LREQ_PUT)) {
+      if (!writable) {
+        fprintf(stderr, "write request to a read-only server; see -w\n");
+        break;
+      }
+      LReq ack;
+      if ((ingest[0] == -1 && !openIngestPipe(ingest)) ||
+          !receivePut(fd, sock_fd, lreqs[0], codec.crc(), ingest, ack)) {
+        break;
+      }
+      acks.push_back(ack);
+      unsynced += ack.size;
+      // Sync once the client pauses, so a batch is as deep as its pipeline.
+      if (unsynced >= SYNC_BATCH || !readable(sock_fd)) {
+        commitPuts(fd, acks, unsynced, reqs);
+      }
+      count++;
+      stats::add(stats::REQUESTS);
       continue;
     }
-    // TODO: evaluate POSIX_FADV_WILLNEED
-    if (posix_fadvise(fd, req->offset(), req->size(), POSIX_FADV_SEQUENTIAL)) {
-      pbail("fadvise");
+    // Responses go out in request order.
+    commitPuts(fd, acks, unsynced, reqs);
+    const bool delta = lreqs.size() == 1 && (lreqs[0].flags & LREQ_DELTA);
+    if (delta && !planDelta(codec.have(), lreqs)) {
+      break;
     }
-    LReq lreq{.offset = req->offset(), .size = req->size()};
-    reqs.send(lreq);
+    bool valid = true;
+    for (const auto &lreq : lreqs) {
+      if (lreq.flags & (LREQ_CHUNK_REF | LREQ_DELTA_END)) {
+        continue;
+      }
+      DLOG("req offset: 0x%" PRIx64 " size: 0x%" PRIx64 "\n", lreq.offset,
+           lreq.size);
+      if (!inFile(lreq, filesize)) {
+        fprintf(stderr,
+                "invalid read requested; filesize: %zd, offset: %" PRId64
+                ", request size: %" PRIu64 "\n",
+                filesize, lreq.offset, lreq.size);
+        valid = false;
+      }
+    }
+    if (!valid) {
+      continue;
+    }
+    if (!delta) {
+      capture::record(connection, lreqs);
+    }
+    // Advise on every range before queueing any of them so the kernel sees
+    // the whole set of a gather request at once. Delta plans go through the
+    // file in order, which readahead already handles.
+    // TODO: evaluate POSIX_FADV_WILLNEED for single-range requests too
+    const int advice =
+        lreqs.size() > 1 ? POSIX_FADV_WILLNEED : POSIX_FADV_SEQUENTIAL;
+    for (const auto &lreq : lreqs) {
+      if (delta) {
+        break;
+      }
+      if (posix_fadvise(fd, lreq.offset, lreq.size, advice)) {
+        pbail("fadvise");
+      }
+      stats::add(stats::FADVISE);
+      stats::add(stats::SYSCALLS);
+      if (compression != Compression::NONE) {
+        prefetchRequest(fd, lreq, compression);
+      }
+    }
+    trace::record(traceId, trace::ADVISED);
+    for (const auto &lreq : lreqs) {
+      reqs.send(lreq);
+      stats::adjust(stats::QUEUE_DEPTH, 1);
+    }
+    trace::record(traceId, trace::ENQUEUED);
     count++;
+    stats::add(stats::REQUESTS);
+  }
+  DLOG("connection ended after %" PRIu64 " requests\n", count);
+  commitPuts(fd, acks, unsynced, reqs);
+  if (ingest[0] != -1) {
+    close(ingest[0]);
+    close(ingest[1]);
   }
+  reqs.send(END_OF_REQUESTS);
 }
 
-void t_read(int fd, int sock_fd, Channel &reqs) {
+// Send `size` bytes of `fd` from `offset`. Returns false if the connection
+// failed.
+bool sendFile(int fd, int sock_fd, off_t offset, size_t size,
+              DropBehind &dropBehind, bool drop) {
+  // sendfile() advances `offset` itself.
+  while (size > 0) {
+    ssize_t sent = retryIo(sock_fd, POLLOUT, [&]() {
+      stats::add(stats::SYSCALLS);
+      return sendfile(sock_fd, fd, &offset, size);
+    });
+    if (sent == -1) {
+      perror("sendfile failed");
+      return false;
+    }
+    stats::add(stats::BYTES, sent);
+    if ((size_t)sent < size) {
+      stats::add(stats::PARTIAL_SENDS);
+    }
+    size -= sent;
+    dropBehind.sent(offset - sent, sent, drop);
+  }
+  return true;
+}
+
+// sendFile(), in turns shared with other clients if `client` isn't null.
+bool sendRange(int fd, int sock_fd, off_t offset, size_t size,
+               DropBehind &dropBehind, bool drop, FairShare::Client *client) {
+  if (client == nullptr) {
+    return sendFile(fd, sock_fd, offset, size, dropBehind, drop);
+  }
+  while (size > 0) {
+    const size_t chunk = std::min(size, FAIR_CHUNK);
+    awaitSendSpace(sock_fd);
+    fairShare->acquire(client, chunk);
+    const bool ok = sendFile(fd, sock_fd, offset, chunk, dropBehind, drop);
+    fairShare->release();
+    if (!ok) {
+      return false;
+    }
+    offset += chunk;
+    size -= chunk;
+  }
+  return true;
+}
+
+// Send a frame header. With `more`, it may wait to share a segment with
+// whatever is sent next.
+bool sendHeader(int sock_fd, Frame frame, bool more, DropBehind &dropBehind) {
+  uint8_t header[Frame::HEADER_SIZE];
+  frame.encode(header);
+  const bool sent =
+      sendFull(sock_fd, header, sizeof(header), more ? MSG_MORE : 0);
+  stats::add(stats::SYSCALLS);
+  if (!sent) {
+    perror("send failed");
+    return false;
+  }
+  stats::add(stats::BYTES, sizeof(header));
+  dropBehind.sent(0, sizeof(header), false);
+  return true;
+}
+
+// Send `size` bytes from memory, in a turn shared with other clients if
+// `client` isn't null.
+bool sendBuffer(int sock_fd, const uint8_t *data, size_t size,
+                DropBehind &dropBehind, FairShare::Client *client) {
+  if (client != nullptr) {
+    awaitSendSpace(sock_fd);
+    fairShare->acquire(client, std::min(size, FAIR_CHUNK));
+  }
+  const bool sent = sendFull(sock_fd, data, size);
+  if (client != nullptr) {
+    fairShare->release();
+  }
+  stats::add(stats::SYSCALLS);
+  if (!sent) {
+    perror("send failed");
+    return false;
+  }
+  stats::add(stats::BYTES, size);
+  dropBehind.sent(0, size, false);
+  return true;
+}
+
+// Send `size` bytes at `offset` block by block: a block as a COMPRESSED
+// frame if that's smaller than the part of it sent, and runs of the rest as
+// DATA frames.
+bool sendCompressed(int fd, int sock_fd, off_t offset, uint32_t size,
+                    Compression compression, DropBehind &dropBehind,
+                    bool drop, FairShare::Client *client) {
+  const off_t end = offset + size;
+  prefetchBlocks(fd, offset, size, compression);
+  // Start of the run of raw blocks not yet sent.
+  off_t raw = offset;
+  const auto sendRaw = [&](off_t upTo) {
+    const uint32_t run = upTo - raw;
+    const bool ok =
+        run == 0 ||
+        (sendHeader(sock_fd, Frame{Frame::DATA, run}, true, dropBehind) &&
+         sendRange(fd, sock_fd, raw, run, dropBehind, drop, client));
+    raw = upTo;
+    return ok;
+  };
+  while (offset < end) {
+    const uint64_t block = offset / COMPRESS_BLOCK;
+    const off_t next = std::min<off_t>(end, (block + 1) * COMPRESS_BLOCK);
+    const uint64_t ahead = block + COMPRESS_AHEAD;
+    if (off_t(ahead * COMPRESS_BLOCK) < end) {
+      compressCache->prefetch(blockKey(ahead, compression), fd);
+    }
+    const auto compressed = compressCache->get(blockKey(block, compression),
+                                               fd);
+    if (compressed && !compressed->incompressible &&
+        compressed->data.size() < size_t(next - offset)) {
+      const uint32_t wire = compressed->data.size();
+      if (!sendRaw(offset) ||
+          !sendHeader(sock_fd, Frame{Frame::COMPRESSED, wire}, true,
+                      dropBehind) ||
+          !sendBuffer(sock_fd, compressed->data.data(), wire, dropBehind,
+                      client)) {
+        return false;
+      }
+      raw = next;
+      stats::add(stats::COMPRESSED_BYTES, next - offset);
+      stats::add(stats::COMPRESSED_WIRE_BYTES, wire);
+    }
+    offset = next;
+  }
+  return sendRaw(end);
+}
+
+// Send `size` bytes at `offset` as a DATA frame, or a ZEROS frame if they're
+// a hole. With compression, data may go as COMPRESSED frames instead.
+bool sendFrame(int fd, int sock_fd, off_t offset, uint32_t size, bool isHole,
+               DropBehind &dropBehind, bool drop, FairShare::Client *client,
+               Compression compression) {
+  if (isHole) {
+    stats::add(stats::HOLE_BYTES, size);
+    return sendHeader(sock_fd, Frame{Frame::ZEROS, size}, false, dropBehind);
+  } else if (compression != Compression::NONE) {
+    return sendCompressed(fd, sock_fd, offset, size, compression, dropBehind,
+                          drop, client);
+  }
+  return sendHeader(sock_fd, Frame{Frame::DATA, size}, true, dropBehind) &&
+         sendRange(fd, sock_fd, offset, size, dropBehind, drop, client);
+}
+
+// Send `req` as frames: one per data extent or hole it covers if it's
+// sparse, or several for one too large for a frame.
+bool sendFramed(int fd, int sock_fd, const LReq &req, DropBehind &dropBehind,
+                bool drop, FairShare::Client *client,
+                Compression compression) {
+  bool ok = true;
+  const auto send = [&](off_t offset, size_t size, bool isHole) {
+    while (ok && size > 0) {
+      const uint32_t frame = std::min<size_t>(size, UINT32_MAX);
+      ok = sendFrame(fd, sock_fd, offset, frame, isHole, dropBehind, drop,
+                     client, compression);
+      offset += frame;
+      size -= frame;
+    }
+  };
+  if (req.flags & LREQ_SPARSE) {
+    extents.split(req.offset, req.size, send);
+  } else {
+    send(req.offset, req.size, false);
+  }
+  return ok;
+}
+
+// Send one step of a delta plan as a frame.
+bool sendStep(int fd, int sock_fd, const LReq &step, DropBehind &dropBehind,
+              bool drop, FairShare::Client *client) {
+  if (step.flags & LREQ_CHUNK_DATA) {
+    return sendHeader(sock_fd, Frame{Frame::DATA, uint32_t(step.size)}, true,
+                      dropBehind) &&
+           sendRange(fd, sock_fd, step.offset, step.size, dropBehind, drop,
+                     client);
+  } else if (step.flags & LREQ_CHUNK_REF) {
+    stats::add(stats::REF_BYTES, step.size);
+    return sendHeader(sock_fd, Frame{Frame::REF, uint32_t(step.offset)}, true,
+                      dropBehind);
+  }
+  return sendHeader(sock_fd, Frame{Frame::END, 0}, false, dropBehind);
+}
+
+// Send a range of a request with an id: an ID frame, then the range's
+// frames, or an EXPIRED frame if it missed its deadline. Once the request is
+// cancelled, a CANCELLED frame ends the range at the next frame boundary.
+template <class Reqs>
+bool sendScheduled(int fd, int sock_fd, const LReq &req, Reqs &reqs,
+                   DropBehind &dropBehind, bool drop,
+                   FairShare::Client *client, Compression compression) {
+  if (!sendHeader(sock_fd, Frame{Frame::ID, req.id}, true, dropBehind)) {
+    return false;
+  } else if (req.flags & LREQ_EXPIRED) {
+    stats::add(stats::EXPIRED);
+    return sendHeader(sock_fd, Frame{Frame::EXPIRED, 0}, false, dropBehind);
+  }
+  bool ok = true;
+  bool cancelled = false;
+  uint64_t left = req.size;
+  const auto send = [&](off_t offset, size_t size, bool isHole) {
+    while (ok && size > 0 && !(cancelled = reqs.cancelled(req.id))) {
+      const uint32_t frame = std::min<size_t>(size, MAX_SCHEDULED_FRAME);
+      ok = sendFrame(fd, sock_fd, offset, frame, isHole, dropBehind, drop,
+                     client, compression);
+      offset += frame;
+      size -= frame;
+      left -= frame;
+    }
+  };
+  if (req.flags & LREQ_SPARSE) {
+    extents.split(req.offset, req.size, send);
+  } else {
+    send(req.offset, req.size, false);
+  }
+  if (!ok || !cancelled) {
+    return ok;
+  }
+  stats::add(stats::CANCELLED);
+  stats::add(stats::CANCELLED_BYTES, left);
+  return sendHeader(sock_fd, Frame{Frame::CANCELLED, 0}, false, dropBehind);
+}
+
+template <class Reqs>
+void t_read(int fd, int sock_fd, Reqs &reqs, Compression compression) {
+  DropBehind dropBehind(sock_fd, fd);
+  FairShare::Client *const client =
+      fairShare ? fairShare->client(sock_fd) : nullptr;
+  bool failed = false;
   while (true) {
     auto req = reqs.recv();
-    off_t offset = req.offset;
-    size_t size = req.size;
-    size_t remaining = req.size;
-    while (remaining > 0) {
-      ssize_t sent = sendfile(sock_fd, fd, &offset, size);
-      if (sent == -1) {
-        pbail("sendfile failed");
-      }
-      remaining -= sent;
-      offset += sent;
+    if (req.offset == END_OF_REQUESTS.offset) {
+      break;
     }
+    stats::adjust(stats::QUEUE_DEPTH, -1);
+    trace::record(req.trace, trace::DEQUEUED);
+    if (failed) {
+      continue;
+    }
+    // Consecutive ranges of a gather request arrive back to back, so this
+    // chains their sendfile() calls.
+    trace::record(req.trace, trace::SEND_START);
+    const bool drop = dropsBehind(dropPolicy, req.flags & LREQ_BULK);
+    bool ok;
+    if (req.id != 0) {
+      ok = sendScheduled(fd, sock_fd, req, reqs, dropBehind, drop, client,
+                         compression);
+      reqs.done(req);
+    } else if (req.flags &
+               (LREQ_CHUNK_DATA | LREQ_CHUNK_REF | LREQ_DELTA_END)) {
+      ok = sendStep(fd, sock_fd, req, dropBehind, drop, client);
+    } else if (req.flags & (LREQ_STORED | LREQ_REJECTED)) {
+      const Frame::Kind kind =
+          req.flags & LREQ_STORED ? Frame::STORED : Frame::REJECTED;
+      ok = sendHeader(sock_fd, Frame{kind, uint32_t(req.size)}, false,
+                      dropBehind);
+    } else if ((req.flags & LREQ_SPARSE) ||
+               compression != Compression::NONE) {
+      ok = sendFramed(fd, sock_fd, req, dropBehind, drop, client,
+                      compression);
+    } else {
+      ok = sendRange(fd, sock_fd, req.offset, req.size, dropBehind, drop,
+                     client);
+    }
+    if (!ok) {
+      // Unblock the receiver; it will queue END_OF_REQUESTS.
+      shutdown(sock_fd, SHUT_RDWR);
+      failed = true;
+    }
+    trace::record(req.trace, trace::SEND_DONE);
+    dropBehind.poll();
   }
+  dropBehind.flush();
 }
 
-void serve(int socket_dest_fd, int src_fd, off_t filesize) {
+template <class Reqs>
+void receive(int src_fd, int socket_dest_fd, Reqs &reqs, off_t filesize,
+             CodecKind codec, Compression compression) {
+  if (codec == CodecKind::FIXED) {
+    t_recv(src_fd, socket_dest_fd, reqs, filesize, FixedCodec(), compression);
+  } else {
+    t_recv(src_fd, socket_dest_fd, reqs, filesize, FlatbufferCodec(),
+           compression);
+  }
+}
+
+// Serve one connection to completion. The calling thread sends; requests are
+// received on a new thread, pinned to `cpu` unless it is negative.
+void serve(int socket_dest_fd, int src_fd, off_t filesize, int cpu) {
+  Compression compression;
+  CodecKind codec;
+  if (!acceptCompression(socket_dest_fd, compressCache != nullptr,
+                         compression) ||
+      !acceptCodec(socket_dest_fd, codec)) {
+    return;
+  }
   Channel reqs;
-  std::thread reader(t_read, src_fd, socket_dest_fd, std::ref(reqs));
-  std::thread receiver(t_recv, src_fd, socket_dest_fd, std::ref(reqs),
-                       filesize);
-  reader.join();
+  std::thread receiver([&]() {
+    if (cpu >= 0) {
+      pinToCpu(cpu);
+    }
+    receive(src_fd, socket_dest_fd, reqs, filesize, codec, compression);
+  });
+  t_read(src_fd, socket_dest_fd, reqs, compression);
   receiver.join();
 }
 
-int main(int argc, char **argv) {
-  signal(SIGPIPE, SIG_IGN);
+// serve() on fibers: the calling fiber sends, a new one receives. Closes the
+// socket when done.
+void serveFiber(int socket_dest_fd, int src_fd, off_t filesize) {
+  fiberio::add(socket_dest_fd);
+  Compression compression;
+  CodecKind codec;
+  if (acceptCompression(socket_dest_fd, compressCache != nullptr,
+                        compression) &&
+      acceptCodec(socket_dest_fd, codec)) {
+    FiberChannel reqs;
+    boost::fibers::fiber receiver([&]() {
+      receive(src_fd, socket_dest_fd, reqs, filesize, codec, compression);
+    });
+    t_read(src_fd, socket_dest_fd, reqs, compression);
+    receiver.join();
+  }
+  fiberio::remove(socket_dest_fd);
+  close(socket_dest_fd);
+}
 
-  if (argc != 2) {
-    bail("expected a file path\n");
+// Bring `lreq`'s range into the page cache without copying it, by faulting
+// it into our mapping, or on kernels that can't, by starting to read it.
+void makeResident(const LReq &lreq) {
+  static const off_t page = sysconf(_SC_PAGESIZE);
+  if (lreq.size == 0) {
+    return;
   }
-  const int fd = open(argv[1], O_RDONLY);
-  if (fd == -1) {
-    pbail("open failed");
+  const off_t start = lreq.offset - lreq.offset % page;
+  const size_t len = lreq.size + (lreq.offset - start);
+  bool populated = false;
+  if (populate) {
+    populated = madvise(localMap + start, len, MADV_POPULATE_READ) == 0;
+    if (!populated && errno == EINVAL) {
+      populate = false;
+    } else if (!populated) {
+      perror("MADV_POPULATE_READ");
+    }
+  }
+  if (!populated && madvise(localMap + start, len, MADV_WILLNEED) == -1) {
+    perror("MADV_WILLNEED");
   }
+  stats::add(stats::MADVISE);
+  stats::add(stats::SYSCALLS);
+  stats::add(stats::LOCAL_BYTES, lreq.size);
+}
 
-  struct stat statbuf;
-  zero(statbuf);
-  if (fstat(fd, &statbuf)) {
-    pbail("fstat failed");
+// Answer a local client's ranges over `shared` until it disconnects.
+void serveRing(int conn, LocalShared *shared, off_t filesize) {
+  const uint32_t connection = capture::connection();
+  std::vector<LReq> lreqs(1);
+  LocalSlot slot;
+  while (true) {
+    if (!shared->requests.pop(slot)) {
+      shared->requests.awaitItems();
+      if (peerGone(conn)) {
+        return;
+      }
+      continue;
+    }
+    stats::add(stats::REQUESTS);
+    lreqs[0] = LReq{.offset = slot.offset, .size = slot.size};
+    slot.status = LOCAL_OK;
+    if (!inFile(lreqs[0], filesize)) {
+      fprintf(stderr,
+              "invalid local read requested; filesize: %zd, offset: %" PRId64
+              ", request size: %" PRIu64 "\n",
+              filesize, slot.offset, slot.size);
+      slot.status = LOCAL_INVALID;
+    } else {
+      capture::record(connection, lreqs);
+      makeResident(lreqs[0]);
+    }
+    while (!shared->completions.push(slot)) {
+      shared->completions.awaitSpace();
+      if (peerGone(conn)) {
+        return;
+      }
+    }
   }
+}
+
+// Serve a local client on `conn` to completion, then close it.
+void serveLocal(int conn, off_t filesize) {
+  void *map = MAP_FAILED;
+  const int memfd = memfd_create("seekable-ring", MFD_CLOEXEC |
+                                                      MFD_ALLOW_SEALING);
+  if (memfd == -1) {
+    perror("memfd_create");
+  } else if (ftruncate(memfd, sizeof(LocalShared)) == -1) {
+    perror("ftruncate");
+  } else {
+    map = mmap(nullptr, sizeof(LocalShared), PROT_READ | PROT_WRITE,
+               MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED) {
+      perror("ring mmap");
+    }
+  }
+  if (map != MAP_FAILED) {
+    LocalShared *shared = new (map) LocalShared();
+    shared->magic = LOCAL_MAGIC;
+    shared->version = LOCAL_VERSION;
+    shared->fileSize = filesize;
+    // So the client can't cut the ring short under us.
+    if (fcntl(memfd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+      perror("F_ADD_SEALS");
+    } else if (!sendLocal(conn, localFd, memfd)) {
+      perror("sendmsg");
+    } else {
+      serveRing(conn, shared, filesize);
+    }
+    munmap(map, sizeof(LocalShared));
+  }
+  if (memfd != -1) {
+    close(memfd);
+  }
+  close(conn);
+}
 
+int listenLocal(const char *path) {
+  struct sockaddr_un s_addr;
+  zero(s_addr);
+  s_addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(s_addr.sun_path)) {
+    bail("socket path %s is too long", path);
+  }
+  strcpy(s_addr.sun_path, path);
+  const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    pbail("socket failed");
+  }
+  // A stale socket from an earlier run would fail the bind.
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&s_addr, sizeof(s_addr)) == -1) {
+    pbail("bind %s failed", path);
+  }
+  if (listen(sock, SOMAXCONN) == -1) {
+    pbail("listen failed");
+  }
+  return sock;
+}
+
+// Accept local clients forever, serving each on its own thread.
+void localAcceptLoop(int sock, off_t filesize) {
+  while (true) {
+    const int conn = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn == -1) {
+      perror("accept failed");
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      continue;
+    }
+    std::thread(serveLocal, conn, filesize).detach();
+  }
+}
+
+int listenSocket(bool reusePort, int backlog = 0) {
   const int sock = socket(AF_INET, SOCK_STREAM, 0);
   if (sock == -1) {
     pbail("socket  failed");
   }
   const int option = 1;
   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+  if (reusePort &&
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option))) {
+    pbail("SO_REUSEPORT failed");
+  }
 
   struct sockaddr_in s_addr;
   zero(s_addr);
@@ -173,12 +1033,15 @@ int main(int argc, char **argv) {
     pbail("bind failed");
   }
 
-  if (listen(sock, 0) == -1) {
+  if (listen(sock, backlog) == -1) {
     pbail("listen failed");
   }
-  struct rusage usage1, usage2;
+  return sock;
+}
 
+void acceptLoop(int sock, int src_fd, off_t filesize, int cpu) {
   while (true) {
+    struct sockaddr_in s_addr;
     socklen_t so_size = sizeof(s_addr);
     printf("waiting for connections\n");
     int s_fd = accept(sock, (struct sockaddr *)&s_addr, &so_size);
@@ -187,9 +1050,303 @@ int main(int argc, char **argv) {
     }
 
     fprintf(stderr, "accepted\n");
-    while (true) {
-      serve(s_fd, fd, statbuf.st_size);
+    serve(s_fd, src_fd, filesize, cpu);
+    close(s_fd);
+  }
+}
+
+// Accept connections forever, serving each on its own fiber.
+void fiberAcceptLoop(int sock, int src_fd, off_t filesize) {
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  fiberio::add(sock);
+  printf("waiting for connections\n");
+  while (true) {
+    const int s_fd = retryIo(sock, POLLIN, [&]() {
+      return accept4(sock, nullptr, nullptr, SOCK_NONBLOCK);
+    });
+    if (s_fd == -1) {
+      // Out of descriptors or memory; wait for connections to finish.
+      perror("accept failed");
+      boost::this_fiber::sleep_for(std::chrono::milliseconds(100));
+      continue;
+    }
+    boost::fibers::fiber(serveFiber, s_fd, src_fd, filesize).detach();
+  }
+}
+
+// The CPUs the process may run on, in order; shard i is pinned to the i-th.
+std::vector<int> shardCpus() {
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus)) {
+    pbail("sched_getaffinity failed");
+  }
+  std::vector<int> list;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpus)) {
+      list.push_back(cpu);
     }
   }
+  return list;
+}
+
+// Steer each new connection to the listener at the index of the receiving
+// CPU in `cpus`, i.e. the shard pinned to that CPU. CPU ids needn't be
+// contiguous, so each is matched explicitly; one not listed, which the kernel
+// would only report if the affinity changed, falls back to the usual hash.
+void attachSteering(int sock, const std::vector<int> &cpus) {
+  std::vector<struct sock_filter> code;
+  code.push_back(
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)});
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    code.push_back({BPF_JMP | BPF_JEQ | BPF_K, 0, 1, uint32_t(cpus[i])});
+    code.push_back({BPF_RET | BPF_K, 0, 0, uint32_t(i)});
+  }
+  code.push_back({BPF_RET | BPF_K, 0, 0, UINT32_MAX});
+  if (code.size() > BPF_MAXINSNS) {
+    bail("too many CPUs to steer connections\n");
+  }
+  struct sock_fprog prog;
+  prog.len = code.size();
+  prog.filter = code.data();
+  if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                 sizeof(prog))) {
+    pbail("SO_ATTACH_REUSEPORT_CBPF failed");
+  }
+}
+
+void t_shard(int sock, int src_fd, off_t filesize, int cpu) {
+  pinToCpu(cpu);
+  // Everything the shard allocates from here on, including its connections'
+  // buffers and channels, comes from the local node.
+  if (syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0)) {
+    perror("set_mempolicy");
+  }
+  acceptLoop(sock, src_fd, filesize, cpu);
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+  stats::start();
+  trace::start();
+
+  int shards = -1;
+  bool steer = false;
+  int fiberThreads = 0;
+  int fairSlots = 0;
+  uint64_t fairRate = 0;
+  FairShare::Policy fairDefaults;
+  std::vector<std::pair<in_addr_t, FairShare::Policy>> fairPolicies;
+  int opt;
+  bool index = false;
+  const char *capturePath = nullptr;
+  unsigned compressThreads = 0;
+  size_t compressCacheMiB = COMPRESS_CACHE_MIB;
+  const char *localPath = nullptr;
+  while ((opt = getopt(argc, argv, "s:bf:d:xwaF:W:l:L:Z:U:")) != -1) {
+    switch (opt) {
+      case 'U':
+        localPath = optarg;
+        break;
+      case 'Z': {
+        char *end;
+        compressThreads = strtoul(optarg, &end, 0);
+        if (*end == ',') {
+          compressCacheMiB = strtoull(end + 1, &end, 0);
+        }
+        if (compressThreads == 0 || compressCacheMiB == 0 || *end != '\0') {
+          bail("-Z takes threads[,cache_mib]");
+        }
+        break;
+      }
+      case 'L':
+        capturePath = optarg;
+        break;
+      case 'F': {
+        char *end;
+        fairSlots = strtol(optarg, &end, 0);
+        if (*end == ',') {
+          fairRate = strtoull(end + 1, &end, 0);
+        }
+        if (fairSlots <= 0 || *end != '\0') {
+          bail("-F takes slots[,rate]");
+        }
+        break;
+      }
+      case 'W': {
+        in_addr_t addr;
+        FairShare::Policy policy;
+        if (!parseFairPolicy(optarg, addr, policy)) {
+          bail("-W takes address=weight[,rate]");
+        }
+        fairPolicies.emplace_back(addr, policy);
+        break;
+      }
+      case 'l':
+        fairDefaults.rate = strtoull(optarg, nullptr, 0);
+        if (fairDefaults.rate == 0) {
+          bail("-l takes bytes per second");
+        }
+        break;
+      case 'w':
+        writable = true;
+        break;
+      case 'a':
+        preallocate = true;
+        break;
+      case 'x':
+        index = true;
+        break;
+      case 'd':
+        if (!parseDropPolicy(optarg, dropPolicy)) {
+          bail("-d takes bulk or all");
+        }
+        break;
+      case 's':
+        shards = strtol(optarg, nullptr, 0);
+        if (shards < 0) {
+          bail("-s takes a shard count, or 0 for one per CPU\n");
+        }
+        break;
+      case 'b':
+        steer = true;
+        break;
+      case 'f':
+        fiberThreads = strtol(optarg, nullptr, 0);
+        if (fiberThreads <= 0) {
+          bail("-f takes a thread count");
+        }
+        break;
+      default:
+        bail("usage: %s [-s shards [-b] | -f threads] [-d bulk|all] "
+             "[-x | -w [-a]] [-F slots[,rate] [-W address=weight[,rate]]... "
+             "[-l rate]] [-L capture] [-Z threads[,cache_mib]] [-U socket] "
+             "file",
+             argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    bail("expected a file path\n");
+  }
+  // Shards are pinned to these, one each.
+  std::vector<int> cpus;
+  if (shards >= 0) {
+    cpus = shardCpus();
+    if (shards == 0) {
+      shards = cpus.size();
+    } else if (size_t(shards) > cpus.size()) {
+      bail("-s can't exceed the number of CPUs available, %zu\n",
+           cpus.size());
+    }
+  }
+  if (steer && size_t(shards) != cpus.size()) {
+    bail("-b requires a shard on each CPU available; -s 0 runs one on "
+         "each\n");
+  } else if (fiberThreads > 0 && shards >= 0) {
+    bail("-f and -s can't be combined");
+  }
+  if (writable && index) {
+    bail("-w and -x can't be combined");
+  } else if (preallocate && !writable) {
+    bail("-a requires -w");
+  } else if (writable && compressThreads > 0) {
+    bail("-w and -Z can't be combined");
+  }
+  if (fairSlots > 0) {
+    fairShare.reset(new FairShare(fairSlots, fairRate, fairDefaults));
+    for (const auto &policy : fairPolicies) {
+      fairShare->setPolicy(policy.first, policy.second);
+    }
+    stats::addReport([]() { return fairShare->format(); });
+  } else if (!fairPolicies.empty() || fairDefaults.rate != 0) {
+    bail("-W and -l require -F");
+  }
+  if (capturePath != nullptr) {
+    if (!capture::start(capturePath)) {
+      exit(1);
+    }
+    stats::addReport(capture::format);
+  }
+  const int fd = open(argv[optind], writable ? O_RDWR | O_CREAT : O_RDONLY,
+                      0644);
+  if (fd == -1) {
+    pbail("open failed");
+  }
+
+  struct stat statbuf;
+  zero(statbuf);
+  if (fstat(fd, &statbuf)) {
+    pbail("fstat failed");
+  }
+  if (compressThreads > 0) {
+    servedDev = statbuf.st_dev;
+    servedIno = statbuf.st_ino;
+    compressCache.reset(
+        new CompressCache(compressThreads, compressCacheMiB << 20));
+    stats::addReport([]() { return compressCache->format(); });
+  }
+  if (index) {
+    if (!chunkIndex.open(argv[optind], fd)) {
+      bail("failed to index %s", argv[optind]);
+    }
+    indexed = true;
+    printf("%zd chunks indexed\n", chunkIndex.chunks().size());
+  }
+  if (writable) {
+    // Writes would leave a hole map stale.
+    extents.allData(statbuf.st_size);
+  } else if (extents.build(fd, statbuf.st_size) && extents.holeBytes() > 0) {
+    printf("%zd data extents, %" PRId64 " bytes of holes\n",
+           extents.numExtents(), int64_t(extents.holeBytes()));
+  }
+
+  if (localPath != nullptr) {
+    localFd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    if (localFd == -1) {
+      pbail("open failed");
+    }
+    if (statbuf.st_size > 0) {
+      void *map = mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED,
+                       localFd, 0);
+      if (map == MAP_FAILED) {
+        pbail("mmap failed");
+      }
+      localMap = static_cast<uint8_t *>(map);
+    }
+    std::thread(localAcceptLoop, listenLocal(localPath), statbuf.st_size)
+        .detach();
+    printf("serving local clients on %s\n", localPath);
+  }
+
+  if (fiberThreads > 0) {
+    const int sock = listenSocket(false, SOMAXCONN);
+    printf("serving on fibers over %d threads\n", fiberThreads);
+    fiberio::start(fiberThreads);
+    fiberAcceptLoop(sock, fd, statbuf.st_size);
+    return 0;
+  }
+
+  if (shards < 0) {
+    const int sock = listenSocket(false);
+    acceptLoop(sock, fd, statbuf.st_size, -1);
+    return 0;
+  }
+
+  // Listeners join the reuseport group in creation order, so create them all
+  // here before the steering program indexes them by shard.
+  std::vector<int> socks;
+  for (int i = 0; i < shards; ++i) {
+    socks.push_back(listenSocket(true));
+  }
+  if (steer) {
+    attachSteering(socks[0], cpus);
+  }
+  printf("starting %d shards\n", shards);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < shards; ++i) {
+    threads.emplace_back(t_shard, socks[i], fd, statbuf.st_size, cpus[i]);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
   return 0;
 }
@@ -1,12 +1,29 @@
 /*
   Sends the entire input file repeatedly over a TCP socket using sendfile().
+
+  With -d, the file is sent in DROP_BEHIND_CHUNK pieces and each piece is
+  dropped from the page cache once the client has acknowledged it; see
+  dropBehind.h.
+
+  With -b N, the file is broadcast to groups of at least N subscribers. Each
+  chunk is spliced from the file into a pipe once and duplicated into every
+  subscriber's pipe with tee(), so the page cache is read once per chunk
+  rather than once per subscriber. Subscribers connecting mid-pass join at
+  the start of the next one. A subscriber that holds the group back for more
+  than -g milliseconds at a stretch, or more than HOLD_REFILL of the time
+  overall, is cut loose and finishes on its own thread with sendfile() from
+  where it fell behind.
 */
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/sendfile.h>
@@ -15,7 +32,15 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
 
+#include "dropBehind.h"
+#include "perfUtil.h"
+#include "stats.h"
 #include "tvUtil.h"
 
 #define bail(...)                 \
@@ -33,14 +58,374 @@
 #define zero(_x) memset(&_x, 0, sizeof(_x))
 
 const unsigned short PORT = 9999;
+constexpr off_t DROP_BEHIND_CHUNK = 4 * 1024 * 1024;
+// Broadcast mode reads the file into a pipe this much at a time.
+constexpr size_t BROADCAST_CHUNK = 256 * 1024;
+// How far a subscriber may fall behind the group before the group waits for
+// it; capped by /proc/sys/fs/pipe-max-size.
+constexpr int SUBSCRIBER_PIPE = 1024 * 1024;
+// Each subscriber's hold budget: the group will wait on it for up to
+// DEFAULT_GRACE_MS, refilled at HOLD_REFILL seconds per second.
+constexpr int DEFAULT_GRACE_MS = 500;
+constexpr double HOLD_REFILL = 0.1;
+
+// Broadcast mode: each chunk is spliced from the file into a source pipe once
+// and tee()d into a pipe per subscriber, which is spliced on to its socket.
+struct Subscriber {
+  int sock;
+  int pipe[2];
+  // Bytes sitting in the pipe, not yet taken by the socket.
+  size_t pending;
+  size_t capacity;
+  // Seconds the group will still wait on this subscriber, and when that was
+  // last topped up.
+  double holdBudget;
+  double refilledAt;
+  // Whether the group is currently waiting on this subscriber alone.
+  bool holding;
+};
+
+double monotonic() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return tsDouble(ts);
+}
+
+bool makePipe(int fds[2], int size, size_t &capacity) {
+  if (pipe(fds) == -1) {
+    perror("pipe");
+    return false;
+  }
+  // Keeps a smaller capacity if `size` is over pipe-max-size, or the user is
+  // over pipe-user-pages-soft.
+  fcntl(fds[1], F_SETPIPE_SZ, size);
+  const int got = fcntl(fds[1], F_GETPIPE_SZ);
+  if (got == -1) {
+    perror("F_GETPIPE_SZ");
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  capacity = got;
+  return true;
+}
+
+void closeSubscriber(const Subscriber &sub) {
+  close(sub.pipe[0]);
+  close(sub.pipe[1]);
+  close(sub.sock);
+}
+
+// Move whatever the socket will take from the subscriber's pipe without
+// blocking. Returns false if the subscriber has gone away.
+bool flush(Subscriber &sub) {
+  while (sub.pending > 0) {
+    const ssize_t n = splice(sub.pipe[0], nullptr, sub.sock, nullptr,
+                             sub.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    stats::add(stats::SYSCALLS);
+    if (n == -1) {
+      return errno == EAGAIN;
+    } else if (n == 0) {
+      break;
+    }
+    stats::add(stats::BYTES, n);
+    sub.pending -= n;
+  }
+  return true;
+}
+
+bool flushOrClose(Subscriber &sub) {
+  if (flush(sub)) {
+    return true;
+  }
+  printf("subscriber %d left\n", sub.sock);
+  closeSubscriber(sub);
+  return false;
+}
+
+// A subscriber that couldn't keep up with the group finishes on its own:
+// first what is still in its pipe, then the rest of the file from `offset`
+// with sendfile(), repeating the file as the single-client mode does.
+void t_catchUp(Subscriber sub, int fd, off_t offset, off_t size) {
+  fcntl(sub.sock, F_SETFL, fcntl(sub.sock, F_GETFL) & ~O_NONBLOCK);
+  bool ok = true;
+  while (ok && sub.pending > 0) {
+    const ssize_t n = splice(sub.pipe[0], nullptr, sub.sock, nullptr,
+                             sub.pending, SPLICE_F_MOVE);
+    stats::add(stats::SYSCALLS);
+    ok = n > 0;
+    if (ok) {
+      stats::add(stats::BYTES, n);
+      sub.pending -= n;
+    }
+  }
+  while (ok) {
+    while (ok && offset < size) {
+      const ssize_t n = sendfile(sub.sock, fd, &offset, size - offset);
+      stats::add(stats::SYSCALLS);
+      ok = n > 0;
+      if (ok) {
+        stats::add(stats::BYTES, n);
+      }
+    }
+    offset = 0;
+  }
+  printf("catch-up subscriber %d left\n", sub.sock);
+  closeSubscriber(sub);
+}
+
+void catchUp(const Subscriber &sub, int fd, off_t offset, off_t size) {
+  printf("subscriber %d fell behind at offset %jd; catching up on its own\n",
+         sub.sock, intmax_t(offset));
+  std::thread(t_catchUp, sub, fd, offset, size).detach();
+}
+
+// Add a subscriber to the group; returns whether it joined. One whose pipe
+// can't hold a whole `chunk` would never have room for one, so it's served on
+// its own from the start instead.
+bool addSubscriber(int s_fd, double grace, size_t chunk, int fd, off_t size,
+                   std::vector<Subscriber> &live) {
+  Subscriber sub;
+  sub.sock = s_fd;
+  sub.pending = 0;
+  sub.holdBudget = grace;
+  sub.refilledAt = monotonic();
+  sub.holding = false;
+  if (!makePipe(sub.pipe, SUBSCRIBER_PIPE, sub.capacity)) {
+    close(s_fd);
+    return false;
+  }
+  if (sub.capacity < chunk) {
+    printf("subscriber %d's pipe holds only %zu bytes; serving it on its "
+           "own\n",
+           s_fd, sub.capacity);
+    std::thread(t_catchUp, sub, fd, off_t(0), size).detach();
+    return false;
+  }
+  fcntl(s_fd, F_SETFL, fcntl(s_fd, F_GETFL) | O_NONBLOCK);
+  live.push_back(sub);
+  printf("subscriber %d joined; %zu in the group\n", s_fd, live.size());
+  return true;
+}
+
+// Keep the subscribers for which keep(sub) is true, in order.
+template <class Fn>
+void filter(std::vector<Subscriber> &live, Fn keep) {
+  live.erase(std::remove_if(live.begin(), live.end(),
+                            [&](Subscriber &sub) { return !keep(sub); }),
+             live.end());
+}
+
+// Wait until every subscriber's pipe has room for `need` more bytes. Time
+// the group spends waiting on a subscriber while others are ready comes out
+// of that subscriber's hold budget; one that has used it up is handed to the
+// catch-up path at `offset`, the file position its stream has reached. When
+// everyone is short of room, the network is the limit and nobody is charged.
+void waitForRoom(std::vector<Subscriber> &live, size_t need, double grace,
+                 int fd, off_t offset, off_t size) {
+  double last = monotonic();
+  for (auto &sub : live) {
+    sub.holdBudget = std::min(
+        grace, sub.holdBudget + (last - sub.refilledAt) * HOLD_REFILL);
+    sub.refilledAt = last;
+  }
+  std::vector<struct pollfd> waiting;
+  while (true) {
+    const double now = monotonic();
+    size_t ready = 0;
+    filter(live, [&](Subscriber &sub) {
+      if (!flushOrClose(sub)) {
+        return false;
+      }
+      if (sub.holding) {
+        sub.holdBudget -= now - last;
+        sub.holding = false;
+      }
+      ready += sub.capacity - sub.pending >= need;
+      return true;
+    });
+    last = now;
+    if (ready == live.size()) {
+      return;
+    }
+    const bool blame = ready > 0;
+    double timeout = -1;
+    waiting.clear();
+    filter(live, [&](Subscriber &sub) {
+      if (sub.capacity - sub.pending >= need) {
+        return true;
+      }
+      if (blame) {
+        if (sub.holdBudget <= 0) {
+          catchUp(sub, fd, offset, size);
+          return false;
+        }
+        sub.holding = true;
+        timeout = timeout < 0 ? sub.holdBudget
+                              : std::min(timeout, sub.holdBudget);
+      }
+      waiting.push_back(pollfd{sub.sock, POLLOUT, 0});
+      return true;
+    });
+    if (waiting.empty()) {
+      return;
+    }
+    poll(waiting.data(), waiting.size(),
+         timeout < 0 ? -1 : int(timeout * 1000) + 1);
+  }
+}
+
+// Send the file once to every subscriber in `live`. Returns the number of
+// bytes read from the file, or -1 on a local error.
+ssize_t broadcastPass(int fd, off_t size, int src[2], size_t chunk,
+                      int devNull, double grace,
+                      std::vector<Subscriber> &live) {
+  off_t offset = 0;
+  while (offset < size && !live.empty()) {
+    const size_t n = std::min(off_t(chunk), size - offset);
+    // The one read of this chunk, whatever the size of the group.
+    loff_t in = offset;
+    for (size_t filled = 0; filled < n;) {
+      const ssize_t r =
+          splice(fd, &in, src[1], nullptr, n - filled, SPLICE_F_MOVE);
+      stats::add(stats::SYSCALLS);
+      if (r <= 0) {
+        perror("splice from file failed");
+        return -1;
+      }
+      filled += r;
+    }
+    waitForRoom(live, n, grace, fd, offset, size);
+    filter(live, [&](Subscriber &sub) {
+      const ssize_t teed = tee(src[0], sub.pipe[1], n, SPLICE_F_NONBLOCK);
+      stats::add(stats::SYSCALLS);
+      if (teed > 0) {
+        sub.pending += teed;
+      }
+      if (teed == ssize_t(n)) {
+        return true;
+      }
+      catchUp(sub, fd, offset + std::max(teed, ssize_t(0)), size);
+      return false;
+    });
+    // tee() left the chunk in the source pipe; release it.
+    for (size_t drained = 0; drained < n;) {
+      const ssize_t r = splice(src[0], nullptr, devNull, nullptr,
+                               n - drained, SPLICE_F_MOVE);
+      stats::add(stats::SYSCALLS);
+      if (r <= 0) {
+        perror("splice to /dev/null failed");
+        return -1;
+      }
+      drained += r;
+    }
+    filter(live, flushOrClose);
+    offset += n;
+  }
+  return offset;
+}
+
+// Serve the file to groups of at least `group` subscribers. New subscribers
+// join at the start of the next pass; the group re-forms once it empties.
+int broadcast(int sock, int fd, const char *path, off_t size, size_t group,
+              int graceMs) {
+  const double grace = graceMs / 1000.0;
+  int src[2];
+  size_t chunk;
+  if (!makePipe(src, BROADCAST_CHUNK, chunk)) {
+    return 1;
+  }
+  chunk = std::min(chunk, BROADCAST_CHUNK);
+  const int devNull = open("/dev/null", O_WRONLY);
+  if (devNull == -1) {
+    pbail("open /dev/null failed");
+  }
+  struct rusage usage1, usage2;
+  PerfCounters perf;
+  std::vector<Subscriber> live;
+  while (true) {
+    printf("waiting for %zu subscribers\n", group - live.size());
+    while (live.size() < group) {
+      const int s_fd = accept(sock, nullptr, nullptr);
+      if (s_fd == -1) {
+        pbail("accept failed");
+      }
+      addSubscriber(s_fd, grace, chunk, fd, size, live);
+    }
+    while (!live.empty()) {
+      struct pollfd pending = {sock, POLLIN, 0};
+      while (poll(&pending, 1, 0) == 1) {
+        const int s_fd = accept(sock, nullptr, nullptr);
+        if (s_fd == -1) {
+          pbail("accept failed");
+        }
+        addSubscriber(s_fd, grace, chunk, fd, size, live);
+      }
+      const size_t receivers = live.size();
+      printf("sending %s to %zu subscribers\n", path, receivers);
+      struct timespec ts_start;
+      if (getrusage(RUSAGE_SELF, &usage1) == -1) {
+        pbail("getrusage failed");
+      }
+      const PerfCounters::Sample perf1 = perf.read();
+      clock_gettime(CLOCK_MONOTONIC, &ts_start);
+      const ssize_t bytes = broadcastPass(fd, size, src, chunk, devNull,
+                                         grace, live);
+      struct timespec ts_end;
+      clock_gettime(CLOCK_MONOTONIC, &ts_end);
+      const PerfCounters::Sample perf2 = perf.read();
+      if (getrusage(RUSAGE_SELF, &usage2) == -1) {
+        pbail("getrusage failed");
+      }
+      if (bytes == -1) {
+        return 1;
+      }
+      const float elapsed = tsDouble(tsDiff(ts_end, ts_start));
+      printf(
+          "read %zd bytes once for %zu subscribers (%zu kept up) in %fs; "
+          "%f MiB/s each; user: %fs; system: %fs\n",
+          bytes, receivers, live.size(), elapsed,
+          bytes / 1024 / 1024 / elapsed,
+          tvDouble(tvDiff(usage2.ru_utime, usage1.ru_utime)),
+          tvDouble(tvDiff(usage2.ru_stime, usage1.ru_stime)));
+      printf("  %s\n", perf.format(perf1, perf2, bytes).c_str());
+    }
+  }
+  return 0;
+}
 
 int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
+  stats::start();
 
-  if (argc != 2) {
+  bool drop = false;
+  size_t group = 0;
+  int graceMs = DEFAULT_GRACE_MS;
+  int opt;
+  while ((opt = getopt(argc, argv, "db:g:")) != -1) {
+    switch (opt) {
+      case 'd':
+        drop = true;
+        break;
+      case 'b':
+        group = atoi(optarg);
+        break;
+      case 'g':
+        graceMs = atoi(optarg);
+        break;
+      default:
+        bail("usage: %s [-d | -b subscribers [-g grace ms]] file\n",
+             argv[0]);
+    }
+  }
+  if (drop && group > 0) {
+    bail("-d and -b can't be combined\n");
+  }
+  if (optind != argc - 1) {
     bail("expected a file path\n");
   }
-  const int fd = open(argv[1], O_RDONLY);
+  const char *path = argv[optind];
+  const int fd = open(path, O_RDONLY);
   if (fd == -1) {
     pbail("open failed");
   }
@@ -71,7 +456,11 @@ int main(int argc, char **argv) {
   if (listen(sock, 0) == -1) {
     pbail("listen failed");
   }
+  if (group > 0) {
+    return broadcast(sock, fd, path, statbuf.st_size, group, graceMs);
+  }
   struct rusage usage1, usage2;
+  PerfCounters perf;
 
   while (true) {
     socklen_t so_size = sizeof(s_addr);
@@ -81,29 +470,55 @@ int main(int argc, char **argv) {
       pbail("accept failed");
     }
 
+    DropBehind dropBehind(s_fd, fd);
+    const off_t chunk = drop ? DROP_BEHIND_CHUNK : statbuf.st_size;
     while (true) {
-      printf("sending %s\n", argv[1]);
+      printf("sending %s\n", path);
       off_t offset = 0;
       struct timespec ts_start;
       if (getrusage(RUSAGE_SELF, &usage1) == -1) {
         pbail("getrusage failed");
       }
+      const PerfCounters::Sample perf1 = perf.read();
       clock_gettime(CLOCK_MONOTONIC, &ts_start);
-      ssize_t sent = sendfile(s_fd, fd, &offset, statbuf.st_size);
+      ssize_t sent = 0;
+      while (offset < statbuf.st_size) {
+        const ssize_t n = sendfile(s_fd, fd, &offset,
+                                   std::min(chunk, statbuf.st_size - offset));
+        stats::add(stats::SYSCALLS);
+        if (n == -1) {
+          sent = -1;
+          break;
+        } else if (n == 0) {
+          break;
+        }
+        stats::add(stats::BYTES, n);
+        sent += n;
+        if (drop) {
+          dropBehind.sent(offset - n, n);
+          dropBehind.poll();
+        }
+      }
       struct timespec ts_end;
       clock_gettime(CLOCK_MONOTONIC, &ts_end);
+      const PerfCounters::Sample perf2 = perf.read();
       if (getrusage(RUSAGE_SELF, &usage2) == -1) {
         pbail("getrusage failed");
       }
       if (sent == -1) {
         perror("sendfile failed");
+        dropBehind.flush();
         break;
       }
+      if (sent < statbuf.st_size) {
+        stats::add(stats::PARTIAL_SENDS);
+      }
       const float elapsed = tsDouble(tsDiff(ts_end, ts_start));
       printf("sent %zd bytes in %fs; %f MiB/s; user: %fs; system: %fs\n", sent,
              elapsed, sent / 1024 / 1024 / elapsed,
              tvDouble(tvDiff(usage2.ru_utime, usage1.ru_utime)),
              tvDouble(tvDiff(usage2.ru_stime, usage1.ru_stime)));
+      printf("  %s\n", perf.format(perf1, perf2, sent).c_str());
     }
   }
   return 0;
@@ -0,0 +1,250 @@
+#include "stats.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "tvUtil.h"
+
+namespace stats {
+
+thread_local Block *tlsBlock = nullptr;
+
+namespace {
+
+const char *const counterNames[NUM_COUNTERS] = {
+    "requests", "bytes",         "syscalls",   "partial_sends", "fadvise",
+    "madvise",  "dropped_bytes", "hole_bytes", "ref_bytes",     "put_bytes",
+    "syncs",    "expired",       "cancelled",  "cancelled_bytes",
+    "compressed_bytes", "compressed_wire_bytes", "local_bytes",
+};
+const char *const gaugeNames[NUM_GAUGES] = {"queue_depth"};
+
+std::mutex mu;
+std::vector<Block *> live;
+std::vector<Block *> spare;
+// Totals of threads that have exited.
+uint64_t retiredCounters[NUM_COUNTERS];
+int64_t retiredGauges[NUM_GAUGES];
+std::vector<std::string (*)()> reports;
+
+void clear(Block &block) {
+  for (auto &c : block.counters) {
+    c.store(0, std::memory_order_relaxed);
+  }
+  for (auto &g : block.gauges) {
+    g.store(0, std::memory_order_relaxed);
+  }
+}
+
+// Hands a thread's block back when the thread exits. Only touched on the
+// registration path so the hot path never pays for its TLS guard.
+struct Registration {
+  Block *block = nullptr;
+  ~Registration() {
+    if (block == nullptr) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mu);
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+      retiredCounters[i] += block->counters[i].load(std::memory_order_relaxed);
+    }
+    for (int i = 0; i < NUM_GAUGES; ++i) {
+      retiredGauges[i] += block->gauges[i].load(std::memory_order_relaxed);
+    }
+    clear(*block);
+    for (auto it = live.begin(); it != live.end(); ++it) {
+      if (*it == block) {
+        live.erase(it);
+        break;
+      }
+    }
+    spare.push_back(block);
+    tlsBlock = nullptr;
+  }
+};
+thread_local Registration registration;
+
+void append(std::string &out, const char *name, int64_t value) {
+  char line[128];
+  snprintf(line, sizeof(line), "%s %" PRId64 "\n", name, value);
+  out += line;
+}
+
+void append(std::string &out, const char *name, double value) {
+  char line[128];
+  snprintf(line, sizeof(line), "%s %.6f\n", name, value);
+  out += line;
+}
+
+void serveSocket(int listenFd, int sigFd) {
+  struct pollfd fds[2];
+  fds[0].fd = sigFd;
+  fds[0].events = POLLIN;
+  fds[1].fd = listenFd;
+  fds[1].events = POLLIN;
+  const int nfds = listenFd == -1 ? 1 : 2;
+  while (true) {
+    if (poll(fds, nfds, -1) == -1) {
+      perror("stats poll");
+      return;
+    }
+    if (fds[0].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      if (read(sigFd, &info, sizeof(info)) == sizeof(info)) {
+        fputs(format().c_str(), stderr);
+      }
+    }
+    if (nfds > 1 && (fds[1].revents & POLLIN)) {
+      const int fd = accept(listenFd, nullptr, nullptr);
+      if (fd == -1) {
+        perror("stats accept");
+        continue;
+      }
+      const std::string text = format();
+      if (send(fd, text.data(), text.size(), MSG_NOSIGNAL) == -1) {
+        perror("stats send");
+      }
+      close(fd);
+    }
+  }
+}
+
+int listenUnix(const char *path) {
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("stats socket");
+    return -1;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 4) == -1) {
+    perror("stats bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+}  // namespace
+
+Block *registerThread() {
+  void *mem;
+  std::lock_guard<std::mutex> lock(mu);
+  Block *block;
+  if (!spare.empty()) {
+    block = spare.back();
+    spare.pop_back();
+  } else if (posix_memalign(&mem, alignof(Block), sizeof(Block)) == 0) {
+    block = new (mem) Block;
+    clear(*block);
+  } else {
+    abort();
+  }
+  live.push_back(block);
+  registration.block = block;
+  tlsBlock = block;
+  return block;
+}
+
+void snapshot(uint64_t counters[NUM_COUNTERS], int64_t gauges[NUM_GAUGES]) {
+  std::lock_guard<std::mutex> lock(mu);
+  for (int i = 0; i < NUM_COUNTERS; ++i) {
+    counters[i] = retiredCounters[i];
+  }
+  for (int i = 0; i < NUM_GAUGES; ++i) {
+    gauges[i] = retiredGauges[i];
+  }
+  for (const Block *block : live) {
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+      counters[i] += block->counters[i].load(std::memory_order_relaxed);
+    }
+    for (int i = 0; i < NUM_GAUGES; ++i) {
+      gauges[i] += block->gauges[i].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+std::string format() {
+  uint64_t counters[NUM_COUNTERS];
+  int64_t gauges[NUM_GAUGES];
+  snapshot(counters, gauges);
+
+  std::string out;
+  for (int i = 0; i < NUM_COUNTERS; ++i) {
+    append(out, counterNames[i], int64_t(counters[i]));
+  }
+  if (counters[REQUESTS] > 0) {
+    append(out, "syscalls_per_request",
+           double(counters[SYSCALLS]) / counters[REQUESTS]);
+  }
+  for (int i = 0; i < NUM_GAUGES; ++i) {
+    append(out, gaugeNames[i], gauges[i]);
+  }
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    append(out, "user_s", tvDouble(usage.ru_utime));
+    append(out, "system_s", tvDouble(usage.ru_stime));
+    append(out, "minor_faults", int64_t(usage.ru_minflt));
+    append(out, "major_faults", int64_t(usage.ru_majflt));
+    append(out, "voluntary_switches", int64_t(usage.ru_nvcsw));
+    append(out, "involuntary_switches", int64_t(usage.ru_nivcsw));
+  }
+  std::vector<std::string (*)()> toRun;
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    toRun = reports;
+  }
+  for (const auto report : toRun) {
+    out += report();
+  }
+  return out;
+}
+
+void addReport(std::string (*report)()) {
+  std::lock_guard<std::mutex> lock(mu);
+  reports.push_back(report);
+}
+
+void start() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+    perror("stats sigmask");
+    return;
+  }
+  const int sigFd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (sigFd == -1) {
+    perror("stats signalfd");
+    return;
+  }
+  const char *path = getenv("STATS_SOCKET");
+  const int listenFd = path != nullptr ? listenUnix(path) : -1;
+  // The thread must not pick up signals another component handles later.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  std::thread(serveSocket, listenFd, sigFd).detach();
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+}  // namespace stats
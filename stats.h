@@ -0,0 +1,96 @@
+#ifndef STATS_H
+#define STATS_H
+/*
+  Runtime statistics shared by all servers.
+
+  Each thread that touches a counter gets its own cache-line aligned block and
+  is the only writer to it, so updates are plain relaxed load/store pairs on a
+  line no other thread writes. Readers sum all blocks.
+
+  start() installs the readers: SIGUSR1 dumps to stderr, and if $STATS_SOCKET
+  names a path, every connection to that Unix socket receives a dump, e.g.
+    socat - UNIX-CONNECT:$STATS_SOCKET
+*/
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+namespace stats {
+
+enum Counter {
+  REQUESTS,
+  BYTES,
+  // Syscalls issued on behalf of requests: recv, advice, send.
+  SYSCALLS,
+  PARTIAL_SENDS,
+  FADVISE,
+  MADVISE,
+  // Bytes given back to the page cache by drop-behind; see dropBehind.h.
+  DROPPED_BYTES,
+  // Bytes of holes sent as zero-run frames instead of data.
+  HOLE_BYTES,
+  // Bytes of delta transfers the client already had, sent as references.
+  REF_BYTES,
+  // Bytes written by write requests, and the fdatasync() calls that made
+  // them durable.
+  PUT_BYTES,
+  SYNCS,
+  // Ranges answered with an EXPIRED frame; see scheduler.h.
+  EXPIRED,
+  // Ranges cut short or skipped by cancellation, and the bytes left unsent.
+  CANCELLED,
+  CANCELLED_BYTES,
+  // Bytes of the file sent in compressed frames, and the frames' size.
+  COMPRESSED_BYTES,
+  COMPRESSED_WIRE_BYTES,
+  // Bytes of ranges made resident for local clients to read themselves.
+  LOCAL_BYTES,
+  NUM_COUNTERS
+};
+
+// Gauges are summed across threads like counters, so a queue's depth can be
+// raised by its producer and lowered by its consumer.
+enum Gauge { QUEUE_DEPTH, NUM_GAUGES };
+
+struct alignas(64) Block {
+  std::atomic<uint64_t> counters[NUM_COUNTERS];
+  std::atomic<int64_t> gauges[NUM_GAUGES];
+};
+
+extern thread_local Block *tlsBlock;
+Block *registerThread();
+
+inline Block &local() {
+  Block *block = tlsBlock;
+  return block != nullptr ? *block : *registerThread();
+}
+
+inline void add(Counter c, uint64_t n = 1) {
+  auto &v = local().counters[c];
+  v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void adjust(Gauge g, int64_t n) {
+  auto &v = local().gauges[g];
+  v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Sum of all threads, including ones that have exited.
+void snapshot(uint64_t counters[NUM_COUNTERS], int64_t gauges[NUM_GAUGES]);
+
+// Counters, gauges and process CPU/fault usage, one "name value" per line,
+// then the lines of each report added.
+std::string format();
+
+// Add `report` to every dump from here on, e.g. for statistics kept per
+// client rather than per thread.
+void addReport(std::string (*report)());
+
+// Call from main() before starting any other thread; blocks SIGUSR1 so only
+// the stats thread sees it.
+void start();
+
+}  // namespace stats
+#endif
@@ -0,0 +1,230 @@
+#include "trace.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace trace {
+
+uint32_t sampleEvery = 0;
+thread_local uint32_t untilSample = 1;
+
+namespace {
+
+constexpr size_t RING_SIZE = 4096;
+
+const char *const stageNames[NUM_STAGES] = {
+    "received", "verified", "advised",  "enqueued",
+    "dequeued", "send start", "send done",
+};
+
+struct Event {
+  uint64_t id;
+  uint64_t ns;
+  uint32_t tid;
+  Stage stage;
+};
+
+/* Single-writer ring. The writer fills a slot and then publishes it by
+   advancing `head`. A reader copies the newest RING_SIZE slots and then
+   rereads `head`; any slot the writer may have reused meanwhile is dropped.
+   Slot fields are relaxed atomics so those racing copies are well defined.
+
+   Once its thread exits, a ring is retired and the next thread to record
+   takes it over, carrying on from `head`, so the old thread's events are
+   dumped until they're overwritten and there are only as many rings as
+   threads that have recorded at once.
+*/
+struct Ring {
+  std::atomic<uint64_t> head{0};
+  std::atomic<bool> retired{false};
+  std::atomic<uint64_t> ids[RING_SIZE];
+  std::atomic<uint64_t> times[RING_SIZE];
+  std::atomic<uint32_t> tids[RING_SIZE];
+  std::atomic<uint8_t> stages[RING_SIZE];
+};
+
+std::atomic<uint64_t> lastId{0};
+std::mutex mu;
+std::vector<Ring *> rings;
+thread_local Ring *tlsRing = nullptr;
+thread_local uint32_t tlsTid = 0;
+
+struct Registration {
+  Ring *ring = nullptr;
+  ~Registration() {
+    if (ring != nullptr) {
+      ring->retired.store(true, std::memory_order_release);
+    }
+  }
+};
+thread_local Registration registration;
+
+Ring *registerThread() {
+  std::lock_guard<std::mutex> lock(mu);
+  Ring *ring = nullptr;
+  for (Ring *r : rings) {
+    if (r->retired.load(std::memory_order_acquire)) {
+      ring = r;
+      ring->retired.store(false, std::memory_order_relaxed);
+      break;
+    }
+  }
+  if (ring == nullptr) {
+    ring = new Ring();
+    rings.push_back(ring);
+  }
+  registration.ring = ring;
+  tlsRing = ring;
+  tlsTid = syscall(SYS_gettid);
+  return ring;
+}
+
+void copyRing(const Ring &ring, std::vector<Event> &events) {
+  const size_t first = events.size();
+  const uint64_t head = ring.head.load(std::memory_order_acquire);
+  const uint64_t begin = head > RING_SIZE ? head - RING_SIZE : 0;
+  for (uint64_t i = begin; i < head; ++i) {
+    const size_t slot = i % RING_SIZE;
+    events.push_back(
+        Event{ring.ids[slot].load(std::memory_order_relaxed),
+              ring.times[slot].load(std::memory_order_relaxed),
+              ring.tids[slot].load(std::memory_order_relaxed),
+              Stage(ring.stages[slot].load(std::memory_order_relaxed))});
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const uint64_t newHead = ring.head.load(std::memory_order_relaxed);
+  // Slot i is rewritten by the writer of event i + RING_SIZE.
+  const uint64_t safe = newHead >= RING_SIZE ? newHead - RING_SIZE + 1 : 0;
+  if (safe > begin) {
+    const size_t overwritten = std::min<uint64_t>(safe - begin, head - begin);
+    events.erase(events.begin() + first,
+                 events.begin() + first + overwritten);
+  }
+}
+
+void appendEvent(std::string &out, const char *ph, const char *name,
+                 const Event &event) {
+  char line[256];
+  snprintf(line, sizeof(line),
+           "%s{\"name\":\"%s\",\"cat\":\"req\",\"ph\":\"%s\",\"id\":%" PRIu64
+           ",\"pid\":%d,\"tid\":%" PRIu32 ",\"ts\":%.3f}",
+           out.size() > 1 ? ",\n" : "", name, ph, event.id, getpid(),
+           event.tid, event.ns / 1000.0);
+  out += line;
+}
+
+void dump(const char *path) {
+  const std::string json = chromeJson();
+  FILE *f = fopen(path, "w");
+  if (f == nullptr) {
+    perror("trace fopen");
+    return;
+  }
+  fwrite(json.data(), 1, json.size(), f);
+  fclose(f);
+  fprintf(stderr, "wrote trace to %s\n", path);
+}
+
+void serveSignals(int sigFd, std::string path) {
+  while (true) {
+    struct signalfd_siginfo info;
+    if (read(sigFd, &info, sizeof(info)) != sizeof(info)) {
+      perror("trace signalfd");
+      return;
+    }
+    dump(path.c_str());
+  }
+}
+
+}  // namespace
+
+uint64_t nextId() { return ++lastId; }
+
+void recordSlow(uint64_t id, Stage stage) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  Ring *ring = tlsRing != nullptr ? tlsRing : registerThread();
+  const uint64_t head = ring->head.load(std::memory_order_relaxed);
+  const size_t slot = head % RING_SIZE;
+  ring->ids[slot].store(id, std::memory_order_relaxed);
+  ring->times[slot].store(ts.tv_sec * 1000000000ull + ts.tv_nsec,
+                          std::memory_order_relaxed);
+  ring->tids[slot].store(tlsTid, std::memory_order_relaxed);
+  ring->stages[slot].store(stage, std::memory_order_relaxed);
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::string chromeJson() {
+  std::vector<Event> events;
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    for (const Ring *ring : rings) {
+      copyRing(*ring, events);
+    }
+  }
+  std::sort(events.begin(), events.end(),
+            [](const Event &a, const Event &b) {
+              return a.id != b.id ? a.id < b.id : a.ns < b.ns;
+            });
+
+  // Each request is an async slice spanning its first to last recorded stage,
+  // with an instant event per stage.
+  std::string out = "[";
+  for (size_t i = 0; i < events.size(); ++i) {
+    const Event &event = events[i];
+    const bool first = i == 0 || events[i - 1].id != event.id;
+    const bool last = i + 1 == events.size() || events[i + 1].id != event.id;
+    if (first) {
+      appendEvent(out, "b", "request", event);
+    }
+    appendEvent(out, "n", stageNames[event.stage], event);
+    if (last) {
+      appendEvent(out, "e", "request", event);
+    }
+  }
+  out += "]\n";
+  return out;
+}
+
+void start() {
+  const char *every = getenv("TRACE_SAMPLE");
+  if (every == nullptr || (sampleEvery = strtoul(every, nullptr, 0)) == 0) {
+    return;
+  }
+  const char *path = getenv("TRACE_FILE");
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR2);
+  if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+    perror("trace sigmask");
+    return;
+  }
+  const int sigFd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (sigFd == -1) {
+    perror("trace signalfd");
+    return;
+  }
+  fprintf(stderr, "tracing 1 in %" PRIu32 " requests\n", sampleEvery);
+  // The thread must not pick up signals another component handles later.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  std::thread(serveSignals, sigFd,
+              std::string(path != nullptr ? path : "trace.json"))
+      .detach();
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+}  // namespace trace
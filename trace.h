@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H
+/*
+  Sampled per-request lifecycle tracing.
+
+  With $TRACE_SAMPLE=N, one request in N gets a nonzero trace id, and each
+  stage it passes through is timestamped into a ring owned by the recording
+  thread. Untraced requests cost one thread-local decrement. On SIGUSR2 the
+  rings are written to $TRACE_FILE (default trace.json) in Chrome trace event
+  format, loadable in chrome://tracing or Perfetto.
+*/
+
+#include <stdint.h>
+
+#include <string>
+
+namespace trace {
+
+enum Stage : uint8_t {
+  RECEIVED,
+  VERIFIED,
+  ADVISED,
+  ENQUEUED,
+  DEQUEUED,
+  SEND_START,
+  SEND_DONE,
+  NUM_STAGES
+};
+
+extern uint32_t sampleEvery;
+extern thread_local uint32_t untilSample;
+uint64_t nextId();
+
+// Trace id for a newly received request, or 0 if it is not sampled.
+inline uint64_t sample() {
+  if (sampleEvery == 0 || --untilSample != 0) {
+    return 0;
+  }
+  untilSample = sampleEvery;
+  return nextId();
+}
+
+void recordSlow(uint64_t id, Stage stage);
+
+inline void record(uint64_t id, Stage stage) {
+  if (id != 0) {
+    recordSlow(id, stage);
+  }
+}
+
+// All events still in the rings, as Chrome trace JSON.
+std::string chromeJson();
+
+// Reads $TRACE_SAMPLE and, if tracing is on, starts the SIGUSR2 dump thread.
+// Call from main() before starting any other thread.
+void start();
+
+}  // namespace trace
+#endif
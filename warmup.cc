@@ -0,0 +1,285 @@
+#include "warmup.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace warmup {
+
+namespace {
+
+const size_t PAGE = sysconf(_SC_PAGESIZE);
+// Pages a warm-up thread claims at a time; also the largest single advice.
+constexpr size_t CHUNK_PAGES = 512;
+// Residency is checked every CHECK_MS; progress is reported once a second.
+constexpr int CHECK_MS = 100;
+// Give up waiting for prefetched pages once residency stops growing this long.
+constexpr int SETTLE_MS = 5000;
+
+const char MAGIC[8] = "HOTSET1";
+
+struct Header {
+  char magic[8];
+  uint64_t fileSize;
+  uint64_t pageSize;
+};
+
+size_t numPages(size_t size) { return (size + PAGE - 1) / PAGE; }
+
+bool isSet(const std::vector<uint8_t> &bitmap, size_t page) {
+  return bitmap[page / 8] & (1 << (page % 8));
+}
+
+std::vector<uint8_t> residency(const void *map, size_t size) {
+  std::vector<uint8_t> vec(numPages(size));
+  if (mincore(const_cast<void *>(map), size, vec.data()) == -1) {
+    perror("mincore");
+    vec.clear();
+  }
+  return vec;
+}
+
+uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct Warmup {
+  std::vector<uint8_t> bitmap;
+  uint8_t *map;
+  size_t size;
+  size_t rate;
+  size_t hotPages = 0;
+  // Next chunk to claim, in pages.
+  std::atomic<size_t> cursor{0};
+  std::atomic<size_t> issuedPages{0};
+  // Earliest time the rate limit lets the next advice go out.
+  std::atomic<uint64_t> nextNs{0};
+};
+
+// Wait until the rate limit allows `bytes` more.
+void pace(Warmup &w, size_t bytes) {
+  if (w.rate == 0) {
+    return;
+  }
+  const uint64_t cost = bytes * 1000000000ull / w.rate;
+  const uint64_t now = nowNs();
+  uint64_t next = w.nextNs.load();
+  uint64_t start;
+  do {
+    start = std::max(next, now);
+  } while (!w.nextNs.compare_exchange_weak(next, start + cost));
+  if (start > now) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(start - now));
+  }
+}
+
+void advise(Warmup &w, size_t first, size_t count) {
+  const size_t offset = first * PAGE;
+  const size_t len = std::min(count * PAGE, w.size - offset);
+  pace(w, len);
+  if (madvise(w.map + offset, len, MADV_WILLNEED) == -1) {
+    perror("warm-up madvise");
+  }
+  w.issuedPages += count;
+}
+
+void t_warm(Warmup &w) {
+  const size_t pages = numPages(w.size);
+  while (true) {
+    const size_t chunk = w.cursor.fetch_add(CHUNK_PAGES);
+    if (chunk >= pages) {
+      return;
+    }
+    const size_t end = std::min(chunk + CHUNK_PAGES, pages);
+    // One advice per run of hot pages.
+    size_t run = 0;
+    for (size_t page = chunk; page < end; ++page) {
+      if (isSet(w.bitmap, page)) {
+        run++;
+      } else if (run > 0) {
+        advise(w, page - run, run);
+        run = 0;
+      }
+    }
+    if (run > 0) {
+      advise(w, end - run, run);
+    }
+  }
+}
+
+size_t residentHotPages(const Warmup &w) {
+  const auto vec = residency(w.map, w.size);
+  size_t resident = 0;
+  for (size_t page = 0; page < vec.size(); ++page) {
+    if ((vec[page] & 1) && isSet(w.bitmap, page)) {
+      resident++;
+    }
+  }
+  return resident;
+}
+
+double mib(size_t pages) { return pages * PAGE / 1024.0 / 1024.0; }
+
+void t_report(Warmup *w, unsigned threads) {
+  const uint64_t start = nowNs();
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < threads; ++i) {
+    workers.emplace_back(t_warm, std::ref(*w));
+  }
+  // Report until every hot page is resident, or residency stops growing
+  // after all advice has been issued.
+  size_t resident = 0;
+  int stalledMs = 0;
+  for (int ms = CHECK_MS; resident < w->hotPages && stalledMs < SETTLE_MS;
+       ms += CHECK_MS) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(CHECK_MS));
+    const size_t issued = w->issuedPages;
+    const size_t now = residentHotPages(*w);
+    stalledMs = issued == w->hotPages && now <= resident ? stalledMs + CHECK_MS
+                                                         : 0;
+    resident = now;
+    if (ms % 1000 == 0) {
+      fprintf(stderr, "warm-up: issued %.1f MiB, %.1f of %.1f MiB resident\n",
+              mib(issued), mib(resident), mib(w->hotPages));
+    }
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  fprintf(stderr, "warm-up: %.1f of %.1f MiB resident after %fs\n",
+          mib(resident), mib(w->hotPages), (nowNs() - start) / 1e9);
+  delete w;
+}
+
+void t_keep(int sigFd, std::string path, const void *map, size_t size,
+            unsigned interval) {
+  struct pollfd pfd;
+  pfd.fd = sigFd;
+  pfd.events = POLLIN;
+  const int timeout = interval > 0 ? int(interval) * 1000 : -1;
+  while (true) {
+    const int ready = poll(&pfd, 1, timeout);
+    if (ready == -1) {
+      perror("hot set poll");
+      return;
+    }
+    save(path.c_str(), map, size);
+    if (ready > 0) {
+      struct signalfd_siginfo info;
+      if (read(sigFd, &info, sizeof(info)) == sizeof(info)) {
+        fprintf(stderr, "exiting on signal %u\n", info.ssi_signo);
+      }
+      exit(0);
+    }
+  }
+}
+
+}  // namespace
+
+bool save(const char *path, const void *map, size_t size) {
+  const auto vec = residency(map, size);
+  if (vec.empty()) {
+    return false;
+  }
+  std::vector<uint8_t> bitmap((vec.size() + 7) / 8);
+  for (size_t page = 0; page < vec.size(); ++page) {
+    if (vec[page] & 1) {
+      bitmap[page / 8] |= 1 << (page % 8);
+    }
+  }
+  Header header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.fileSize = size;
+  header.pageSize = PAGE;
+
+  // Write a new file and rename it over the old one so a crash mid-save
+  // leaves the previous hot set intact.
+  const std::string tmp = std::string(path) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (f == nullptr) {
+    perror("hot set fopen");
+    return false;
+  }
+  const bool written =
+      fwrite(&header, sizeof(header), 1, f) == 1 &&
+      fwrite(bitmap.data(), 1, bitmap.size(), f) == bitmap.size();
+  if (fclose(f) != 0 || !written || rename(tmp.c_str(), path) == -1) {
+    perror("hot set write");
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+void warm(const char *path, void *map, size_t size, unsigned threads,
+          size_t rate) {
+  FILE *f = fopen(path, "r");
+  if (f == nullptr) {
+    fprintf(stderr, "no hot set at %s; starting cold\n", path);
+    return;
+  }
+  Header header;
+  Warmup *w = new Warmup();
+  w->bitmap.resize((numPages(size) + 7) / 8);
+  const bool valid =
+      fread(&header, sizeof(header), 1, f) == 1 &&
+      memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+      header.fileSize == size && header.pageSize == PAGE &&
+      fread(w->bitmap.data(), 1, w->bitmap.size(), f) == w->bitmap.size();
+  fclose(f);
+  if (!valid) {
+    fprintf(stderr, "hot set %s doesn't match this file; starting cold\n",
+            path);
+    delete w;
+    return;
+  }
+  w->map = static_cast<uint8_t *>(map);
+  w->size = size;
+  w->rate = rate;
+  for (size_t page = 0; page < numPages(size); ++page) {
+    w->hotPages += isSet(w->bitmap, page);
+  }
+  fprintf(stderr, "warming %.1f MiB with %u threads\n", mib(w->hotPages),
+          threads);
+  std::thread(t_report, w, std::max(threads, 1u)).detach();
+}
+
+void keep(const char *path, const void *map, size_t size, unsigned interval) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+    perror("hot set sigmask");
+    return;
+  }
+  const int sigFd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (sigFd == -1) {
+    perror("hot set signalfd");
+    return;
+  }
+  // The thread must not pick up signals another component handles later.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  std::thread(t_keep, sigFd, std::string(path), map, size, interval).detach();
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+}  // namespace warmup
@@ -0,0 +1,34 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+/*
+  Hot-set snapshots and page cache warm-up for a mapped file.
+
+  A hot set is a bitmap of the file's pages that were resident in the page
+  cache, taken with mincore(). keep() saves one periodically and on SIGTERM or
+  SIGINT. After a restart, warm() prefetches the saved pages with
+  MADV_WILLNEED from several threads while the server is already accepting
+  connections. Progress goes to stderr once a second, ending with the time it
+  took to warm.
+*/
+
+#include <stddef.h>
+
+namespace warmup {
+
+// Write the pages of `map` that are resident to `path`. Returns false on
+// error, having reported it.
+bool save(const char *path, const void *map, size_t size);
+
+// Prefetch the pages listed in `path` in the background with `threads`
+// threads, issuing at most `rate` bytes per second (0 for no limit). Does
+// nothing if there is no hot set or it was saved for a different file size.
+void warm(const char *path, void *map, size_t size, unsigned threads,
+          size_t rate);
+
+// Save the hot set to `path` every `interval` seconds (0 for never) and on
+// SIGTERM or SIGINT, then exit. Call from main() before starting any other
+// thread.
+void keep(const char *path, const void *map, size_t size, unsigned interval);
+
+}  // namespace warmup
+#endif
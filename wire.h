@@ -1,15 +1,486 @@
 #ifndef WIRE_H
+#define WIRE_H
 
+#include <endian.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <array>
+#include <cinttypes>
+#include <vector>
+
+#include "compression.h"
+#include "io.h"
+#include "log.h"
 #include "req_generated.h"
-/* TODO: need a wire-compatible serialization scheme.
-   Flatbuffers?
-*/
 
 using Req = Server::Req;
 
 struct LReq {
   int64_t offset;
+  uint64_t size;
+  uint32_t flags;
+  // Nonzero if the request is being traced; see trace.h.
+  uint64_t trace;
+  // Scheduling, from Req: the client's id for the request, or 0 to keep it
+  // in order; its priority class; and the microseconds sending it may wait
+  // after receipt, or 0 for no deadline. See scheduler.h.
+  uint32_t id;
+  uint32_t priority;
+  uint32_t deadlineUs;
+};
+
+// LReq flags.
+// Part of a bulk transfer; see DropPolicy in dropBehind.h.
+constexpr uint32_t LREQ_BULK = 1;
+// The response is a sequence of frames; see Frame.
+constexpr uint32_t LREQ_SPARSE = 2;
+// A delta request; see Req.delta. Flatbuffers only.
+constexpr uint32_t LREQ_DELTA = 4;
+// A write request; see Req.put. Flatbuffers only.
+constexpr uint32_t LREQ_PUT = 8;
+// Cancels request `id`; see Req.cancel. Flatbuffers only.
+constexpr uint32_t LREQ_CANCEL = 16;
+// Flags a client may set in a fixed frame.
+constexpr uint32_t LREQ_FLAGS = LREQ_BULK | LREQ_SPARSE;
+// Set by servers on the steps of a delta plan, each sent as one frame:
+// a range of the file as a DATA frame,
+constexpr uint32_t LREQ_CHUNK_DATA = 1 << 8;
+// a REF frame to the client's chunk at index `offset`,
+constexpr uint32_t LREQ_CHUNK_REF = 1 << 9;
+// or the END frame.
+constexpr uint32_t LREQ_DELTA_END = 1 << 10;
+// Set by servers on the response to a write request: a STORED frame for
+// `size` bytes,
+constexpr uint32_t LREQ_STORED = 1 << 11;
+// or a REJECTED frame.
+constexpr uint32_t LREQ_REJECTED = 1 << 12;
+// Set by schedulers on a range whose deadline passed before it was sent, to
+// be answered with an EXPIRED frame.
+constexpr uint32_t LREQ_EXPIRED = 1 << 13;
+
+// Queued by a receiver after a connection's last request.
+constexpr LReq END_OF_REQUESTS = {.offset = -1, .size = 0};
+
+// Whether `lreq` lies within a file of `filesize` bytes, without overflow
+// for any offset and size a client can send.
+inline bool inFile(const LReq &lreq, uint64_t filesize) {
+  return uint64_t(lreq.offset) <= filesize &&
+         lreq.size <= filesize - uint64_t(lreq.offset);
+}
+
+// Expand `req` into the ranges it asks for, in response order.
+inline void unpackReq(const Req &req, std::vector<LReq> &lreqs,
+                      uint64_t trace = 0) {
+  lreqs.clear();
+  const uint32_t flags = (req.bulk() ? LREQ_BULK : 0) |
+                         (req.sparse() ? LREQ_SPARSE : 0) |
+                         (req.delta() ? LREQ_DELTA : 0) |
+                         (req.put() ? LREQ_PUT : 0) |
+                         (req.cancel() ? LREQ_CANCEL : 0);
+  const auto *ranges = req.ranges();
+  const uint64_t size = req.size64() != 0 ? req.size64() : req.size();
+  if (req.delta() || req.put() || req.cancel()) {
+    lreqs.push_back(LReq{.offset = req.offset(),
+                         .size = size,
+                         .flags = flags,
+                         .trace = trace,
+                         .id = req.id()});
+    return;
+  }
+  const LReq scheduled = {.flags = flags,
+                          .trace = trace,
+                          .id = req.id(),
+                          .priority = req.priority(),
+                          .deadlineUs = req.deadline_us()};
+  if (ranges == nullptr) {
+    lreqs.push_back(scheduled);
+    lreqs.back().offset = req.offset();
+    lreqs.back().size = size;
+    return;
+  }
+  for (flatbuffers::uoffset_t i = 0; i < ranges->size(); ++i) {
+    const auto *range = ranges->Get(i);
+    lreqs.push_back(scheduled);
+    lreqs.back().offset = range->offset();
+    lreqs.back().size = range->size();
+  }
+}
+
+/* Request codecs, used as policy parameters of the servers' receive loops and
+   the client's request loop. A server calls receive() to get the next
+   message off the socket and decode() to validate and expand it; both
+   return false once the connection should end, having reported why. A
+   client calls encode() for each request; it returns empty Bytes for one
+   the codec can't carry.
+
+   Connections use FlatbufferCodec unless the client opens with
+   FIXED_CODEC_MAGIC and the server echoes it back (see acceptCodec()).
+*/
+
+struct Bytes {
+  const uint8_t *data;
+  size_t size;
+};
+
+// Size-prefixed flatbuffers Req; the original format.
+class FlatbufferCodec {
+ public:
+  bool receive(int sock_fd) {
+    using flatbuffers::uoffset_t;
+    // read the size field
+    std::array<uint8_t, sizeof(uoffset_t)> msgSizeBuf;
+    ssize_t bytesRead = recvFull(sock_fd, msgSizeBuf.data(), msgSizeBuf.size(),
+                                 MSG_PEEK, &syscalls);
+    if (bytesRead == 0) {
+      DLOG("connection closed\n");
+      return false;
+    } else if (bytesRead == -1) {
+      perror("recv");
+      return false;
+    } else if (size_t(bytesRead) != msgSizeBuf.size()) {
+      fprintf(stderr, "partial recv; expected %zd, got %zd\n",
+              msgSizeBuf.size(), bytesRead);
+      return false;
+    }
+    const uoffset_t msgSize =
+        flatbuffers::ReadScalar<uoffset_t>(msgSizeBuf.data());
+    DLOG("incoming message size: %d (not including %zd-byte prefix)\n",
+         msgSize, sizeof(uoffset_t));
+    const size_t totalSize = msgSize + sizeof(uoffset_t);
+    DLOG("receiving %zd bytes (including %zd-byte prefix)\n", totalSize,
+         sizeof(uoffset_t));
+    buf.resize(totalSize);
+    bytesRead = recvFull(sock_fd, &buf[0], buf.size(), 0, &syscalls);
+    if (bytesRead == -1) {
+      perror("recv");
+      return false;
+    } else if (size_t(bytesRead) != buf.size()) {
+      fprintf(stderr, "partial recv\n");
+      return false;
+    }
+    return true;
+  }
+
+  bool decode(std::vector<LReq> &lreqs, uint64_t trace) {
+    flatbuffers::Verifier verifier(buf.data(), buf.size());
+    if (!Server::VerifySizePrefixedReqBuffer(verifier)) {
+      fprintf(stderr, "invalid flatbuffer\n");
+      return false;
+    }
+    const Req *req = Server::GetSizePrefixedReq(buf.data());
+    unpackReq(*req, lreqs, trace);
+    const auto *have = req->have();
+    haveHashes = have != nullptr ? Bytes{have->data(), have->size()}
+                                 : Bytes{nullptr, 0};
+    putCrc = req->crc();
+    return true;
+  }
+
+  // The `have` hashes of the last decoded delta request; valid until the next
+  // receive().
+  Bytes have() const { return haveHashes; }
+
+  // The payload CRC of the last decoded write request.
+  uint32_t crc() const { return putCrc; }
+
+  // Flags and scheduling are per request, so they are taken from the first
+  // range. Only a single range may be 4 GiB or more; a request with a larger
+  // gather range is refused with empty Bytes.
+  Bytes encode(const std::vector<LReq> &lreqs) {
+    fbb.Clear();
+    const LReq &first = lreqs[0];
+    const bool bulk = first.flags & LREQ_BULK;
+    const bool sparse = first.flags & LREQ_SPARSE;
+    if (lreqs.size() == 1) {
+      const bool large = first.size > UINT32_MAX;
+      fbb.FinishSizePrefixed(Server::CreateReq(
+          fbb, first.offset, large ? 0 : uint32_t(first.size), 0, bulk,
+          sparse, false, 0, false, 0, first.id, first.priority,
+          first.deadlineUs, false, large ? first.size : 0));
+    } else {
+      ranges.clear();
+      for (const auto &lreq : lreqs) {
+        if (lreq.size > UINT32_MAX) {
+          return Bytes{nullptr, 0};
+        }
+        ranges.push_back(Server::Range(lreq.offset, lreq.size));
+      }
+      auto rangesOffset = fbb.CreateVectorOfStructs(ranges);
+      fbb.FinishSizePrefixed(Server::CreateReq(
+          fbb, 0, 0, rangesOffset, bulk, sparse, false, 0, false, 0,
+          first.id, first.priority, first.deadlineUs));
+    }
+    return Bytes{fbb.GetBufferPointer(), fbb.GetSize()};
+  }
+
+  Bytes encodeDelta(Bytes have, uint32_t flags) {
+    fbb.Clear();
+    auto haveOffset = fbb.CreateVector(have.data, have.size);
+    fbb.FinishSizePrefixed(Server::CreateReq(
+        fbb, 0, 0, 0, flags & LREQ_BULK, flags & LREQ_SPARSE, true,
+        haveOffset));
+    return Bytes{fbb.GetBufferPointer(), fbb.GetSize()};
+  }
+
+  // The caller sends the payload after the message.
+  Bytes encodePut(int64_t offset, uint32_t size, uint32_t crc) {
+    fbb.Clear();
+    fbb.FinishSizePrefixed(Server::CreateReq(fbb, offset, size, 0, false,
+                                             false, false, 0, true, crc));
+    return Bytes{fbb.GetBufferPointer(), fbb.GetSize()};
+  }
+
+  Bytes encodeCancel(uint32_t id) {
+    fbb.Clear();
+    fbb.FinishSizePrefixed(Server::CreateReq(fbb, 0, 0, 0, false, false,
+                                             false, 0, false, 0, id, 0, 0,
+                                             true));
+    return Bytes{fbb.GetBufferPointer(), fbb.GetSize()};
+  }
+
+  // Syscalls made by receive() since the caller last cleared this.
+  uint64_t syscalls = 0;
+
+ private:
+  std::vector<uint8_t> buf;
+  Bytes haveHashes{nullptr, 0};
+  uint32_t putCrc = 0;
+  flatbuffers::FlatBufferBuilder fbb;
+  std::vector<Server::Range> ranges;
+};
+
+constexpr uint32_t FIXED_CODEC_MAGIC = 0x5145524c;  // "LREQ"
+constexpr uint32_t COMPRESS_MAGIC = 0x5145525a;  // "ZREQ"
+
+/* Fixed 16-byte little-endian frame: int64 offset, uint32 size, uint32 LReq
+   flags (other bits are reserved and must be zero). One frame is one range,
+   of under 4 GiB; a gather request is sent as consecutive frames, which
+   yields the same back-to-back response.
+   receive() reads as many frames as the socket has ready, so a pipelining
+   client costs well under one recv() per request.
+*/
+class FixedCodec {
+ public:
+  static constexpr size_t FRAME_SIZE = 16;
+
+  bool receive(int sock_fd) {
+    while (end - begin < FRAME_SIZE) {
+      if (begin > 0) {
+        memmove(buf.data(), buf.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+      }
+      const ssize_t bytesRead = retryIo(sock_fd, POLLIN, [&]() {
+        syscalls++;
+        return recv(sock_fd, buf.data() + end, buf.size() - end, 0);
+      });
+      if (bytesRead == 0) {
+        if (end > 0) {
+          fprintf(stderr, "partial frame at end of stream\n");
+        }
+        return false;
+      } else if (bytesRead == -1) {
+        perror("recv");
+        return false;
+      }
+      end += bytesRead;
+    }
+    return true;
+  }
+
+  bool decode(std::vector<LReq> &lreqs, uint64_t trace) {
+    uint64_t offset;
+    uint32_t size, flags;
+    memcpy(&offset, &buf[begin], sizeof(offset));
+    memcpy(&size, &buf[begin + 8], sizeof(size));
+    memcpy(&flags, &buf[begin + 12], sizeof(flags));
+    begin += FRAME_SIZE;
+    flags = le32toh(flags);
+    if (flags & ~LREQ_FLAGS) {
+      fprintf(stderr, "unsupported frame flags 0x%" PRIx32 "\n", flags);
+      return false;
+    }
+    lreqs.clear();
+    lreqs.push_back(LReq{.offset = int64_t(le64toh(offset)),
+                         .size = le32toh(size),
+                         .flags = flags,
+                         .trace = trace});
+    return true;
+  }
+
+  // Frames carry 32-bit sizes, so a request with a range of 4 GiB or more is
+  // refused with empty Bytes.
+  Bytes encode(const std::vector<LReq> &lreqs) {
+    out.resize(lreqs.size() * FRAME_SIZE);
+    uint8_t *frame = out.data();
+    for (const auto &lreq : lreqs) {
+      if (lreq.size > UINT32_MAX) {
+        return Bytes{nullptr, 0};
+      }
+      const uint64_t offset = htole64(lreq.offset);
+      const uint32_t size = htole32(uint32_t(lreq.size));
+      const uint32_t flags = htole32(lreq.flags);
+      memcpy(frame, &offset, sizeof(offset));
+      memcpy(frame + 8, &size, sizeof(size));
+      memcpy(frame + 12, &flags, sizeof(flags));
+      frame += FRAME_SIZE;
+    }
+    return Bytes{out.data(), out.size()};
+  }
+
+  // Fixed frames can't carry delta or write requests.
+  Bytes have() const { return Bytes{nullptr, 0}; }
+  uint32_t crc() const { return 0; }
+
+  uint64_t syscalls = 0;
+
+ private:
+  std::array<uint8_t, FRAME_SIZE * 64> buf;
+  size_t begin = 0;
+  size_t end = 0;
+  std::vector<uint8_t> out;
+};
+
+/* Framed responses. Each frame starts with a little-endian uint32 kind and
+   uint32 size. A DATA frame is followed by that many bytes of the file; a
+   ZEROS frame stands for that many zero bytes, a hole in the file.
+
+   The response to an LREQ_SPARSE range is DATA and ZEROS frames whose sizes
+   add up to the range's size. The response to a delta request is DATA frames
+   and REF frames, whose size is instead the index of one of the request's
+   `have` hashes, in file order, then an END frame of size 0.
+
+   The response to a write request is a single frame of the request's size:
+   STORED once the range is durable, or REJECTED if the payload didn't match
+   its CRC or couldn't be written, in which case the range's contents are
+   undefined until it is written again.
+
+   The response to each range of a request with an id starts with an ID
+   frame, whose size is instead the id. Then come the range's DATA frames, or
+   DATA and ZEROS frames if it is sparse, at most MAX_SCHEDULED_FRAME bytes
+   each. An EXPIRED frame instead if its deadline passed first, or a
+   CANCELLED frame once the request is cancelled, ends the range early; both
+   have size 0.
+
+   Ranges of 4 GiB or more take several DATA or ZEROS frames.
+
+   On a connection with compression (see acceptCompression()), every read's
+   response is framed, as if it were sparse, and its data may also come as
+   COMPRESSED frames. One holds the whole COMPRESS_BLOCK-aligned block the
+   range's next byte is in, compressed on its own; the range takes its part
+   of the block, up to the block's end or its own. So a frame's size is
+   compressed bytes, fewer than the range takes from it.
+*/
+struct Frame {
+  enum Kind : uint32_t {
+    DATA = 0,
+    ZEROS = 1,
+    REF = 2,
+    END = 3,
+    STORED = 4,
+    REJECTED = 5,
+    ID = 6,
+    EXPIRED = 7,
+    CANCELLED = 8,
+    COMPRESSED = 9
+  };
+  static constexpr size_t HEADER_SIZE = 8;
+
+  Kind kind;
   uint32_t size;
+
+  void encode(uint8_t header[HEADER_SIZE]) const {
+    const uint32_t le[2] = {htole32(kind), htole32(size)};
+    memcpy(header, le, HEADER_SIZE);
+  }
+
+  // Returns false for an unknown kind.
+  bool decode(const uint8_t header[HEADER_SIZE]) {
+    uint32_t le[2];
+    memcpy(le, header, HEADER_SIZE);
+    kind = Kind(le32toh(le[0]));
+    size = le32toh(le[1]);
+    return kind <= COMPRESSED;
+  }
 };
 
+// Largest DATA or ZEROS frame of a response to a request with an id, and so
+// how much of a range is sent after it's cancelled.
+constexpr uint32_t MAX_SCHEDULED_FRAME = 1024 * 1024;
+
+enum class CodecKind { FLATBUFFERS, FIXED };
+
+// Server side of codec negotiation; call before any response is sent.
+// Returns false if the connection closed first.
+inline bool acceptCodec(int sock_fd, CodecKind &kind) {
+  uint32_t magic;
+  const ssize_t bytesRead =
+      recvFull(sock_fd, &magic, sizeof(magic), MSG_PEEK);
+  if (bytesRead != sizeof(magic)) {
+    return false;
+  }
+  kind = CodecKind::FLATBUFFERS;
+  if (le32toh(magic) != FIXED_CODEC_MAGIC) {
+    return true;
+  }
+  kind = CodecKind::FIXED;
+  // Consume the magic and echo it back as the acceptance.
+  return recvFull(sock_fd, &magic, sizeof(magic)) == sizeof(magic) &&
+         sendFull(sock_fd, &magic, sizeof(magic));
+}
+
+// Server side of compression negotiation; call before acceptCodec(). A client
+// that wants compression opens with COMPRESS_MAGIC and the algorithm; the
+// server answers with the magic and the algorithm it accepts, which is
+// NONE unless `enabled`. Leaves `compression` NONE if not asked. Returns
+// false if the connection closed first.
+inline bool acceptCompression(int sock_fd, bool enabled,
+                              Compression &compression) {
+  compression = Compression::NONE;
+  uint32_t hello[2];
+  const ssize_t bytesRead =
+      recvFull(sock_fd, hello, sizeof(hello[0]), MSG_PEEK);
+  if (bytesRead != sizeof(hello[0])) {
+    return false;
+  } else if (le32toh(hello[0]) != COMPRESS_MAGIC) {
+    return true;
+  } else if (recvFull(sock_fd, hello, sizeof(hello)) != sizeof(hello)) {
+    return false;
+  }
+  const Compression asked = Compression(le32toh(hello[1]));
+  if (enabled &&
+      (asked == Compression::LZ4 || asked == Compression::ZSTD)) {
+    compression = asked;
+  }
+  hello[1] = htole32(uint32_t(compression));
+  return sendFull(sock_fd, hello, sizeof(hello));
+}
+
+// Client side; only for servers that support compression, as for
+// requestFixedCodec(). Sets `compression` to what the server accepted.
+inline bool requestCompression(int sock_fd, Compression &compression) {
+  uint32_t hello[2] = {htole32(COMPRESS_MAGIC),
+                       htole32(uint32_t(compression))};
+  if (send(sock_fd, hello, sizeof(hello), 0) != sizeof(hello) ||
+      recv(sock_fd, hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+      le32toh(hello[0]) != COMPRESS_MAGIC) {
+    return false;
+  }
+  compression = Compression(le32toh(hello[1]));
+  return true;
+}
+
+// Client side; only for servers that support FixedCodec, as older ones would
+// read the magic as the size of a huge flatbuffer.
+inline bool requestFixedCodec(int sock_fd) {
+  uint32_t magic = htole32(FIXED_CODEC_MAGIC);
+  if (send(sock_fd, &magic, sizeof(magic), 0) != sizeof(magic) ||
+      recv(sock_fd, &magic, sizeof(magic), MSG_WAITALL) != sizeof(magic)) {
+    return false;
+  }
+  return le32toh(magic) == FIXED_CODEC_MAGIC;
+}
+
 #endif